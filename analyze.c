@@ -0,0 +1,405 @@
+// kakkor-analyze: per-cycle post-processing of kakkor CSV logs.
+//
+// Usage: kakkor-analyze [-j threads] <log1> [log2] ...
+//
+// Each log is mmapped and split into chunks at cycle boundaries, one chunk per
+// thread. Threads parse their chunk into per-cycle accumulators which are then
+// merged and printed as CSV to stdout, one row per cycle.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS 64
+
+const char* delim = ";";
+
+typedef struct
+{
+	double done;  // sum of already finished segments (log restarted mid-halfcycle)
+	double last;  // last seen value of the running segment
+} cumul_acc_t;
+
+typedef struct
+{
+	int cycle;
+	cumul_acc_t cha_ah;
+	cumul_acc_t cha_wh;
+	cumul_acc_t dsch_ah;
+	cumul_acc_t dsch_wh;
+	double resistance_sum;
+	int resistance_cnt;
+	double peak_temperature;
+	int have_temperature;
+	double duration;
+} cycle_stats_t;
+
+typedef struct
+{
+	const char* start;
+	const char* end;
+	cycle_stats_t* cycles;
+	int num_cycles;
+	int alloc_cycles;
+} chunk_t;
+
+// Minimal decimal parser: [-]digits[.digits]. Advances *p past the number.
+static double parse_num(const char** p, const char* end)
+{
+	const char* s = *p;
+	double val = 0.0;
+	double sign = 1.0;
+	if(s < end && *s == '-')
+	{
+		sign = -1.0;
+		s++;
+	}
+	while(s < end && *s >= '0' && *s <= '9')
+		val = val*10.0 + (*s++ - '0');
+	if(s < end && *s == '.')
+	{
+		double scale = 0.1;
+		s++;
+		while(s < end && *s >= '0' && *s <= '9')
+		{
+			val += (*s++ - '0') * scale;
+			scale *= 0.1;
+		}
+	}
+	*p = s;
+	return sign*val;
+}
+
+static const char* next_field(const char* p, const char* end)
+{
+	while(p < end && *p != ';' && *p != '\n')
+		p++;
+	if(p < end && *p == ';')
+		p++;
+	return p;
+}
+
+static const char* next_line(const char* p, const char* end)
+{
+	const char* nl = memchr(p, '\n', end-p);
+	return nl ? nl+1 : end;
+}
+
+// Returns cycle number of the data line at p, or -1 for header/garbage lines.
+static int line_cycle(const char* p, const char* end)
+{
+	if(p >= end || *p < '0' || *p > '9')
+		return -1;
+	return (int)parse_num(&p, end);
+}
+
+#define CUMUL_RESTART_FRAC 0.5  // a restart starts again from zero: below this fraction of the previous value
+#define CUMUL_RESTART_MIN 0.001  // Ah/Wh; and by more than this, so noise and short reverse currents aren't restarts
+
+static void cumul_add(cumul_acc_t* acc, double val)
+{
+	// Cumulative values restart from zero when the halfcycle is restarted;
+	// keep what was accumulated before the restart.
+	if(fabs(val) < CUMUL_RESTART_FRAC*fabs(acc->last) && fabs(acc->last) - fabs(val) > CUMUL_RESTART_MIN)
+		acc->done += acc->last;
+	acc->last = val;
+}
+
+static double cumul_total(cumul_acc_t* acc)
+{
+	return fabs(acc->done + acc->last);
+}
+
+static void cumul_merge(cumul_acc_t* dst, cumul_acc_t* src)
+{
+	dst->done += cumul_total(src);
+}
+
+static cycle_stats_t* get_cycle(chunk_t* c, int cycle)
+{
+	int i;
+	// Cycles are nearly always in order, so search from the end.
+	for(i = c->num_cycles-1; i >= 0; i--)
+	{
+		if(c->cycles[i].cycle == cycle)
+			return &c->cycles[i];
+	}
+
+	if(c->num_cycles >= c->alloc_cycles)
+	{
+		int new_alloc = c->alloc_cycles ? c->alloc_cycles*2 : 64;
+		cycle_stats_t* n = realloc(c->cycles, new_alloc*sizeof(cycle_stats_t));
+		if(!n)
+		{
+			printf("Memory allocation error\n");
+			exit(1);
+		}
+		c->cycles = n;
+		c->alloc_cycles = new_alloc;
+	}
+
+	cycle_stats_t* s = &c->cycles[c->num_cycles++];
+	memset(s, 0, sizeof(*s));
+	s->cycle = cycle;
+	return s;
+}
+
+static void* parse_chunk(void* arg)
+{
+	chunk_t* c = arg;
+	const char* p = c->start;
+	const char* end = c->end;
+	cycle_stats_t* s = NULL;
+	int prev_cycle = -1;
+	double prev_time = 0.0;
+
+	while(p < end)
+	{
+		const char* line = p;
+		p = next_line(p, end);
+
+		int cycle = line_cycle(line, p);
+		if(cycle < 0)
+			continue;
+
+		const char* f = next_field(line, p);
+		double time = parse_num(&f, p);
+		f = next_field(f, p);
+		const char* mode = f;
+		f = next_field(f, p);
+		f = next_field(f, p); // cc/cv
+		f = next_field(f, p); // voltage
+		f = next_field(f, p); // current
+		double temperature = parse_num(&f, p);
+		f = next_field(f, p);
+		double ah = parse_num(&f, p);
+		f = next_field(f, p);
+		double wh = parse_num(&f, p);
+		f = next_field(f, p);
+		double resistance = parse_num(&f, p);
+
+		if(cycle != prev_cycle)
+		{
+			s = get_cycle(c, cycle);
+			prev_cycle = cycle;
+		}
+		else if(time > prev_time)
+		{
+			s->duration += time - prev_time;
+		}
+		prev_time = time;
+
+		if(mode[0] == 'C')
+		{
+			cumul_add(&s->cha_ah, ah);
+			cumul_add(&s->cha_wh, wh);
+		}
+		else if(mode[0] == 'D')
+		{
+			cumul_add(&s->dsch_ah, ah);
+			cumul_add(&s->dsch_wh, wh);
+		}
+
+		if(resistance != 0.0)
+		{
+			s->resistance_sum += resistance;
+			s->resistance_cnt++;
+		}
+
+		// ntc_to_c() returns +-999 or -9999 when out of calibration range.
+		if(temperature > -500.0 && temperature < 500.0)
+		{
+			if(!s->have_temperature || temperature > s->peak_temperature)
+				s->peak_temperature = temperature;
+			s->have_temperature = 1;
+		}
+	}
+
+	return NULL;
+}
+
+// Moves p forward to the first line whose cycle number differs from the cycle
+// of the line at p, so that no cycle is split between two chunks.
+static const char* find_cycle_boundary(const char* p, const char* end)
+{
+	p = next_line(p, end);
+	int cycle = -1;
+	while(p < end && (cycle = line_cycle(p, end)) < 0)
+		p = next_line(p, end);
+
+	while(p < end)
+	{
+		int c = line_cycle(p, end);
+		if(c >= 0 && c != cycle)
+			break;
+		p = next_line(p, end);
+	}
+	return p;
+}
+
+static int cmp_cycle(const void* a, const void* b)
+{
+	return ((const cycle_stats_t*)a)->cycle - ((const cycle_stats_t*)b)->cycle;
+}
+
+static void print_cycles(const char* filename, chunk_t* chunks, int num_chunks)
+{
+	chunk_t all;
+	int i, k;
+	memset(&all, 0, sizeof(all));
+
+	for(k = 0; k < num_chunks; k++)
+	{
+		for(i = 0; i < chunks[k].num_cycles; i++)
+		{
+			cycle_stats_t* src = &chunks[k].cycles[i];
+			cycle_stats_t* dst = get_cycle(&all, src->cycle);
+			cumul_merge(&dst->cha_ah, &src->cha_ah);
+			cumul_merge(&dst->cha_wh, &src->cha_wh);
+			cumul_merge(&dst->dsch_ah, &src->dsch_ah);
+			cumul_merge(&dst->dsch_wh, &src->dsch_wh);
+			dst->resistance_sum += src->resistance_sum;
+			dst->resistance_cnt += src->resistance_cnt;
+			dst->duration += src->duration;
+			if(src->have_temperature && (!dst->have_temperature || src->peak_temperature > dst->peak_temperature))
+			{
+				dst->peak_temperature = src->peak_temperature;
+				dst->have_temperature = 1;
+			}
+		}
+		free(chunks[k].cycles);
+	}
+
+	qsort(all.cycles, all.num_cycles, sizeof(cycle_stats_t), cmp_cycle);
+
+	for(i = 0; i < all.num_cycles; i++)
+	{
+		cycle_stats_t* s = &all.cycles[i];
+		double cha_ah = cumul_total(&s->cha_ah), cha_wh = cumul_total(&s->cha_wh);
+		double dsch_ah = cumul_total(&s->dsch_ah), dsch_wh = cumul_total(&s->dsch_wh);
+		printf("%s%s%u%s%.4f%s%.3f%s%.4f%s%.3f%s%.2f%s%.2f%s%.2f%s%.1f%s%.0f\n",
+			filename, delim, s->cycle, delim,
+			cha_ah, delim, cha_wh, delim, dsch_ah, delim, dsch_wh, delim,
+			(cha_ah > 0.0)?(100.0*dsch_ah/cha_ah):(0.0), delim,
+			(cha_wh > 0.0)?(100.0*dsch_wh/cha_wh):(0.0), delim,
+			(s->resistance_cnt)?(s->resistance_sum/s->resistance_cnt):(0.0), delim,
+			s->peak_temperature, delim, s->duration);
+	}
+
+	free(all.cycles);
+}
+
+int analyze_file(const char* filename, int num_threads)
+{
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+	{
+		printf("Error opening file %s\n", filename);
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		printf("Error: cannot stat or empty file %s\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		printf("Error: mmap failed for %s\n", filename);
+		return -1;
+	}
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+	const char* end = data + st.st_size;
+	chunk_t chunks[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	int num_chunks = 0;
+	int k;
+
+	const char* p = data;
+	for(k = 0; k < num_threads && p < end; k++)
+	{
+		const char* chunk_end = end;
+		if(k < num_threads-1)
+		{
+			const char* nominal = data + st.st_size/num_threads*(k+1);
+			if(nominal > p)
+				chunk_end = find_cycle_boundary(nominal, end);
+			else
+				chunk_end = p;
+		}
+		if(chunk_end <= p)
+			continue;
+
+		memset(&chunks[num_chunks], 0, sizeof(chunk_t));
+		chunks[num_chunks].start = p;
+		chunks[num_chunks].end = chunk_end;
+		num_chunks++;
+		p = chunk_end;
+	}
+
+	for(k = 0; k < num_chunks; k++)
+	{
+		if(pthread_create(&threads[k], NULL, parse_chunk, &chunks[k]))
+		{
+			printf("Error: pthread_create failed, parsing in main thread\n");
+			parse_chunk(&chunks[k]);
+			threads[k] = 0;
+		}
+	}
+	for(k = 0; k < num_chunks; k++)
+	{
+		if(threads[k])
+			pthread_join(threads[k], NULL);
+	}
+
+	print_cycles(filename, chunks, num_chunks);
+
+	munmap((void*)data, st.st_size);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int first_file = 1;
+	int i;
+	int fail = 0;
+
+	if(argc > 2 && strcmp(argv[1], "-j") == 0)
+	{
+		num_threads = atoi(argv[2]);
+		first_file = 3;
+	}
+
+	if(num_threads < 1) num_threads = 1;
+	if(num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+
+	if(first_file >= argc)
+	{
+		printf("Usage: kakkor-analyze [-j threads] <log1> [log2] ...\n");
+		return 1;
+	}
+
+	printf("file%scycle%scharge.Ah%scharge.Wh%sdischarge.Ah%sdischarge.Wh%scoulombic.eff%%%senergy.eff%%%smean.DCresistance%speak.temperature%sduration\n",
+		delim,delim,delim,delim,delim,delim,delim,delim,delim,delim);
+
+	for(i = first_file; i < argc; i++)
+	{
+		if(analyze_file(argv[i], num_threads))
+			fail = 1;
+	}
+
+	return fail;
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "chanreg.h"
+
+typedef struct
+{
+	void* owner;
+	int idx;
+} chanreg_entry_t;
+
+static char bus_paths[CHANREG_MAX_BUSES][PATH_MAX];
+static chanreg_entry_t entries[CHANREG_MAX_BUSES][CHANREG_NUM_IDS];
+static int num_buses;
+
+int chanreg_bus(const char* device)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if(realpath(device, path) == NULL)
+		snprintf(path, sizeof(path), "%s", device);
+	for(i = 0; i < num_buses; i++)
+		if(strcmp(bus_paths[i], path) == 0)
+			return i;
+	if(num_buses >= CHANREG_MAX_BUSES)
+	{
+		printf("ERROR: too many devices (max %d)\n", CHANREG_MAX_BUSES);
+		return -1;
+	}
+	strcpy(bus_paths[num_buses], path);
+	memset(entries[num_buses], 0, sizeof(entries[num_buses]));
+	return num_buses++;
+}
+
+const char* chanreg_bus_path(int rbus)
+{
+	return bus_paths[rbus];
+}
+
+int chanreg_num_buses(void)
+{
+	return num_buses;
+}
+
+int chanreg_claim(int rbus, int id, void* owner, int idx, void** other, int* other_idx)
+{
+	chanreg_entry_t* e = &entries[rbus][id];
+	if(e->owner != NULL && (e->owner != owner || e->idx != idx))
+	{
+		*other = e->owner;
+		*other_idx = e->idx;
+		return -1;
+	}
+	e->owner = owner;
+	e->idx = idx;
+	return 0;
+}
+
+void chanreg_release(void* owner)
+{
+	int b, id;
+	for(b = 0; b < num_buses; b++)
+		for(id = 0; id < CHANREG_NUM_IDS; id++)
+			if(entries[b][id].owner == owner)
+				entries[b][id].owner = NULL;
+}
+
+void* chanreg_lookup(int rbus, int id, int* idx)
+{
+	if(rbus < 0 || rbus >= num_buses || id < 0 || id >= CHANREG_NUM_IDS)
+		return NULL;
+	if(idx)
+		*idx = entries[rbus][id].idx;
+	return entries[rbus][id].owner;
+}
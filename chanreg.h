@@ -0,0 +1,34 @@
+#ifndef __CHANREG_H
+#define __CHANREG_H
+
+// Process-wide channel registry: which test owns each channel ID on each bus.
+//
+// Buses are identified by the real path of their device, so two names of the
+// same device (a /dev/serial/by-id link and /dev/ttyUSB0) are one bus. Each bus
+// has a direct table of all 256 IDs: claims, releases and lookups are constant
+// time, so a reply can be routed to its test and channel from the ID it carries.
+//
+// Owners are opaque pointers (the test). Used by the main thread only.
+//
+// Don't include anything here that pulls in sys/types.h; kakkor.c has its own mode_t.
+
+#define CHANREG_MAX_BUSES 32
+#define CHANREG_NUM_IDS 256
+
+// Registry bus number of a device, registering it on first use. Returns
+// negative if the registry is full (message printed).
+int chanreg_bus(const char* device);
+// Real path of a registry bus (the name given if it couldn't be resolved).
+const char* chanreg_bus_path(int rbus);
+int chanreg_num_buses(void);
+
+// Claims channel id on rbus for owner, as its channel number idx. Returns 0, or
+// -1 if another owner, or another channel number of the same owner, has it (that
+// owner and its index to *other and *other_idx).
+int chanreg_claim(int rbus, int id, void* owner, int idx, void** other, int* other_idx);
+// Frees every channel of owner.
+void chanreg_release(void* owner);
+// Owner of id on rbus, NULL if free; its channel number to *idx (may be NULL).
+void* chanreg_lookup(int rbus, int id, int* idx);
+
+#endif
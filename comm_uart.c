@@ -10,6 +10,12 @@
 #include <sys/select.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "comm_uart.h"
+#include "msg.h"
 
 int set_interface_attribs(int fd)
 {
@@ -54,6 +60,86 @@ int set_interface_attribs(int fd)
 	return 0;
 }
 
+// Devices currently open, so that go_fatal() can shut down every bus, and the
+// channel IDs the tests use on each, which it turns off first.
+#define MAX_OPEN_FDS 256
+#define MAX_CHANNEL_IDS 256
+static char device_open[MAX_OPEN_FDS];
+static char device_channels[MAX_OPEN_FDS][MAX_CHANNEL_IDS];
+
+// Bus locks, one per device (by its real path) and shared by every fd opened on
+// it, so that the transactions of different threads don't interleave on the bus.
+static pthread_mutex_t bus_locks[MAX_OPEN_FDS];
+static char bus_lock_paths[MAX_OPEN_FDS][PATH_MAX];
+static int num_bus_locks;
+static int fd_lock[MAX_OPEN_FDS]; // index to bus_locks + 1, 0 = none
+static pthread_mutex_t bus_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void assign_bus_lock(int fd, char* device)
+{
+	char path[PATH_MAX];
+	int i;
+	if(fd < 0 || fd >= MAX_OPEN_FDS)
+		return;
+	if(realpath(device, path) == NULL)
+		snprintf(path, sizeof(path), "%s", device);
+
+	pthread_mutex_lock(&bus_table_lock);
+	for(i = 0; i < num_bus_locks; i++)
+		if(strcmp(bus_lock_paths[i], path) == 0)
+			break;
+	if(i == num_bus_locks && num_bus_locks < MAX_OPEN_FDS)
+	{
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&bus_locks[i], &attr);
+		pthread_mutexattr_destroy(&attr);
+		strcpy(bus_lock_paths[i], path);
+		num_bus_locks++;
+	}
+	fd_lock[fd] = (i < num_bus_locks)?(i+1):(0);
+	pthread_mutex_unlock(&bus_table_lock);
+}
+
+static pthread_mutex_t* bus_lock_of(int fd)
+{
+	if(fd < 0 || fd >= MAX_OPEN_FDS || fd_lock[fd] == 0)
+		return NULL;
+	return &bus_locks[fd_lock[fd]-1];
+}
+
+void comm_lock(int fd)
+{
+	pthread_mutex_t* m = bus_lock_of(fd);
+	if(m)
+		pthread_mutex_lock(m);
+}
+
+void comm_unlock(int fd)
+{
+	pthread_mutex_t* m = bus_lock_of(fd);
+	if(m)
+		pthread_mutex_unlock(m);
+}
+
+int comm_timedlock(int fd, int timeout_ms)
+{
+	pthread_mutex_t* m = bus_lock_of(fd);
+	struct timespec ts;
+	if(m == NULL)
+		return 0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return (pthread_mutex_timedlock(m, &ts) == 0)?(0):(-1);
+}
+
 int open_device(char* device)
 {
 	int fd;
@@ -66,17 +152,43 @@ int open_device(char* device)
 	if(set_interface_attribs(fd))
 		return  -1;
 
+	if(fd < MAX_OPEN_FDS)
+		device_open[fd] = 1;
+	assign_bus_lock(fd, device);
 	return fd;
 }
 
+// The fd loses its bus lock, so a stale fd number can't lock the bus of a device
+// opened later with the same number.
 int close_device(int fd)
 {
-	return close(fd);
+	int ret;
+	pthread_mutex_t* m = bus_lock_of(fd);
+	if(m)
+		pthread_mutex_lock(m);
+	if(fd >= 0 && fd < MAX_OPEN_FDS)
+	{
+		device_open[fd] = 0;
+		memset(device_channels[fd], 0, sizeof(device_channels[fd]));
+		fd_lock[fd] = 0;
+	}
+	ret = close(fd);
+	if(m)
+		pthread_mutex_unlock(m);
+	return ret;
+}
+
+void comm_add_channel(int fd, int id)
+{
+	if(fd >= 0 && fd < MAX_OPEN_FDS && id >= 0 && id < MAX_CHANNEL_IDS)
+		device_channels[fd][id] = 1;
 }
 
 void uart_flush(int fd)
 {
+	comm_lock(fd);
 	tcflush(fd, TCIOFLUSH);
+	comm_unlock(fd);
 }
 
 int comm_send(int device_fd, char* buf)
@@ -94,28 +206,80 @@ int comm_send(int device_fd, char* buf)
 #define REPLY_WAIT_TIMEOUT_MS 100
 #define REPLY_INTERREAD_TIMEOUT_MS 20
 
-void go_fatal(int fd, char* message)
+#define FATAL_MAX_ID 255
+
+// Sends cmd to every channel ID on fd and on every other open device.
+static void send_to_all(int fd, char* cmd, int delay_us)
 {
 	char tmpbuf[100];
-	int ch, tries;
-	printf("\n\n\n\nFATAL ERROR: %s\n", message);
-	printf("Shutting down channels 0 to 64\n");
-
-	for(ch = 0; ch < 65; ch++)
+	int ch, dev;
+	for(ch = 0; ch <= FATAL_MAX_ID; ch++)
 	{
-		sprintf(tmpbuf, "@%u:OFF;", ch);
+		sprintf(tmpbuf, "@%u:%s;", ch, cmd);
 		comm_send(fd, tmpbuf);
-		usleep(20000);
+		for(dev = 0; dev < MAX_OPEN_FDS; dev++)
+		{
+			if(device_open[dev] && dev != fd)
+				comm_send(dev, tmpbuf);
+		}
+		usleep(delay_us);
 	}
+}
 
-	for(tries = 0; tries < 10; tries++)
+// Sends cmd to the channels registered with comm_add_channel() on every open device.
+static void send_to_registered(char* cmd, int delay_us)
+{
+	char tmpbuf[100];
+	int ch, dev;
+	for(dev = 0; dev < MAX_OPEN_FDS; dev++)
 	{
-		for(ch = 0; ch < 65; ch++)
+		if(!device_open[dev])
+			continue;
+		for(ch = 0; ch < MAX_CHANNEL_IDS; ch++)
 		{
-			sprintf(tmpbuf, "@%u:SHDN;", ch);
-			comm_send(fd, tmpbuf);
-			usleep(50000);
+			if(!device_channels[dev][ch])
+				continue;
+			sprintf(tmpbuf, "@%u:%s;", ch, cmd);
+			comm_send(dev, tmpbuf);
+			usleep(delay_us);
 		}
+	}
+}
+
+#define FATAL_LOCK_TIMEOUT_MS 200
+#define FATAL_FIRST_DELAY_US 2000
+
+static pthread_mutex_t fatal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void go_fatal(int fd, char* message)
+{
+	int tries, dev;
+
+	// Another thread is already shutting down, and will exit.
+	if(pthread_mutex_trylock(&fatal_lock))
+	{
+		printf("\nFATAL ERROR: %s (already shutting down)\n", message);
+		while(1)
+			sleep(1);
+	}
+
+	// Keep the other threads off the buses for good; a bus whose lock is stuck
+	// is written anyway.
+	for(dev = 0; dev < MAX_OPEN_FDS; dev++)
+		if(device_open[dev])
+			comm_timedlock(dev, FATAL_LOCK_TIMEOUT_MS);
+
+	msg_set_nonblocking(0);
+	printf("\n\n\n\nFATAL ERROR: %s\n", message);
+	printf("Shutting down the test channels, then channels 0 to %d on all devices\n", FATAL_MAX_ID);
+
+	// The channels known to run go off within milliseconds; the sweep catches the rest.
+	send_to_registered("OFF", FATAL_FIRST_DELAY_US);
+	send_to_all(fd, "OFF", 20000);
+
+	for(tries = 0; tries < 10; tries++)
+	{
+		send_to_all(fd, "SHDN", 50000);
 		sleep(3);
 	}
 
@@ -183,6 +347,88 @@ int read_reply(int fd, char* outbuf, int maxbytes)
 	}
 }
 
+int read_replies(int fd, char replies[][MAX_REPLY_LEN], int max_replies)
+{
+	char readbuf[MAX_READBUF_LEN*4];
+	int len = 0;
+	int num_replies = 0;
+	int timeout_cnt = 0;
+	int firstwait_timeout_cnt = 0;
+	int got_something = 0;
+	char* p_start = NULL;
+
+	while(num_replies < max_replies)
+	{
+		int bytes_read = read(fd, readbuf+len, sizeof(readbuf)-1-len);
+		if(bytes_read > 0)
+		{
+			got_something = 1;
+			timeout_cnt = 0;
+			len += bytes_read;
+			readbuf[len] = 0;
+
+			// Messages are framed as ;msg; -- consecutive messages may share nothing or
+			// the separator pair ";;".
+			char* p = (p_start)?(p_start):(readbuf);
+			char* sep;
+			while(num_replies < max_replies && (sep = strchr(p, COMM_SEPARATOR)))
+			{
+				if(p_start == NULL)
+				{
+					p_start = sep+1;
+				}
+				else
+				{
+					int msglen = sep - p_start;
+					if(msglen > 0)
+					{
+						if(msglen > MAX_REPLY_LEN-1)
+							msglen = MAX_REPLY_LEN-1;
+						memcpy(replies[num_replies], p_start, msglen);
+						replies[num_replies][msglen] = 0;
+						num_replies++;
+						p_start = NULL;
+					}
+					else
+					{
+						p_start = sep+1; // ";;" between messages
+					}
+				}
+				p = sep+1;
+			}
+
+			// Keep only the unfinished message in the buffer.
+			if(p_start)
+			{
+				int rest = len - (p_start - readbuf);
+				memmove(readbuf, p_start, rest);
+				len = rest;
+				p_start = readbuf;
+			}
+			else
+			{
+				len = 0;
+			}
+			if(len >= (int)sizeof(readbuf)-1)
+				return num_replies;
+			continue;
+		}
+
+		if(got_something)
+			timeout_cnt++;
+		firstwait_timeout_cnt++;
+
+		if(!got_something && firstwait_timeout_cnt > REPLY_WAIT_TIMEOUT_MS)
+			break;
+		if(got_something && timeout_cnt > REPLY_INTERREAD_TIMEOUT_MS)
+			break;
+
+		usleep(1000);
+	}
+
+	return num_replies;
+}
+
 int comm_expect(int fd, char* buf)
 {
 	char readbuf[1000];
@@ -203,17 +449,153 @@ int comm_expect(int fd, char* buf)
 		return -999;
 }
 
+#define MAX_STATS_FDS 256
+comm_stats_t comm_stats[MAX_STATS_FDS];
+// The safety monitor thread talks on the buses too.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void stats_add(int fd, long transactions, long retries, long failures)
+{
+	comm_stats_t* s = &comm_stats[(fd >= 0 && fd < MAX_STATS_FDS)?fd:0];
+	pthread_mutex_lock(&stats_lock);
+	s->transactions += transactions;
+	s->retries += retries;
+	s->failures += failures;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void comm_get_stats(int fd, comm_stats_t* stats)
+{
+	if(fd < 0 || fd >= MAX_STATS_FDS)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	pthread_mutex_lock(&stats_lock);
+	memcpy(stats, &comm_stats[fd], sizeof(*stats));
+	pthread_mutex_unlock(&stats_lock);
+}
+
+#define MAX_BATCH 256
+// Leave the previous board time to reply before addressing the next one.
+#define BATCH_SPACING_US 1500
+
+int comm_batch(int fd, int n, char** sendbufs, char* expect)
+{
+	static char replies[MAX_BATCH][MAX_REPLY_LEN];
+	int i, num_replies, num_ok = 0;
+	int fail = 0;
+
+	if(n < 1)
+		return 0;
+	if(n > MAX_BATCH)
+		n = MAX_BATCH;
+
+	comm_lock(fd);
+	uart_flush(fd);
+	for(i = 0; i < n; i++)
+	{
+		comm_send(fd, sendbufs[i]);
+		usleep(BATCH_SPACING_US);
+	}
+	stats_add(fd, n, 0, 0);
+
+	num_replies = read_replies(fd, replies, n);
+	comm_unlock(fd);
+	for(i = 0; i < num_replies; i++)
+	{
+		if(strncmp(replies[i], expect, strlen(expect)) == 0)
+			num_ok++;
+	}
+
+	if(num_ok == n)
+		return 0;
+
+	msg(MSGC_COMM, MSG_WARN, "comm_batch: got %d/%d \"%s\" replies, redoing commands one by one\n", num_ok, n, expect);
+	stats_add(fd, 0, 1, 0);
+	for(i = 0; i < n; i++)
+	{
+		if(comm_autoretry(fd, sendbufs[i], expect, NULL))
+			fail = -1;
+	}
+	return fail;
+}
+
+#define PIPELINE_TAIL_MS 30 // quiet time after the last command that ends the wait
+
+// Appends whatever has arrived, without waiting.
+static int pipeline_read(int fd, char* buf, int len, int size)
+{
+	int bytes_read;
+	while(len < size-1 && (bytes_read = read(fd, buf+len, size-1-len)) > 0)
+		len += bytes_read;
+	return len;
+}
+
+int comm_pipeline(int fd, int n, char** sendbufs, char replies[][MAX_REPLY_LEN], int max_replies, int spacing_us)
+{
+	static char buf[MAX_BATCH*MAX_REPLY_LEN];
+	int len = 0;
+	int num_replies = 0;
+	int quiet_ms = 0;
+	int i;
+	char* p;
+	char* p_start = NULL;
+
+	comm_lock(fd);
+	uart_flush(fd);
+	for(i = 0; i < n; i++)
+	{
+		comm_send(fd, sendbufs[i]);
+		usleep(spacing_us);
+		len = pipeline_read(fd, buf, len, sizeof(buf));
+	}
+	while(quiet_ms < PIPELINE_TAIL_MS)
+	{
+		int prev_len = len;
+		usleep(1000);
+		len = pipeline_read(fd, buf, len, sizeof(buf));
+		quiet_ms = (len == prev_len)?(quiet_ms+1):(0);
+	}
+	comm_unlock(fd);
+	stats_add(fd, n, 0, 0);
+	buf[len] = 0;
+
+	// Framed as in read_replies().
+	for(p = buf; num_replies < max_replies && (p = strchr(p, COMM_SEPARATOR)); p++)
+	{
+		if(p_start && p > p_start)
+		{
+			int msglen = p - p_start;
+			if(msglen > MAX_REPLY_LEN-1)
+				msglen = MAX_REPLY_LEN-1;
+			memcpy(replies[num_replies], p_start, msglen);
+			replies[num_replies][msglen] = 0;
+			num_replies++;
+			p_start = NULL;
+		}
+		else
+			p_start = p+1;
+	}
+	return num_replies;
+}
+
 // Sends sendbuf, expects expect, sets the result AFTER expect buffer to rxbuf, returns 0
 // In case of error, autoretries, and returns negative if failure.
 int comm_autoretry(int fd, char* sendbuf, char* expect, char* rxbuf)
 {
 	char readbuf[1000];
+	char reason[1100];
 	int retry = 0;
+	stats_add(fd, 1, 0, 0);
 	while(1)
 	{
 		int ret;
+		comm_lock(fd);
 		comm_send(fd, sendbuf);
-		if((ret = read_reply(fd, readbuf, 1000)) == 0)
+		ret = read_reply(fd, readbuf, 1000);
+		comm_unlock(fd);
+		if(ret == 0)
 		{
 			int len = strlen(expect);
 			if(strncmp(readbuf, expect, len) == 0)
@@ -224,24 +606,46 @@ int comm_autoretry(int fd, char* sendbuf, char* expect, char* rxbuf)
 			}
 			else
 			{
-				printf("comm_autoretry: reply (%s) not as expected (%s) -- ", readbuf, expect);
+				snprintf(reason, sizeof(reason), "reply (%s) not as expected (%s)", readbuf, expect);
 			}
 		}
 		else
 		{
-			printf("comm_autoretry: read_reply returned %d -- ", ret);
+			snprintf(reason, sizeof(reason), "read_reply returned %d", ret);
 		}
 		retry++;
 		uart_flush(fd);
 		if(retry > 5)
 		{
-			printf("out of autoretries, giving up.\n"); 
+			msg(MSGC_COMM, MSG_ERROR, "comm_autoretry: %s -- out of autoretries for %s, giving up.\n", reason, sendbuf);
+			stats_add(fd, 0, 0, 1);
 			return -1;
 		}
+		stats_add(fd, 0, 1, 0);
 		int sleepy = retry*retry*retry;
-		printf("autoretry #%d after sleeping %d ms...\n", retry, sleepy);
+		msg(MSGC_COMM, MSG_WARN, "comm_autoretry: %s -- autoretry #%d after sleeping %d ms...\n", reason, retry, sleepy);
 		usleep(1000*sleepy);
 	}
 	return -1;
 }
 
+
+int comm_query(int fd, char* sendbuf, char* expect, char* rxbuf, int lock_timeout_ms)
+{
+	char readbuf[1000];
+	int ret;
+	if(comm_timedlock(fd, lock_timeout_ms))
+		return -100;
+	uart_flush(fd);
+	comm_send(fd, sendbuf);
+	ret = read_reply(fd, readbuf, 1000);
+	comm_unlock(fd);
+	if(ret)
+		return ret;
+	int len = strlen(expect);
+	if(strncmp(readbuf, expect, len))
+		return -999;
+	if(rxbuf)
+		strcpy(rxbuf, readbuf+len);
+	return 0;
+}
@@ -19,11 +19,56 @@ int comm_expect(int fd, char* buf);
 // In case of error, autoretries, and returns negative if failure.
 int comm_autoretry(int fd, char* sendbuf, char* expect, char* rxbuf);
 
+#define MAX_REPLY_LEN 200
+
+// Reads up to max_replies separator-framed messages arriving back to back.
+// Returns the number of messages read (0 on timeout).
+int read_replies(int fd, char replies[][MAX_REPLY_LEN], int max_replies);
+
+// Sends n commands back to back, then collects the n replies, expecting each to
+// start with expect. Replies carry no channel ID, so if any reply is missing or
+// wrong, all commands are redone one by one with comm_autoretry(); use only for
+// idempotent commands. Returns 0 if all succeeded, negative otherwise.
+int comm_batch(int fd, int n, char** sendbufs, char* expect);
+
+// Sends n commands spacing_us apart, collecting the replies while sending, and
+// waits until the bus has been quiet for a moment after the last one. The spacing
+// should cover one reply, so that the replies don't collide on the bus. For
+// queries whose replies carry the channel ID (VERB), where a missing reply only
+// means nobody is there: no retries. Returns the number of replies.
+int comm_pipeline(int fd, int n, char** sendbufs, char replies[][MAX_REPLY_LEN], int max_replies, int spacing_us);
+
 int comm_send(int fd, char* buf);
 void uart_flush(int fd);
 
+// Bus locks: every fd opened on the same device shares one recursive lock. Each
+// transaction (send and reply) of the functions above holds it; hold it yourself
+// around sequences that must not be split. comm_timedlock() returns 0 when locked,
+// -1 on timeout.
+void comm_lock(int fd);
+void comm_unlock(int fd);
+int comm_timedlock(int fd, int timeout_ms);
+
+// One transaction without retries, for callers that can't wait: gives up with
+// -100 if the bus stays busy for lock_timeout_ms. Otherwise like comm_autoretry().
+int comm_query(int fd, char* sendbuf, char* expect, char* rxbuf, int lock_timeout_ms);
+
+// Registers channel id on fd as in use; go_fatal() turns these off before its sweep.
+// Cleared when the device is closed.
+void comm_add_channel(int fd, int id);
+// Turns off and shuts down all channels on fd and every other open device, then exits.
 void go_fatal(int fd, char* message);
 
+// Cumulative per-device transaction counters, for health monitoring.
+typedef struct
+{
+	long transactions;
+	long retries;
+	long failures;
+} comm_stats_t;
+
+void comm_get_stats(int fd, comm_stats_t* stats);
+
 
 
 #endif
@@ -1,34 +1,214 @@
+// kakkor-gui: ncurses live dashboard.
+//
+// Reads the shared-memory telemetry published by kakkor (see telemetry.h),
+// so it runs as a separate process and never slows down the control loop.
+// Repaints at a fixed low rate. Keys: up/down select test, q quits.
+
 #include <ncurses.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+
+#include "telemetry.h"
+
+#define REPAINT_INTERVAL_MS 500
+#define MAX_GUI_TESTS 64
+
+// Channel is flagged if its current deviates this much from the test average (mA)
+#define IMBALANCE_LIMIT_MA 1500
+
+const char* gui_mode_names[4] = {"UNDEF", "OFF", "CHA", "DSCH"};
+const char* gui_cccv_names[3] = {"UNDEF", "CC", "CV"};
+
+typedef struct
+{
+	int64_t prev_retries;
+	int64_t prev_transactions;
+	time_t prev_time;
+	double retry_rate; // retries per minute
+	double error_pct;  // retries per transaction in the last interval, %
+} comm_rate_t;
+
+comm_rate_t rates[MAX_GUI_TESTS];
+
+const char* name_of(const char** names, int n, int idx)
+{
+	if(idx < 0 || idx >= n)
+		return "?";
+	return names[idx];
+}
+
+void update_rate(comm_rate_t* r, telemetry_sample_t* s, time_t now)
+{
+	if(r->prev_time && now - r->prev_time >= 10)
+	{
+		double minutes = (double)(now - r->prev_time) / 60.0;
+		int64_t d_retries = s->comm_retries - r->prev_retries;
+		int64_t d_trans = s->comm_transactions - r->prev_transactions;
+		r->retry_rate = (double)d_retries / minutes;
+		r->error_pct = (d_trans > 0)?(100.0*(double)d_retries/(double)d_trans):(0.0);
+	}
+	if(!r->prev_time || now - r->prev_time >= 10)
+	{
+		r->prev_retries = s->comm_retries;
+		r->prev_transactions = s->comm_transactions;
+		r->prev_time = now;
+	}
+}
+
+const char* channel_health(telemetry_sample_t* s, telemetry_channel_t* c)
+{
+	int i;
+	int mean = 0;
+	int n = (s->num_channels < TELEMETRY_MAX_CHANNELS)?(s->num_channels):(TELEMETRY_MAX_CHANNELS);
+	for(i = 0; i < n; i++)
+		mean += s->ch[i].current;
+	if(n)
+		mean /= n;
+
+	if(c->mode != s->mode)
+		return "MODE MISMATCH";
+	if(c->cccv != 1 && c->cccv != 2)
+		return "BAD CC/CV";
+	if(abs(c->current - mean) > IMBALANCE_LIMIT_MA)
+		return "IMBALANCE";
+	return "OK";
+}
+
+void draw_test_table(telemetry_shm_t* shm, int selected, time_t now)
+{
+	int t;
+	int row = 2;
+	attron(A_BOLD);
+	mvprintw(row++, 0, "%-16s %5s %4s %3s %8s %8s %6s %9s %9s %6s %6s %7s %6s %8s %9s",
+		"test", "cycle", "mode", "cv", "V", "I", "T", "Ah", "Wh", "SoC", "SoH", "R mOhm", "next", "retr/min", "commfails");
+	attroff(A_BOLD);
+
+	for(t = 0; t < (int)shm->num_tests && t < MAX_GUI_TESTS; t++)
+	{
+		telemetry_sample_t s;
+		if(telemetry_read_latest(shm, t, &s))
+		{
+			mvprintw(row++, 0, "%-16.16s  (no data yet)", shm->tests[t].name);
+			continue;
+		}
+
+		update_rate(&rates[t], &s, now);
+
+		char next[16];
+		if(s.cooldown_left >= 0)
+			snprintf(next, sizeof(next), "%ds", s.cooldown_left);
+		else
+			snprintf(next, sizeof(next), "-");
+
+		char soc[16], soh[16];
+		if(s.soc >= 0.0)
+			snprintf(soc, sizeof(soc), "%.1f", s.soc);
+		else
+			snprintf(soc, sizeof(soc), "-");
+		if(s.soh > 0.0)
+			snprintf(soh, sizeof(soh), "%.1f", s.soh);
+		else
+			snprintf(soh, sizeof(soh), "-");
+
+		if(t == selected)
+			attron(A_REVERSE);
+		mvprintw(row++, 0, "%-16.16s %5d %4s %3s %8.3f %8.2f %6.1f %9.4f %9.3f %6s %6s %7.2f %6s %8.1f %9ld",
+			shm->tests[t].name, s.cycle, name_of(gui_mode_names, 4, s.mode), name_of(gui_cccv_names, 3, s.cccv),
+			s.voltage, s.current, s.temperature, s.cumul_ah, s.cumul_wh, soc, soh, s.last_resistance*1000.0,
+			next, rates[t].retry_rate, (long)s.comm_failures);
+		if(t == selected)
+			attroff(A_REVERSE);
+	}
+}
+
+void draw_channels(telemetry_shm_t* shm, int selected, int row)
+{
+	telemetry_sample_t s;
+	int i;
+
+	if(selected < 0 || selected >= (int)shm->num_tests)
+		return;
+
+	attron(A_BOLD);
+	mvprintw(row++, 0, "Channels of %s (comm retries %.1f%% of transactions)", shm->tests[selected].name, rates[selected].error_pct);
+	mvprintw(row++, 0, "%4s %5s %3s %8s %8s %8s %7s  %s", "id", "mode", "cv", "V", "I", "Iset", "T raw", "health");
+	attroff(A_BOLD);
+
+	if(telemetry_read_latest(shm, selected, &s))
+		return;
+
+	for(i = 0; i < s.num_channels && i < TELEMETRY_MAX_CHANNELS && row < LINES-1; i++)
+	{
+		telemetry_channel_t* c = &s.ch[i];
+		const char* health = channel_health(&s, c);
+		if(strcmp(health, "OK"))
+			attron(A_BOLD);
+		mvprintw(row++, 0, "%4d %5s %3s %8.3f %8.3f %8.3f %7d  %s",
+			c->id, name_of(gui_mode_names, 4, c->mode), name_of(gui_cccv_names, 3, c->cccv),
+			c->voltage/1000.0, c->current/1000.0, c->current_setpoint/1000.0, c->temperature, health);
+		if(strcmp(health, "OK"))
+			attroff(A_BOLD);
+	}
+	if(s.num_channels > TELEMETRY_MAX_CHANNELS)
+		mvprintw(row, 0, "(%d more channels not shown)", s.num_channels - TELEMETRY_MAX_CHANNELS);
+}
 
 int main()
 {
-	int timecnt = 0;
+	telemetry_shm_t* shm = NULL;
+	int selected = 0;
+
 	initscr();
 	raw();
 	noecho();
+	curs_set(0);
 	keypad(stdscr, TRUE);
+	timeout(REPAINT_INTERVAL_MS);
 
-	timeout(0);
-	mvprintw(10,10, "Johannes H. !!!");
-	mvprintw(40,0, "kakkor=420");
 	while(1)
 	{
 		int ch;
-		timecnt++;
-		usleep(1000);
-		if(timecnt%1000 == 0)
-			mvprintw(20,20, "%u", timecnt);
+		time_t now = time(0);
+
+		if(!shm)
+			shm = telemetry_attach();
+		else if(shm->writer_pid && kill((pid_t)shm->writer_pid, 0) && now - shm->heartbeat > 5)
+		{
+			// kakkor restarted or exited; reattach to the new segment.
+			telemetry_detach(shm);
+			shm = telemetry_attach();
+		}
+
+		erase();
+		if(!shm)
+		{
+			mvprintw(0, 0, "kakkor-gui: waiting for kakkor telemetry (%s)...", TELEMETRY_SHM_NAME);
+		}
+		else
+		{
+			mvprintw(0, 0, "kakkor-gui   pid %ld   %d tests   last update %lds ago   (up/down: select, q: quit)",
+				(long)shm->writer_pid, shm->num_tests, (long)(now - shm->heartbeat));
+			if(selected >= (int)shm->num_tests)
+				selected = shm->num_tests-1;
+			draw_test_table(shm, selected, now);
+			draw_channels(shm, selected, shm->num_tests + 5);
+		}
+		refresh();
+
+		// getch() also provides the repaint interval via timeout().
 		ch = getch();
 		if(ch == 'q')
 			break;
-		if(ch == KEY_RIGHT)
-			printw("KAKKOR RIGHT");
-
-		int jeah=5;
-		mvscanw(40,0, "kakkor=%u", &jeah);
-		mvprintw(41,10, "-->%u", jeah);
-		refresh();
+		if(ch == KEY_UP && selected > 0)
+			selected--;
+		if(ch == KEY_DOWN)
+			selected++;
 	}
+
+	telemetry_detach(shm);
 	endwin();
 
 	return 0;
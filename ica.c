@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "ica.h"
+
+int ica_init(ica_t* h, double bin_v)
+{
+	memset(h, 0, sizeof(*h));
+	h->bin_v = bin_v;
+	h->num_bins = (int)(ICA_V_MAX / bin_v + 0.5);
+	h->q = malloc(h->num_bins * sizeof(double));
+	if(h->q == NULL)
+	{
+		printf("ERROR: memory allocation error for ica\n");
+		return -1;
+	}
+	ica_reset(h);
+	return 0;
+}
+
+void ica_reset(ica_t* h)
+{
+	memset(h->q, 0, h->num_bins * sizeof(double));
+	h->have_prev = 0;
+	h->lo = h->num_bins;
+	h->hi = -1;
+}
+
+void ica_break(ica_t* h)
+{
+	h->have_prev = 0;
+}
+
+static int bin_of(ica_t* h, double v)
+{
+	int b = (int)(v / h->bin_v);
+	if(b < 0)
+		return 0;
+	if(b >= h->num_bins)
+		return h->num_bins-1;
+	return b;
+}
+
+void ica_add(ica_t* h, double v, double ah)
+{
+	int b = bin_of(h, v);
+	int b0 = (h->have_prev)?(bin_of(h, h->prev_v)):(b);
+	ah = fabs(ah);
+
+	if(b0 == b)
+		h->q[b] += ah;
+	else
+	{
+		double lo_v = (h->prev_v < v)?(h->prev_v):(v);
+		double hi_v = (h->prev_v < v)?(v):(h->prev_v);
+		int lo = (b0 < b)?(b0):(b);
+		int hi = (b0 < b)?(b):(b0);
+		int k;
+		for(k = lo; k <= hi; k++)
+		{
+			double from = (k*h->bin_v > lo_v)?(k*h->bin_v):(lo_v);
+			double to = ((k+1)*h->bin_v < hi_v)?((k+1)*h->bin_v):(hi_v);
+			if(to > from)
+				h->q[k] += ah * (to - from) / (hi_v - lo_v);
+		}
+		if(lo < h->lo) h->lo = lo;
+		if(hi > h->hi) h->hi = hi;
+	}
+	if(b < h->lo) h->lo = b;
+	if(b > h->hi) h->hi = b;
+
+	h->prev_v = v;
+	h->have_prev = 1;
+}
+
+int ica_curve(ica_t* h, int smooth, double* dqdv)
+{
+	int k, j;
+	memset(dqdv, 0, h->num_bins * sizeof(double));
+	if(h->hi < h->lo)
+		return -1;
+
+	for(k = h->lo; k <= h->hi; k++)
+	{
+		double sum = 0.0;
+		int n = 0;
+		for(j = k-smooth; j <= k+smooth; j++)
+		{
+			if(j < h->lo || j > h->hi)
+				continue;
+			sum += h->q[j];
+			n++;
+		}
+		dqdv[k] = sum / (double)n / h->bin_v;
+	}
+	return 0;
+}
+
+int ica_peaks(ica_t* h, double* dqdv, double min_rel, double* peak_v, double* peak_h, int max)
+{
+	int k, j;
+	int n = 0;
+	double top = 0.0;
+
+	for(k = h->lo; k <= h->hi; k++)
+		if(dqdv[k] > top)
+			top = dqdv[k];
+	if(top <= 0.0)
+		return 0;
+
+	for(k = h->lo+1; k < h->hi; k++)
+	{
+		double y = dqdv[k];
+		if(y <= dqdv[k-1] || y < dqdv[k+1])
+			continue;
+
+		// Prominence: how far the curve drops on each side before rising above
+		// the peak (or ending). Ripple on a plateau and the ends don't count.
+		double lmin = y, rmin = y;
+		for(j = k-1; j >= h->lo && dqdv[j] <= y; j--)
+			if(dqdv[j] < lmin)
+				lmin = dqdv[j];
+		for(j = k+1; j <= h->hi && dqdv[j] <= y; j++)
+			if(dqdv[j] < rmin)
+				rmin = dqdv[j];
+		if(y - ((lmin > rmin)?(lmin):(rmin)) < min_rel*top)
+			continue;
+
+		// Parabolic interpolation between the bin centers
+		double den = dqdv[k-1] - 2.0*y + dqdv[k+1];
+		double off = (den < 0.0)?(0.5*(dqdv[k-1] - dqdv[k+1])/den):(0.0);
+		double v = (k + 0.5 + off) * h->bin_v;
+
+		// Insert, strongest first
+		int pos = n;
+		while(pos > 0 && peak_h[pos-1] < y)
+		{
+			if(pos < max)
+			{
+				peak_v[pos] = peak_v[pos-1];
+				peak_h[pos] = peak_h[pos-1];
+			}
+			pos--;
+		}
+		if(pos < max)
+		{
+			peak_v[pos] = v;
+			peak_h[pos] = y;
+			if(n < max)
+				n++;
+		}
+	}
+	return n;
+}
+
+void ica_track(ica_track_t* t, double* peak_v, double* peak_h, int n, double window, double* slot_v, double* slot_h)
+{
+	int used[ICA_MAX_PEAKS];
+	int i, s;
+
+	memset(used, 0, sizeof(used));
+	for(s = 0; s < ICA_MAX_PEAKS; s++)
+	{
+		slot_v[s] = 0.0;
+		slot_h[s] = 0.0;
+	}
+
+	if(t->n == 0)
+	{
+		// First curve: slots in voltage order.
+		for(i = 0; i < n && i < ICA_MAX_PEAKS; i++)
+		{
+			s = t->n;
+			while(s > 0 && t->ref_v[s-1] > peak_v[i])
+			{
+				t->ref_v[s] = t->ref_v[s-1];
+				slot_h[s] = slot_h[s-1];
+				s--;
+			}
+			t->ref_v[s] = peak_v[i];
+			slot_h[s] = peak_h[i];
+			t->n++;
+		}
+		for(s = 0; s < t->n; s++)
+		{
+			t->last_v[s] = t->ref_v[s];
+			slot_v[s] = t->ref_v[s];
+		}
+		return;
+	}
+
+	// Strongest peaks pick their slots first.
+	for(i = 0; i < n; i++)
+	{
+		int best = -1;
+		for(s = 0; s < t->n; s++)
+		{
+			if(used[s] || fabs(t->last_v[s] - peak_v[i]) > window)
+				continue;
+			if(best < 0 || fabs(t->last_v[s] - peak_v[i]) < fabs(t->last_v[best] - peak_v[i]))
+				best = s;
+		}
+		if(best < 0 && t->n < ICA_MAX_PEAKS)
+		{
+			best = t->n++;
+			t->ref_v[best] = peak_v[i];
+		}
+		if(best < 0)
+			continue;
+		used[best] = 1;
+		t->last_v[best] = peak_v[i];
+		slot_v[best] = peak_v[i];
+		slot_h[best] = peak_h[i];
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef __ICA_H
+#define __ICA_H
+
+// Streaming incremental capacity (dQ/dV) and differential voltage (dV/dQ)
+// analysis of one halfcycle.
+//
+// Charge is binned by voltage as the samples arrive: the charge of a sample is
+// spread evenly over the bins the voltage moved through since the previous one,
+// so the histogram doesn't depend on the sample rate. The curve is only
+// computed (smoothed, differentiated) when asked for, at the end of the halfcycle.
+//
+// Peaks of dQ/dV are tracked across halfcycles in fixed slots: the peaks found in
+// the first curve open the slots, and later peaks go to the slot whose latest
+// position is nearest, so a slot follows the same peak as it shifts with aging.
+//
+// Don't include anything here that pulls in sys/types.h; kakkor.c has its own mode_t.
+
+#define ICA_V_MAX 5.0
+#define ICA_MAX_PEAKS 6
+
+typedef struct
+{
+	double bin_v;             // V
+	int num_bins;             // bins from 0 to ICA_V_MAX
+	double* q;                // Ah per bin
+	int have_prev;
+	double prev_v;
+	int lo;                   // populated bin range
+	int hi;
+} ica_t;
+
+typedef struct
+{
+	int n;                    // slots opened
+	double ref_v[ICA_MAX_PEAKS];   // position when the slot was opened, V
+	double last_v[ICA_MAX_PEAKS];  // latest position, V
+} ica_track_t;
+
+// Returns 0 on success, negative on error (message printed).
+int ica_init(ica_t* h, double bin_v);
+void ica_reset(ica_t* h);
+// Adds charge ah (sign ignored) at voltage v.
+void ica_add(ica_t* h, double v, double ah);
+// Breaks the voltage path: the next sample isn't spread back to the previous one
+// (used over CV phases and gaps).
+void ica_break(ica_t* h);
+
+// dQ/dV (Ah/V) of every bin, smoothed with a moving average over +-smooth bins,
+// into dqdv[num_bins]. Returns 0, or -1 if the histogram is empty.
+int ica_curve(ica_t* h, int smooth, double* dqdv);
+// Peaks of dqdv with a prominence of at least min_rel times the highest value,
+// strongest first. Returns the number found (up to max).
+int ica_peaks(ica_t* h, double* dqdv, double min_rel, double* peak_v, double* peak_h, int max);
+// Assigns peaks to slots; slot_v/slot_h[ICA_MAX_PEAKS] get the peak of each slot,
+// 0 where the slot has none this time. window is the largest shift matched, V.
+void ica_track(ica_track_t* t, double* peak_v, double* peak_h, int n, double window, double* slot_v, double* slot_h);
+
+#endif
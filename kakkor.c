@@ -4,9 +4,18 @@
 #include <time.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 //#include <ncurses.h>
 
 #include "comm_uart.h"
+#include "telemetry.h"
+#include "msg.h"
+#include "profile.h"
+#include "soc.h"
+#include "ica.h"
+#include "rolling.h"
+#include "chanreg.h"
 
 #define RESISTANCE_COMP_KLUDGE 0.001
 
@@ -27,7 +36,9 @@ const char* short_cccv_names[3] = {"UNDEF", "CC", "CV"};
 
 const char* delim = ";";
 
-#define MAX_PARALLEL_CHANNELS 32
+#define MAX_PARALLEL_CHANNELS 256
+#define MAX_TEST_BUSES 8
+#define MAX_ABORT_CONDS 8
 #define MIN_ID 0
 #define MAX_ID 255
 
@@ -37,18 +48,63 @@ const char* delim = ";";
    fprintf(fp, fmt, __VA_ARGS__); \
  }
 
+// Condition used by the step program: "<var><op><value>", e.g. "ah<2.5" or "cycle%50".
+// dvdt (mV/min), dtdt (C/min) and ndv (mV below the peak voltage of the step) come
+// from the rolling window estimators.
+typedef enum {COND_NONE = 0, COND_CYCLE, COND_AH, COND_WH, COND_V, COND_I, COND_T, COND_TIME, COND_SOC,
+              COND_DVDT, COND_DTDT, COND_NDV, NUM_COND_VARS} cond_var_t;
+const char* cond_var_names[NUM_COND_VARS] = {"", "cycle", "ah", "wh", "v", "i", "t", "time", "soc", "dvdt", "dtdt", "ndv"};
+typedef enum {OP_LT = 0, OP_GT, OP_LE, OP_GE, OP_MOD} cond_op_t;
+const char* cond_op_names[5] = {"<", ">", "<=", ">=", "%"};
+
+typedef struct
+{
+	cond_var_t var;
+	cond_op_t op;
+	double value;
+} cond_t;
+
 typedef struct
 {
 	double current;
 	double voltage;
 	int const_power_mode;
 	double power;
+	int const_resistance_mode;
+	double load_resistance;
+	double max_current; // current limit in constant power and constant resistance modes
 
 	stop_mode_t stop_mode;
 	double stop_current;
 	double stop_voltage;
+	cond_t stop_if;     // ends the halfcycle early; COND_NONE = off
 } base_settings_t;
 
+typedef enum {STEP_CHARGE = 0, STEP_DISCHARGE, STEP_CC, STEP_CCCV, STEP_CV, STEP_PULSE,
+              STEP_REST, STEP_CYCLE, STEP_LOOP, STEP_GOTO, STEP_END, NUM_STEP_TYPES} step_type_t;
+const char* step_type_names[NUM_STEP_TYPES] = {"charge", "discharge", "cc", "cccv", "cv", "pulse",
+                                               "rest", "cycle", "loop", "goto", "end"};
+
+#define MAX_STEPS 64
+#define STEP_LABEL_LEN 16
+
+// One compiled step. Steps that run the channels carry their complete settings,
+// so the tick only copies them to the test; jump targets are resolved to indices.
+typedef struct
+{
+	step_type_t type;
+	char label[STEP_LABEL_LEN];
+	mode_t mode;              // MODE_CHARGE or MODE_DISCHARGE for steps that run the channels
+	base_settings_t settings;
+	int time;                 // maximum duration, s; -1 = no limit
+	cond_t until;             // ends the step early
+	cond_t cond;              // goto condition; COND_NONE = always
+	int target;               // goto/loop target index
+	int count;                // loop: number of jumps back
+} step_t;
+
+typedef enum {PROGRAM_WAIT = 0, PROGRAM_RUNNING, PROGRAM_DONE} program_state_t;
+
 typedef struct
 {
 	int current;
@@ -64,14 +120,26 @@ typedef struct
 	int temperature;
 	int is_cv;
 	int current_setpoint;
+	int input_voltage; // mV, 0 if the board doesn't report it
 	mode_t mode;
 	cccv_t cccv;
 } hw_measurement_t;
 
+// State of one paralleled channel. Tests allocate exactly num_channels of these.
+typedef struct
+{
+	int id;
+	int bus;            // index to the test's device_names[] / fds[]
+	int rbus;           // bus number in the channel registry
+	int fd;
+	hw_measurement_t meas;
+	int share_trim;     // current sharing correction, mA
+	int share_last_set; // setpoint last sent to the channel, mA
+} channel_t;
+
 typedef struct
 {
 	int num_hw_measurements; // Channels
-	hw_measurement_t hw_meas[MAX_PARALLEL_CHANNELS];
 	double voltage;
 	double current;
 	double temperature;
@@ -80,6 +148,9 @@ typedef struct
 	double cumul_ah;
 	double cumul_wh;
 	double resistance;
+	double soc; // %, from the estimator
+	double soh; // %, 0 until the capacity is measured
+	double input_voltage; // V, stationary pack as seen by the boards; 0 if not reported
 	int start_time;
 
 } measurement_t;
@@ -87,17 +158,74 @@ typedef struct
 
 #define MAX_T_CAL_POINTS 20
 
+// Streaming statistics of one signal: Welford running mean and variance,
+// min/max and time integral, in O(1) memory.
+typedef struct
+{
+	long n;
+	double mean;
+	double m2;
+	double min;
+	double max;
+	double time_integral;
+	double time;
+} stat_acc_t;
+
+typedef struct
+{
+	mode_t mode;
+	stat_acc_t voltage;
+	stat_acc_t current;
+	stat_acc_t temperature;
+	stat_acc_t power;
+	double resistance_sum;
+	int resistance_cnt;
+} halfcycle_stats_t;
+
+// Swinging door trend compression state for one logged signal.
+// The "door" is the range of slopes from the last archived point that keep
+// every sample seen since within +-band; a sample is archived when the
+// line to the newest sample no longer fits through the door.
+typedef struct
+{
+	double band;
+	double t0;
+	double y0;
+	double slope_lo;
+	double slope_hi;
+} sdt_t;
+
+// Capacity fade: weighted least squares line through (cycle, discharge Ah), with
+// older points forgotten by FADE_FORGET per new point so the fit follows a knee.
+// Running sums only, O(1) per point.
+typedef struct
+{
+	int n;
+	double sw;
+	double sx;
+	double sy;
+	double sxx;
+	double sxy;
+	double initial_sum; // mean of the first FADE_REF_POINTS points is the initial capacity
+	int initial_n;
+} fade_fit_t;
+
 typedef struct
 {
 	char* name;
-	char* device_name;
-	int fd;
+	char* device_names[MAX_TEST_BUSES]; // device= is bus 0, extradevice= adds the next ones
+	int fds[MAX_TEST_BUSES];
+	int rbuses[MAX_TEST_BUSES]; // channel registry bus of each
+	int channels_auto;        // channels=auto: allocated from the bus scan inventory
+	double auto_current;      // A the allocation is sized for, 0 = from the settings
+	int num_buses;
+	int fd; // first bus
 	int num_channels;
-	int channels[MAX_PARALLEL_CHANNELS];
-	int master_channel_idx; // index to channels[] to show which channel is "master".
+	channel_t* ch;
+	int master_channel_idx; // index to ch[] to show which channel is "master".
 	// voltage sense and temperature reading are taken from the master channel.
-	// When master channel is in CV mode, its current is copied to other channels
-	// every second.
+	// The other channels are trimmed to share the current equally with the master,
+	// see current_sharing().
 
 	base_settings_t charge;
 	base_settings_t discharge;
@@ -108,7 +236,47 @@ typedef struct
 
 	int postcharge_cooldown;
 	int postdischarge_cooldown;
-	int cooldown_start_time;
+
+	// Step program, compiled from step= tokens at load time (default: charge/discharge cycling).
+	char* step_src[MAX_STEPS];
+	int num_step_src;
+	step_t program[MAX_STEPS];
+	int num_steps;
+	program_state_t program_state;
+	int step_idx;
+	int step_start_time;
+	int step_pending;         // step runs the channels, to be started at the end of the tick
+	int loop_done[MAX_STEPS];
+	int step_last_duration[MAX_STEPS]; // s, of the latest run of each step; 0 = not run yet
+	int start_slack;          // s a start may be held for the pack current limit
+	int sched_held;           // a start is being held
+	int priority;             // power budget: lower priorities are throttled first
+	double budget_scale;      // power budget: 1.0 = the step's own settings
+	double derate_temp;       // C where temperature derating starts, 0 = off
+	double derate_min;        // scale at temperaturestop
+	double derate_scale;      // temperature derating: 1.0 = the step's own settings
+	double derate_hc_s;       // s derated in the running halfcycle
+	double derate_total_s;
+
+	// Rolling window estimators for the dvdt, dtdt and ndv conditions
+	int deriv_window;         // s
+	rolling_t deriv_v;        // voltage of the running step
+	rolling_t deriv_t;        // temperature
+	double v_peak;            // highest voltage of the running step, V
+	cond_t abort_if[MAX_ABORT_CONDS];
+	int num_abort_if;
+
+	// Adaptive cooldown: timed rests end once the cell has cooled and relaxed
+	int cooldown_min;         // s, -1 = off; the rest's own time is the maximum
+	double cooldown_band;     // C over ambient
+	double cooldown_dvdt;     // V/s
+	double ambient;           // C, 0 = lowest temperature seen
+	double temp_min_seen;
+	int cooldown_due;         // step time when the rest was done, -1 = not yet
+	int cooldown_ref_time;    // start of the dV/dt window, step time; -1 = not started
+	double cooldown_ref_v;
+	double cooldown_last_dvdt; // V/s over the latest window, negative = none yet
+	long cooldown_saved_s;
 
 	double temperature_stop;
 
@@ -131,12 +299,103 @@ typedef struct
 	double resistance_second_pulse_current_mul;
 	int resistance_state;
 	double resistance_last_v;
-	int kludgimus_maximus;
 	int resistance_every_cycle;
 
-	double voltage_avg_acc;
-	double current_avg_acc;
-	double temperature_avg_acc;
+	int share_cmd;        // commanded current per channel, mA
+	int settle_skip;      // measurements still to skip after a new test current
+	int meas_settled;     // latest measurement was taken with the current setpoints in effect
+
+	double cp_trim;     // constant power/resistance loop: relative correction of the setpoint
+	double cp_last_set; // last current sent by the loop, A
+
+	double last_tick;   // run_clock() at the previous update_test(), 0 before the first
+	double tick_dt;     // s since the previous update_test(); more than 1 when the loop skipped a second
+	halfcycle_stats_t hc_stats;
+
+	int log_compress;
+	sdt_t sdt_voltage;
+	sdt_t sdt_current;
+	sdt_t sdt_temperature;
+	measurement_t held_meas; // last sample not yet written to the log
+	int held_time;
+	int held_cycle;
+	int have_held;
+	mode_t last_logged_mode;
+	cccv_t last_logged_cccv;
+	int last_logged_cycle;
+	int last_logged_time;
+	long log_rows_in;
+	long log_rows_out;
+
+	int telemetry_idx;
+	double last_resistance;
+
+	soc_est_t soc;            // off unless capacity= is given
+
+	// End of life: stop conditions on cycle count and discharge capacity
+	int stop_cycle;           // 0 = none
+	double stop_capacity;     // Ah, 0 = none
+	double stop_fade;         // % of initial capacity, 0 = none
+	char* fade_step;          // label of the step whose discharges count; NULL = every full discharge
+	fade_fit_t fade;
+	int eol;                  // stopped by a stop condition; channels freed at the end of the tick
+	int finished;             // channels freed, no longer polled
+
+	// Safety monitor limits (0 = off) and its state, shared under safety_lock
+	int safety_on;
+	double safety_temp;       // C
+	double safety_dtdt;       // C/min
+	double safety_vmin;       // V
+	double safety_vmax;
+	double safety_imismatch;  // A, master channel vs. its setpoint
+	int safety_deadline;      // ms
+	int safety_active;        // channels may be on
+	int safety_closed;        // buses closed, not monitored
+	double safety_time;       // run_clock() of the latest master measurement
+	hw_measurement_t safety_meas;
+	double safety_t_ref;      // dT/dt reference point
+	double safety_t_ref_time;
+	double safety_mismatch_since; // 0 = no mismatch
+	volatile int safety_tripped;  // channels turned off by the monitor
+	int safety_handled;
+	char safety_reason[128];
+
+	// Incremental capacity / differential voltage analysis of every halfcycle
+	int ica_on;
+	double ica_bin;           // V
+	int ica_smooth;           // moving average half width, bins
+	ica_t ica;
+	ica_track_t ica_track[2]; // peak slots of charge and discharge
+	double* ica_dqdv;
+	FILE* ica_log;
+	FILE* icapeaks_log;
+
+	// Profile playback, instead of charge/discharge cycling
+	char* profile_file;
+	profile_t profile;
+	int profile_power;        // profile values are W instead of A
+	int profile_rate;         // setpoint updates per second
+	int profile_repeat;
+	int profile_round;
+	int profile_running;
+	double profile_start;     // run() clock, s
+	double profile_next;
+	double profile_last_tick;
+	double profile_last_set;  // A
+	mode_t profile_hw_mode;   // direction whose voltage limits are in the channels
+	FILE* profile_log;
+
+	// Log-spaced sampling of pulse steps and the rests right after them (GITT, HPPC)
+	int pulse_points;         // samples per decade of time
+	int pulse_armed;          // step edge in this tick; the fast loop takes its time
+	int pulse_sampling;
+	double pulse_t0;          // run() clock at the step edge, s
+	double pulse_next;
+	int pulse_k;              // grid index of pulse_next
+	double pulse_v0;          // voltage and current just before the edge
+	double pulse_i0;
+	double pulse_r;           // latest dV/dI from the edge, ohm
+	FILE* pulse_log;
 
 } test_t;
 
@@ -144,6 +403,47 @@ typedef struct
 int num_t_cal_points;
 double t_cal[MAX_T_CAL_POINTS][2];
 int defaults_parsed_once = 0;
+char* parse_file_name;       // file parse_token() is reading
+
+// Stationary pack, shared by all tests of this process
+#define PACK_DEFAULT_VOLTAGE 11.0
+#define PACK_DEFAULT_EFFICIENCY 0.94 // kakkor conversion, each way
+#define PACK_V_MIN 9.0       // kakkor input voltage range
+#define PACK_V_MAX 13.8
+typedef enum {PACK_PAUSE_NONE = 0, PACK_PAUSE_CHARGE, PACK_PAUSE_DISCHARGE} pack_pause_t;
+double pack_limit = 0.0;     // A, 0 = no start scheduling
+double pack_voltage = PACK_DEFAULT_VOLTAGE;
+double pack_efficiency = PACK_DEFAULT_EFFICIENCY;
+double power_budget = 0.0;   // W, 0 = no power budget
+#define MAX_PRIORITY 9       // priority= is 0..MAX_PRIORITY
+double pack_capacity = 0.0;  // Wh, 0 = no pack SoC estimate
+double pack_soc = 0.5;       // 0..1
+double pack_soc_min = 0.1;   // charges are paused below this
+double pack_soc_max = 0.9;   // discharges are paused above this
+double charger_input = 0.0;  // W the charger puts into the pack
+double charger_soc = 0.5;    // SoC where the charger's CV voltage is
+double pack_vin;             // latest input voltage reported by the boards, 0 = none
+pack_pause_t pack_pause;
+pack_pause_t pack_stop;      // running halfcycles of this direction are stopped
+test_t* all_tests;
+int num_all_tests;
+FILE* pack_log;
+double pack_wh_out;          // Wh given to charging cells, pack side
+double pack_wh_in;           // Wh taken back from discharging cells, pack side
+double pack_last_tick;       // run_clock() at the previous pack_update(), 0 before the first
+
+// Board inventory from the startup scan, per channel registry bus and ID
+typedef struct
+{
+	int present;
+	int garbled;                 // answered, but not with a valid measurement
+	hw_measurement_t meas;
+} inventory_t;
+inventory_t inventory[CHANREG_MAX_BUSES][CHANREG_NUM_IDS];
+int scan_on = 1; // 2 = strict: scan problems stop kakkor before the tests start
+int scan_done;
+#define BOARD_DEFAULT_CHANNELS 3
+int board_channels = BOARD_DEFAULT_CHANNELS; // consecutive IDs per board
 
 double ntc_to_c(double ntc)
 {
@@ -175,6 +475,13 @@ double ntc_to_c(double ntc)
 	return -9999.0;
 }
 
+// ntc_to_c() gives -9999, -999 or 999 when the reading is outside the calibration;
+// those are error codes, not temperatures.
+int temperature_in_range(double t)
+{
+	return t > -999.0 && t < 999.0;
+}
+
 int log_read_cycle_num(char* filename)
 {
 	int cycle_num = 0;
@@ -213,6 +520,22 @@ int log_read_cycle_num(char* filename)
 
 }
 
+void log_summary_header(test_t* t);
+
+// SoC and SoH columns at the end of the main and verbose log rows, with capacity= only.
+void log_soc_header(FILE* f, test_t* t)
+{
+	if(t->soc.capacity > 0.0)
+		fprintf(f, "%sSoC%sSoH", delim, delim);
+	fprintf(f, "\n");
+}
+
+void log_soc(FILE* f, measurement_t* m, test_t* t)
+{
+	if(t->soc.capacity > 0.0)
+		fprintf(f, "%s%.2f%s%.2f", delim, m->soc, delim, m->soh);
+	fprintf(f, "\n");
+}
 
 int start_log(test_t* t)
 {
@@ -237,11 +560,55 @@ int start_log(test_t* t)
 	sprintf(buf, "%s_summary.log", t->name);
 	t->summary_log = fopen(buf, "a");
 
-	fprintf(t->log, "cycle%stime%smode%scc/cv%svoltage%scurrent%stemperature%scumul.Ah%scumul.Wh%sDCresistance\n",
+	fprintf(t->log, "cycle%stime%smode%scc/cv%svoltage%scurrent%stemperature%scumul.Ah%scumul.Wh%sDCresistance",
 		delim,delim,delim,delim,delim,delim,delim,delim,delim);
+	log_soc_header(t->log, t);
 
-	fprintf(t->verbose_log, "cycle%stime%smode%scc/cv%svoltage%scurrent%stemperature%scumul.Ah%scumul.Wh%sDCresistance\n",
+	fprintf(t->verbose_log, "cycle%stime%smode%scc/cv%svoltage%scurrent%stemperature%scumul.Ah%scumul.Wh%sDCresistance",
 		delim,delim,delim,delim,delim,delim,delim,delim,delim);
+	log_soc_header(t->verbose_log, t);
+
+	log_summary_header(t);
+
+	if(t->profile_file)
+	{
+		sprintf(buf, "%s_profile.log", t->name);
+		t->profile_log = fopen(buf, "a");
+		fprintf(t->profile_log, "round%stime%sprofile%sset_current%smeas_current%svoltage\n",
+			delim,delim,delim,delim,delim);
+		fflush(t->profile_log);
+	}
+
+	if(t->ica_on)
+	{
+		sprintf(buf, "%s_ica.log", t->name);
+		t->ica_log = fopen(buf, "a");
+		fprintf(t->ica_log, "cycle%smode%svoltage%sAh%sdQ/dV%sdV/dQ\n", delim,delim,delim,delim,delim);
+		fflush(t->ica_log);
+
+		sprintf(buf, "%s_icapeaks.log", t->name);
+		t->icapeaks_log = fopen(buf, "a");
+		fprintf(t->icapeaks_log, "cycle%smode", delim);
+		int p;
+		for(p = 1; p <= ICA_MAX_PEAKS; p++)
+			fprintf(t->icapeaks_log, "%speak%d.V%speak%d.dQ/dV%speak%d.shift", delim, p, delim, p, delim, p);
+		fprintf(t->icapeaks_log, "\n");
+		fflush(t->icapeaks_log);
+	}
+
+	int i;
+	for(i = 0; i < t->num_steps; i++)
+	{
+		if(t->program[i].type == STEP_PULSE)
+		{
+			sprintf(buf, "%s_pulse.log", t->name);
+			t->pulse_log = fopen(buf, "a");
+			fprintf(t->pulse_log, "cycle%sstep%stype%stime%scurrent%svoltage%sdV%sdV/dI\n",
+				delim,delim,delim,delim,delim,delim,delim);
+			fflush(t->pulse_log);
+			break;
+		}
+	}
 
 	fflush(t->log);
 	fflush(t->verbose_log);
@@ -249,11 +616,281 @@ int start_log(test_t* t)
 	return 0;
 }
 
+#define FADE_FORGET 0.99   // weight of the previous points at each new one: about 100 cycles of memory
+#define FADE_REF_POINTS 3
+#define FADE_MIN_POINTS 5   // before this, no fit and no stop
+
+void fade_add(fade_fit_t* f, double x, double y)
+{
+	f->sw = f->sw*FADE_FORGET + 1.0;
+	f->sx = f->sx*FADE_FORGET + x;
+	f->sy = f->sy*FADE_FORGET + y;
+	f->sxx = f->sxx*FADE_FORGET + x*x;
+	f->sxy = f->sxy*FADE_FORGET + x*y;
+	f->n++;
+	if(f->initial_n < FADE_REF_POINTS)
+	{
+		f->initial_sum += y;
+		f->initial_n++;
+	}
+}
+
+double fade_slope(fade_fit_t* f)
+{
+	double d = f->sw*f->sxx - f->sx*f->sx;
+	if(f->n < 2 || d <= 0.0)
+		return 0.0;
+	return (f->sw*f->sxy - f->sx*f->sy) / d;
+}
+
+double fade_value(fade_fit_t* f, double x)
+{
+	double b = fade_slope(f);
+	return (f->sy - b*f->sx)/f->sw + b*x;
+}
+
+double fade_initial(fade_fit_t* f)
+{
+	return (f->initial_n)?(f->initial_sum/(double)f->initial_n):(0.0);
+}
+
+void stat_reset(stat_acc_t* s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+void stat_add(stat_acc_t* s, double x, double dt)
+{
+	s->n++;
+	double delta = x - s->mean;
+	s->mean += delta / (double)s->n;
+	s->m2 += delta * (x - s->mean);
+
+	if(s->n == 1 || x < s->min) s->min = x;
+	if(s->n == 1 || x > s->max) s->max = x;
+
+	s->time_integral += x * dt;
+	s->time += dt;
+}
+
+double stat_stddev(stat_acc_t* s)
+{
+	if(s->n < 2)
+		return 0.0;
+	return sqrt(s->m2 / (double)(s->n - 1));
+}
+
+double stat_time_avg(stat_acc_t* s)
+{
+	if(s->time <= 0.0)
+		return 0.0;
+	return s->time_integral / s->time;
+}
+
+void halfcycle_stats_reset(halfcycle_stats_t* h, mode_t mode)
+{
+	memset(h, 0, sizeof(*h));
+	h->mode = mode;
+}
+
+void halfcycle_stats_add(halfcycle_stats_t* h, measurement_t* m, double dt)
+{
+	stat_add(&h->voltage, m->voltage, dt);
+	stat_add(&h->current, m->current, dt);
+	stat_add(&h->temperature, m->temperature, dt);
+	stat_add(&h->power, m->voltage * m->current, dt);
+	if(m->resistance != 0.0)
+	{
+		h->resistance_sum += m->resistance;
+		h->resistance_cnt++;
+	}
+}
+
+void log_stat(FILE* f, stat_acc_t* s, const char* fmt)
+{
+	fprintf(f, fmt, stat_time_avg(s)); fputs(delim, f);
+	fprintf(f, fmt, s->mean); fputs(delim, f);
+	fprintf(f, fmt, stat_stddev(s)); fputs(delim, f);
+	fprintf(f, fmt, s->min); fputs(delim, f);
+	fprintf(f, fmt, s->max); fputs(delim, f);
+}
+
+void log_summary_header(test_t* t)
+{
+	const char* sig[4] = {"voltage", "current", "temperature", "power"};
+	int i;
+	fprintf(t->summary_log, "cycle%smode%sduration%s", delim, delim, delim);
+	for(i = 0; i < 4; i++)
+		fprintf(t->summary_log, "%s.avg%s%s.mean%s%s.stddev%s%s.min%s%s.max%s",
+			sig[i], delim, sig[i], delim, sig[i], delim, sig[i], delim, sig[i], delim);
+	fprintf(t->summary_log, "end.temperature%scumul.Ah%scumul.Wh%sDCresistance", delim, delim, delim);
+	if(t->derate_temp > 0.0)
+		fprintf(t->summary_log, "%sderated.s", delim);
+	fprintf(t->summary_log, "\n");
+}
+
+// One row per halfcycle, from the streaming accumulators.
 void log_summary(measurement_t* m, test_t* t, int time)
 {
-	fprintf(t->summary_log, "%u%s%u%s%.3f%s%.3f%s%.1f%s%.1f%s%.3f%s%.3f\n",
-		t->cycle_cnt, delim, time, delim,
-		t->voltage_avg_acc/((double)time), delim, t->current_avg_acc/((double)time), delim, t->temperature_avg_acc/((double)time), delim, m->temperature, delim, m->cumul_ah, delim, m->cumul_wh);
+	halfcycle_stats_t* h = &t->hc_stats;
+	fprintf(t->summary_log, "%u%s%s%s%u%s", t->cycle_cnt, delim, short_mode_names[h->mode], delim, time, delim);
+	log_stat(t->summary_log, &h->voltage, "%.4f");
+	log_stat(t->summary_log, &h->current, "%.3f");
+	log_stat(t->summary_log, &h->temperature, "%.2f");
+	log_stat(t->summary_log, &h->power, "%.2f");
+	fprintf(t->summary_log, "%.1f%s%.4f%s%.3f%s%.2f", m->temperature, delim, m->cumul_ah, delim, m->cumul_wh, delim,
+		(h->resistance_cnt)?(h->resistance_sum*1000.0/(double)h->resistance_cnt):(0.0));
+	if(t->derate_temp > 0.0)
+		fprintf(t->summary_log, "%s%.0f", delim, t->derate_hc_s);
+	fprintf(t->summary_log, "\n");
+	fflush(t->summary_log);
+}
+
+#define ICA_PEAK_MIN_REL 0.1  // peaks less prominent than this times the highest are ignored
+#define ICA_TRACK_WINDOW 0.05 // V; a peak moving more than this between halfcycles opens a new slot
+
+// Writes the dQ/dV and dV/dQ curve of the halfcycle, and its peaks in their tracked slots.
+void log_ica(test_t* t, mode_t mode)
+{
+	ica_t* h = &t->ica;
+	double peak_v[ICA_MAX_PEAKS], peak_h[ICA_MAX_PEAKS];
+	double slot_v[ICA_MAX_PEAKS], slot_h[ICA_MAX_PEAKS];
+	int k;
+
+	if(ica_curve(h, t->ica_smooth, t->ica_dqdv))
+		return;
+
+	double q = 0.0;
+	for(k = h->lo; k <= h->hi; k++)
+	{
+		q += h->q[k];
+		fprintf(t->ica_log, "%u%s%s%s%.4f%s%.5f%s%.4f%s%.5f\n", t->cycle_cnt, delim, short_mode_names[mode], delim,
+			(k+0.5)*h->bin_v, delim, q, delim, t->ica_dqdv[k], delim, (t->ica_dqdv[k] > 0.0)?(1.0/t->ica_dqdv[k]):(0.0));
+	}
+	fflush(t->ica_log);
+
+	int n = ica_peaks(h, t->ica_dqdv, ICA_PEAK_MIN_REL, peak_v, peak_h, ICA_MAX_PEAKS);
+	ica_track_t* tr = &t->ica_track[(mode == MODE_CHARGE)?(0):(1)];
+	ica_track(tr, peak_v, peak_h, n, ICA_TRACK_WINDOW, slot_v, slot_h);
+
+	fprintf(t->icapeaks_log, "%u%s%s", t->cycle_cnt, delim, short_mode_names[mode]);
+	for(k = 0; k < ICA_MAX_PEAKS; k++)
+	{
+		if(slot_h[k] > 0.0)
+			fprintf(t->icapeaks_log, "%s%.4f%s%.4f%s%.4f", delim, slot_v[k], delim, slot_h[k], delim, slot_v[k] - tr->ref_v[k]);
+		else
+			fprintf(t->icapeaks_log, "%s%s%s", delim, delim, delim);
+	}
+	fprintf(t->icapeaks_log, "\n");
+	fflush(t->icapeaks_log);
+}
+
+void sdt_reset(sdt_t* d, double t, double y)
+{
+	d->t0 = t;
+	d->y0 = y;
+	d->slope_lo = -HUGE_VAL;
+	d->slope_hi = HUGE_VAL;
+}
+
+// Returns 1 if the line from the archived point to the new sample would leave
+// some earlier sample out of band, i.e., the previous sample needs to be archived.
+int sdt_update(sdt_t* d, double t, double y)
+{
+	double dt = t - d->t0;
+	if(dt <= 0.0)
+		return 0;
+
+	double slope = (y - d->y0) / dt;
+	int closed = (slope < d->slope_lo || slope > d->slope_hi);
+
+	double hi = (y + d->band - d->y0) / dt;
+	double lo = (y - d->band - d->y0) / dt;
+	if(hi < d->slope_hi) d->slope_hi = hi;
+	if(lo > d->slope_lo) d->slope_lo = lo;
+
+	return closed;
+}
+
+void write_log_row(measurement_t* m, test_t* t, int cycle, int time)
+{
+	fprintf(t->log, "%u%s%u%s%s%s%s%s%.3f%s%.2f%s%.3f%s%.4f%s%.3f%s%.2f",
+		cycle, delim, time, delim, short_mode_names[m->mode], delim, short_cccv_names[m->cccv], delim,
+		m->voltage, delim, m->current, delim, m->temperature, delim, m->cumul_ah, delim, m->cumul_wh, delim, m->resistance*1000.0);
+	log_soc(t->log, m, t);
+	t->log_rows_out++;
+}
+
+void sdt_reset_all(test_t* t, measurement_t* m, int time)
+{
+	sdt_reset(&t->sdt_voltage, time, m->voltage);
+	sdt_reset(&t->sdt_current, time, m->current);
+	sdt_reset(&t->sdt_temperature, time, m->temperature);
+}
+
+// Writes the sample to the main log, or with log_compress on, only when
+// needed to reconstruct the curves within the configured tolerance.
+// Mode and CC/CV changes, resistance results and cycle boundaries are always written.
+void log_compressed(measurement_t* m, test_t* t, int time)
+{
+	t->log_rows_in++;
+
+	if(!t->log_compress)
+	{
+		write_log_row(m, t, t->cycle_cnt, time);
+		return;
+	}
+
+	int forced = (m->mode != t->last_logged_mode || m->cccv != t->last_logged_cccv ||
+		m->resistance != 0.0 || t->cycle_cnt != t->last_logged_cycle || time < t->last_logged_time ||
+		t->log_rows_out == 0);
+
+	if(forced)
+	{
+		if(t->have_held)
+			write_log_row(&t->held_meas, t, t->held_cycle, t->held_time);
+		write_log_row(m, t, t->cycle_cnt, time);
+		sdt_reset_all(t, m, time);
+		t->have_held = 0;
+	}
+	else
+	{
+		int closed = 0;
+		closed |= sdt_update(&t->sdt_voltage, time, m->voltage);
+		closed |= sdt_update(&t->sdt_current, time, m->current);
+		closed |= sdt_update(&t->sdt_temperature, time, m->temperature);
+
+		if(closed)
+		{
+			write_log_row(&t->held_meas, t, t->held_cycle, t->held_time);
+			sdt_reset_all(t, &t->held_meas, t->held_time);
+			sdt_update(&t->sdt_voltage, time, m->voltage);
+			sdt_update(&t->sdt_current, time, m->current);
+			sdt_update(&t->sdt_temperature, time, m->temperature);
+		}
+
+		memcpy(&t->held_meas, m, sizeof(measurement_t));
+		t->held_time = time;
+		t->held_cycle = t->cycle_cnt;
+		t->have_held = 1;
+	}
+
+	t->last_logged_mode = m->mode;
+	t->last_logged_cccv = m->cccv;
+	t->last_logged_cycle = t->cycle_cnt;
+	t->last_logged_time = time;
+}
+
+// Writes the sample held back by the compression, if any, so the curve ends at
+// its last point when the test stops or the process exits.
+void log_flush_held(test_t* t)
+{
+	if(!t->have_held || t->log == NULL)
+		return;
+	write_log_row(&t->held_meas, t, t->held_cycle, t->held_time);
+	sdt_reset_all(t, &t->held_meas, t->held_time);
+	t->have_held = 0;
+	fflush(t->log);
 }
 
 void log_measurement(measurement_t* m, test_t* t, int time)
@@ -263,27 +900,27 @@ void log_measurement(measurement_t* m, test_t* t, int time)
 		printf("Warn: log == NULL\n");
 		return;
 	}
-	fprintf(t->log, "%u%s%u%s%s%s%s%s%.3f%s%.2f%s%.3f%s%.4f%s%.3f%s%.2f\n",
-		t->cycle_cnt, delim, time, delim, short_mode_names[m->mode], delim, short_cccv_names[m->cccv], delim,
-		m->voltage, delim, m->current, delim, m->temperature, delim, m->cumul_ah, delim, m->cumul_wh, delim, m->resistance*1000.0);
 
-	fprintf(t->verbose_log, "%u%s%u%s%s%s%s%s%.4f%s%.3f%s%.4f%s%.5f%s%.4f%s%.3f\n",
+	log_compressed(m, t, time);
+
+	fprintf(t->verbose_log, "%u%s%u%s%s%s%s%s%.4f%s%.3f%s%.4f%s%.5f%s%.4f%s%.3f",
 		t->cycle_cnt, delim, time, delim, short_mode_names[m->mode], delim, short_cccv_names[m->cccv], delim,
 		m->voltage, delim, m->current, delim, m->temperature, delim, m->cumul_ah, delim, m->cumul_wh, delim, m->resistance*1000.0);
+	log_soc(t->verbose_log, m, t);
 
 	fflush(t->log);
 	fflush(t->verbose_log);
 }
 
-void print_measurement(measurement_t* m, int time)
+void print_measurement(char* name, int cycle, measurement_t* m, int time)
 {
 	if(m->resistance != 0.0)
-		printf("time=%u %s %s V=%.3f I=%.2f T=%.1f Ah=%.4f Wh=%.3f                           R measured = %.2f",
-			time, short_mode_names[m->mode], short_cccv_names[m->cccv],
+		msg(MSGC_TEST, MSG_DEBUG, "test=%s cycle=%u time=%u %s %s V=%.3f I=%.2f T=%.1f Ah=%.4f Wh=%.3f                           R measured = %.2f\n",
+			name, cycle, time, short_mode_names[m->mode], short_cccv_names[m->cccv],
 			m->voltage, m->current, m->temperature, m->cumul_ah, m->cumul_wh, m->resistance*1000.0);
 	else
-		printf("time=%u %s %s V=%.3f I=%.2f T=%.1f Ah=%.4f Wh=%.3f",
-			time, short_mode_names[m->mode], short_cccv_names[m->cccv],
+		msg(MSGC_TEST, MSG_DEBUG, "test=%s cycle=%u time=%u %s %s V=%.3f I=%.2f T=%.1f Ah=%.4f Wh=%.3f\n",
+			name, cycle, time, short_mode_names[m->mode], short_cccv_names[m->cccv],
 			m->voltage, m->current, m->temperature, m->cumul_ah, m->cumul_wh);
 
 //	refresh();
@@ -296,8 +933,11 @@ void print_measurement(measurement_t* m, int time)
 #define HW_MIN_TEMPERATURE 0
 #define HW_MAX_TEMPERATURE 65535
 
-int set_channel_mode(test_t* test, int channel, mode_t mode)
+void safety_set_active(test_t* test, int active);
+
+int set_channel_mode(test_t* test, int idx, mode_t mode)
 {
+	int channel = test->ch[idx].id;
 	usleep(1000);
 	if(mode != MODE_OFF && mode != MODE_CHARGE && mode != MODE_DISCHARGE)
 	{
@@ -330,11 +970,21 @@ int set_channel_mode(test_t* test, int channel, mode_t mode)
 	char expect[32];
 	sprintf(expect, "%s OK", mode_commands[mode]);
 
-	if(comm_autoretry(test->fd, txbuf, expect, NULL))
+	// Under the bus lock, so that the safety monitor's OFF can't come in between.
+	comm_lock(test->ch[idx].fd);
+	if(mode != MODE_OFF && test->safety_tripped)
 	{
+		// Left off; update_test() stops the test.
+		comm_unlock(test->ch[idx].fd);
+		return 0;
+	}
+	if(comm_autoretry(test->ch[idx].fd, txbuf, expect, NULL))
+	{
+		comm_unlock(test->ch[idx].fd);
 		printf("Emergency: failed to set channel %d to mode %s!\n", channel, mode_names[mode]);
 		return -1;
 	}
+	comm_unlock(test->ch[idx].fd);
 
 /*	sprintf(txbuf, "@%u:WDGON;", channel);
 	usleep(1000);
@@ -355,20 +1005,28 @@ int set_test_mode(test_t* test, mode_t mode)
 	for(i = 0; i < test->num_channels; i++)
 	{
 //		usleep(1000);
-//		printf("INFO: Setting channel %d to mode %d\n", test->channels[i], mode);
-		if(set_channel_mode(test, test->channels[i], mode))
+//		printf("INFO: Setting channel %d to mode %d\n", test->ch[i].id, mode);
+		if(set_channel_mode(test, i, mode))
 		{
 			printf("Error setting channel mode!\n");
 			fail = -1;
 		}
 	}
 
+	if(mode != test->cur_mode)
+	{
+		rolling_reset(&test->deriv_v);
+		test->v_peak = 0.0;
+	}
 	test->cur_mode = mode;
+	safety_set_active(test, mode != MODE_OFF);
 	return fail;
 }
 
 int configure_hw(test_t* params, mode_t mode);
 int translate_settings(test_t* params);
+double required_current(test_t* test);
+double run_clock(double start);
 
 int translate_configure_channel_hws(test_t* test, mode_t mode)
 {
@@ -382,30 +1040,17 @@ int translate_configure_channel_hws(test_t* test, mode_t mode)
 	return fail;
 }
 
-int get_channel_idx(test_t* test, int channel_id)
-{
-	int i;
-	for(i = 0; i < test->num_channels; i++)
-	{
-		if(channel_id == test->channels[i])
-			return i;
-	}
-	printf("Error: channel index not found with channel id %d\n", channel_id);
-	return -1;
-}
-
 int clear_hw_measurements(test_t* test)
 {
 	test->cur_meas.num_hw_measurements = 0;
 	return 0;
 }
 
-int add_measurement(test_t* test, int channel_id, hw_measurement_t* hw)
+int add_measurement(test_t* test, int idx, hw_measurement_t* hw)
 {
-	int idx = get_channel_idx(test, channel_id);
-	if(idx < 0)
-		return idx;
-	memcpy(&test->cur_meas.hw_meas[idx], hw, sizeof(hw_measurement_t));
+	if(idx < 0 || idx >= test->num_channels)
+		return -1;
+	memcpy(&test->ch[idx].meas, hw, sizeof(hw_measurement_t));
 	test->cur_meas.num_hw_measurements++;
 	return 0;
 }
@@ -487,6 +1132,14 @@ int parse_hw_measurement(hw_measurement_t* meas, char* str)
 	}
 	chk+=meas->current_setpoint;
 
+	// Input (stationary pack) voltage, on boards that report it.
+	if((p_val = strstr(str, "Vin=")))
+	{
+		if(sscanf(p_val, "Vin=%d", &meas->input_voltage) != 1)
+			return -14;
+		chk+=meas->input_voltage;
+	}
+
 	uint32_t chk_orig;
 	if((p_val = strstr(str, "chk=")))
 	{
@@ -510,18 +1163,27 @@ int parse_hw_measurement(hw_measurement_t* meas, char* str)
 void print_params(test_t* params)
 {
 	int i;
+	for(i = 0; i < params->num_buses; i++)
+		fprintf(params->verbose_log, "bus %d: %s (%s)\n", i, params->device_names[i], chanreg_bus_path(params->rbuses[i]));
 	fprintf(params->verbose_log, "%u parallel channels: ", params->num_channels);
 	for(i = 0; i < params->num_channels; i++)
-		fprintf(params->verbose_log, "%u  ", params->channels[i]);
+		fprintf(params->verbose_log, "%u:%u  ", params->ch[i].bus, params->ch[i].id);
 
 	fprintf(params->verbose_log, "Master channel will be: ");
-	fprintf(params->verbose_log, "%u\n", params->channels[params->master_channel_idx]);
+	fprintf(params->verbose_log, "%u:%u\n", params->ch[params->master_channel_idx].bus, params->ch[params->master_channel_idx].id);
+	if(params->channels_auto)
+		fprintf(params->verbose_log, "channels=auto: allocated for %.2f A\n", required_current(params));
 
 	fprintf(params->verbose_log, "CHARGE: current=%.3f   voltage=%.3f   stop_mode=%s   stop_current=%.3f   stop_voltage=%.3f\n",
 		params->charge.current, params->charge.voltage, short_stop_mode_names[params->charge.stop_mode], params->charge.stop_current, params->charge.stop_voltage);
 	fprintf(params->verbose_log, "DISCHARGE: current=%.3f   voltage=%.3f   stop_mode=%s   stop_current=%.3f   stop_voltage=%.3f\n",
 		params->discharge.current, params->discharge.voltage, short_stop_mode_names[params->discharge.stop_mode], params->discharge.stop_current, params->discharge.stop_voltage);
 
+	fprintf(params->verbose_log, "CHARGE: const_power=%d power=%.2f   const_resistance=%d load_resistance=%.4f   max_current=%.3f\n",
+		params->charge.const_power_mode, params->charge.power, params->charge.const_resistance_mode, params->charge.load_resistance, params->charge.max_current);
+	fprintf(params->verbose_log, "DISCHARGE: const_power=%d power=%.2f   const_resistance=%d load_resistance=%.4f   max_current=%.3f\n",
+		params->discharge.const_power_mode, params->discharge.power, params->discharge.const_resistance_mode, params->discharge.load_resistance, params->discharge.max_current);
+
 	fprintf(params->verbose_log, "HW CHARGE: current=%d   stopcurrent=%d   voltage=%d   stopvoltage=%d\n",
 		params->hw_charge.current, params->hw_charge.stop_current, params->hw_charge.voltage, params->hw_charge.stop_voltage);
 
@@ -530,14 +1192,65 @@ void print_params(test_t* params)
 
 	fprintf(params->verbose_log, "cycling_start=%s   postcharge_cooldown=%u sec   postdischarge_cooldown=%u sec\n",
 		mode_names[params->start_mode], params->postcharge_cooldown, params->postdischarge_cooldown);
+	if(params->cooldown_min >= 0)
+		fprintf(params->verbose_log, "adaptive cooldown: min %d sec, %.1f C over ambient %.1f C (0 = lowest seen), %.2f mV/min\n",
+			params->cooldown_min, params->cooldown_band, params->ambient, params->cooldown_dvdt*1000.0*60.0);
 
 	fprintf(params->verbose_log, "temperature_stop=%f\n", params->temperature_stop);
+	if(params->safety_on)
+		fprintf(params->verbose_log, "safety monitor: T<%.1f C, dT/dt<%.1f C/min, %.3f V<V<%.3f V, current mismatch<%.2f A, deadline %d ms\n",
+			params->safety_temp, params->safety_dtdt, params->safety_vmin, params->safety_vmax, params->safety_imismatch, params->safety_deadline);
+	else
+		fprintf(params->verbose_log, "safety monitor off\n");
 
 	fprintf(params->verbose_log, "resistance_on=%d, interval=%d, interval_offset=%d first_pulse=%d, second_pulse=%d, base_curr=%f, first_curr=%f, second_curr=%f, resistance_every_cycle=%d\n",
 		params->resistance_on, params->resistance_interval, params->resistance_interval_offset, params->resistance_first_pulse_len, params->resistance_second_pulse_len, 
  		params->resistance_base_current_mul, params->resistance_first_pulse_current_mul, params->resistance_second_pulse_current_mul,
 		params->resistance_every_cycle);
 
+	fprintf(params->verbose_log, "log_compress=%d, tolerance V=%.4f I=%.3f T=%.2f\n",
+		params->log_compress, params->sdt_voltage.band, params->sdt_current.band, params->sdt_temperature.band);
+
+	for(i = 0; i < params->num_steps; i++)
+	{
+		step_t* st = &params->program[i];
+		fprintf(params->verbose_log, "step %d: %s", i+1, step_type_names[st->type]);
+		if(st->mode != MODE_UNDEFINED)
+			fprintf(params->verbose_log, " %s current=%.3f voltage=%.3f stop_mode=%s stop_current=%.3f stop_voltage=%.3f",
+				short_mode_names[st->mode], st->settings.current, st->settings.voltage, short_stop_mode_names[st->settings.stop_mode],
+				st->settings.stop_current, st->settings.stop_voltage);
+		if(st->time >= 0)
+			fprintf(params->verbose_log, " time=%d", st->time);
+		if(st->until.var != COND_NONE)
+			fprintf(params->verbose_log, " until=%s%s%g", cond_var_names[st->until.var], cond_op_names[st->until.op], st->until.value);
+		if(st->type == STEP_GOTO || st->type == STEP_LOOP)
+			fprintf(params->verbose_log, " to=%d count=%d", st->target+1, st->count);
+		if(st->cond.var != COND_NONE)
+			fprintf(params->verbose_log, " if=%s%s%g", cond_var_names[st->cond.var], cond_op_names[st->cond.op], st->cond.value);
+		if(st->mode != MODE_UNDEFINED && st->settings.stop_if.var != COND_NONE)
+			fprintf(params->verbose_log, " stopif=%s%s%g", cond_var_names[st->settings.stop_if.var], cond_op_names[st->settings.stop_if.op],
+				st->settings.stop_if.value);
+		fprintf(params->verbose_log, "\n");
+	}
+	for(i = 0; i < params->num_abort_if; i++)
+		fprintf(params->verbose_log, "abortif=%s%s%g\n", cond_var_names[params->abort_if[i].var], cond_op_names[params->abort_if[i].op],
+			params->abort_if[i].value);
+	fprintf(params->verbose_log, "derivative window %d s\n", params->deriv_window);
+
+	if(params->profile_file)
+		fprintf(params->verbose_log, "profile=%s type=%s points=%d duration=%.2f rate=%d repeat=%d\n",
+			params->profile_file, (params->profile_power)?("power"):("current"), params->profile.num_points,
+			profile_duration(&params->profile), params->profile_rate, params->profile_repeat);
+
+	if(params->soc.capacity > 0.0)
+	{
+		fprintf(params->verbose_log, "soc: capacity=%.4f filter=%s rest_time=%.0f init=%.3f ocv points=%d\n",
+			params->soc.capacity, (params->soc.filter == SOC_FILTER_EKF)?("ekf"):("ocv"), params->soc.rest_time,
+			params->soc.init, params->soc.num_ocv_points);
+		for(i = 0; i < params->soc.num_ocv_points; i++)
+			fprintf(params->verbose_log, "  ocv %.1f%% %.4f V\n", params->soc.ocv_soc[i]*100.0, params->soc.ocv_v[i]);
+	}
+
 	fflush(params->log);
 	fflush(params->verbose_log);
 
@@ -545,31 +1258,34 @@ void print_params(test_t* params)
 
 int update_measurement(test_t* test, double elapsed_seconds)
 {
-//	printf("upd_meas: %u , %u\n", test->master_channel_idx, test->cur_meas.hw_meas[test->master_channel_idx].voltage);
-	test->cur_meas.voltage = test->cur_meas.hw_meas[test->master_channel_idx].voltage / 1000.0;
-	test->cur_meas.temperature = ntc_to_c(test->cur_meas.hw_meas[test->master_channel_idx].temperature);
+	hw_measurement_t* master = &test->ch[test->master_channel_idx].meas;
+	test->cur_meas.voltage = master->voltage / 1000.0;
+	test->cur_meas.temperature = ntc_to_c(master->temperature);
+	test->cur_meas.input_voltage = master->input_voltage / 1000.0;
 
-	double current_sum = 0;
+	// Sum in integer mA: exact, and independent of the number of channels.
+	int64_t current_sum_ma = 0;
 	int num_channels_in_mode[4] = {0,0,0,0};
 	int num_channels_in_cccv[3] = {0,0,0};
 	int ch;
 
 	for(ch = 0; ch < test->num_channels; ch++)
 	{
-		current_sum += (double)test->cur_meas.hw_meas[ch].current / 1000.0;
+		hw_measurement_t* hw = &test->ch[ch].meas;
+		current_sum_ma += hw->current;
 
-		int chmode = test->cur_meas.hw_meas[ch].mode;
+		int chmode = hw->mode;
 		if(chmode < 1 || chmode > 3)
 		{
-			printf("Channel %d in illegal mode (%d)!\n", test->channels[ch], chmode);
+			printf("Channel %d in illegal mode (%d)!\n", test->ch[ch].id, chmode);
 			return -1;
 		}
 		num_channels_in_mode[chmode]++;
 
-		int chcccv = test->cur_meas.hw_meas[ch].cccv;
+		int chcccv = hw->cccv;
 		if(chcccv < 1 || chcccv > 2)
 		{
-			printf("Channel %d in illegal CC-CV state (%d)!\n", test->channels[ch], chcccv);
+			printf("Channel %d in illegal CC-CV state (%d)!\n", test->ch[ch].id, chcccv);
 			return -1;
 		}
 		num_channels_in_cccv[chcccv]++;
@@ -599,17 +1315,184 @@ int update_measurement(test_t* test, double elapsed_seconds)
 	else
 		test->cur_meas.cccv = MODE_CC;
 
+	double current_sum = (double)current_sum_ma / 1000.0;
 	test->cur_meas.current = current_sum;
 	test->cur_meas.cumul_ah += current_sum * elapsed_seconds / 3600.0;
 	test->cur_meas.cumul_wh += current_sum * test->cur_meas.voltage * elapsed_seconds / 3600.0;
+	if(test->soc.capacity > 0.0)
+		soc_count(&test->soc, current_sum * elapsed_seconds / 3600.0);
+
+	// ICA bins the CC part of the running halfcycle only; CV would pile up at one voltage.
+	if(test->ica_on && elapsed_seconds > 0.0)
+	{
+		if(test->cur_meas.mode == test->cur_mode && test->cur_mode != MODE_OFF && test->cur_meas.cccv == MODE_CC)
+			ica_add(&test->ica, test->cur_meas.voltage, current_sum * elapsed_seconds / 3600.0);
+		else
+			ica_break(&test->ica);
+	}
+
+
+	return 0;
+}
 
+// Sends per-channel current setpoints (mA) to all channels of the test, as one batch per bus.
+int hw_set_currents(test_t* test, int* currents)
+{
+	static char bufs[MAX_PARALLEL_CHANNELS][32];
+	char* sendbufs[MAX_PARALLEL_CHANNELS];
+	int ch, bus;
+	int fail = 0;
+
+	for(bus = 0; bus < test->num_buses; bus++)
+	{
+		int n = 0;
+		for(ch = 0; ch < test->num_channels; ch++)
+		{
+			if(test->ch[ch].bus != bus)
+				continue;
+			if(test->ch[ch].id < 0 || test->ch[ch].id > MAX_ID || currents[ch] < HW_MIN_CURRENT || currents[ch] > HW_MAX_CURRENT)
+				go_fatal(test->fd, "illegal set current");
+			if(currents[ch] == test->ch[ch].share_last_set)
+				continue;
+			sprintf(bufs[n], "@%u:SETI %d;", test->ch[ch].id, currents[ch]);
+			sendbufs[n] = bufs[n];
+			n++;
+		}
+
+		if(comm_batch(test->fds[bus], n, sendbufs, "SETI OK"))
+		{
+			fail = -1;
+			continue;
+		}
+
+		for(ch = 0; ch < test->num_channels; ch++)
+		{
+			if(test->ch[ch].bus == bus)
+				test->ch[ch].share_last_set = currents[ch];
+		}
+	}
+	return fail;
+}
+
+#define SHARE_GAIN 0.5
+#define SHARE_DEADBAND 30         // mA; smaller deviations are left alone (measurement noise)
+#define SHARE_TRIM_MAX_FRAC 0.2   // trim limit relative to the commanded current
+#define SHARE_MIN_TRIM_LIMIT 200  // mA
+#define SHARE_UPDATE_THRESHOLD 20 // mA; smaller setpoint changes are not sent
+#define SETTLE_MEASUREMENTS 2     // measurements that may still show the state before a new current
+
+// kakkor.c can't include stdlib.h (mode_t), so no abs().
+int iabs(int x)
+{
+	return (x < 0)?(-x):(x);
+}
+
+// Setpoint of slave channel idx: base plus its sharing trim, limited so that a
+// runaway trim can't flip the direction or go far from the commanded current,
+// and clamped to the hardware current range.
+int share_setpoint(test_t* test, int idx, int base)
+{
+	int limit = iabs(base) * SHARE_TRIM_MAX_FRAC;
+	if(limit < SHARE_MIN_TRIM_LIMIT)
+		limit = SHARE_MIN_TRIM_LIMIT;
+	channel_t* c = &test->ch[idx];
+	if(c->share_trim > limit)
+		c->share_trim = limit;
+	if(c->share_trim < -limit)
+		c->share_trim = -limit;
+
+	int set = base + c->share_trim;
+	if((base > 0 && set < 0) || (base < 0 && set > 0))
+		set = 0;
+	if(set > HW_MAX_CURRENT)
+		set = HW_MAX_CURRENT;
+	if(set < HW_MIN_CURRENT)
+		set = HW_MIN_CURRENT;
+	return set;
+}
+
+// Current sharing between paralleled channels, run after every measurement.
+// The master is the reference. In CC, it runs at the commanded current. In CV,
+// the hardware lowers the master setpoint to hold the voltage; the slaves are
+// configured with a higher CV voltage, so they stay in CC and follow it.
+// Each slave has an integral trim that removes its deviation from the master
+// current (channel gain/offset differences, wiring resistance).
+// The SETTLE_MEASUREMENTS measurements after a new test current was commanded
+// may still show the old state; these are skipped.
+int current_sharing(test_t* test)
+{
+	hw_measurement_t* master = &test->ch[test->master_channel_idx].meas;
+	int sets[MAX_PARALLEL_CHANNELS];
+	int base = test->share_cmd;
+	int ch;
+	int changed = 0;
+
+	if(test->num_channels < 2 || !test->meas_settled)
+		return 0;
+	if(master->mode != MODE_CHARGE && master->mode != MODE_DISCHARGE)
+		return 0;
+
+	if(master->cccv == MODE_CV)
+	{
+		if(master->current_setpoint < HW_MIN_CURRENT || master->current_setpoint > HW_MAX_CURRENT ||
+		   (master->mode == MODE_CHARGE && master->current_setpoint < test->hw_charge.stop_current) ||
+		   (master->mode == MODE_DISCHARGE && master->current_setpoint > test->hw_discharge.stop_current))
+		{
+			msg(MSGC_HW, MSG_ERROR, "Illegal master current setpoint (%d mA), aborting current sharing.\n", master->current_setpoint);
+			return -1;
+		}
+		base = master->current_setpoint;
+		// The master can only lower its current in CV; never drive the slaves above the command.
+		if(iabs(base) > iabs(test->share_cmd))
+			base = test->share_cmd;
+	}
+
+	for(ch = 0; ch < test->num_channels; ch++)
+	{
+		if(ch == test->master_channel_idx)
+		{
+			sets[ch] = test->ch[ch].share_last_set;
+			continue;
+		}
 
+		hw_measurement_t* hw = &test->ch[ch].meas;
+		int err = master->current - hw->current;
+		int trim = test->ch[ch].share_trim;
+		if(hw->mode == master->mode && hw->cccv == MODE_CC && iabs(err) > SHARE_DEADBAND)
+			test->ch[ch].share_trim += SHARE_GAIN * err;
+
+		sets[ch] = share_setpoint(test, ch, base);
+		// Anti-windup: a channel at the hardware limit can't follow; hold its trim at the limit.
+		if((sets[ch] == HW_MAX_CURRENT && test->ch[ch].share_trim > trim) ||
+		   (sets[ch] == HW_MIN_CURRENT && test->ch[ch].share_trim < trim))
+			test->ch[ch].share_trim = sets[ch] - base;
+		if(iabs(sets[ch] - test->ch[ch].share_last_set) > SHARE_UPDATE_THRESHOLD)
+			changed = 1;
+		else
+			sets[ch] = test->ch[ch].share_last_set;
+	}
+
+	if(!changed)
+		return 0;
+
+	msg(MSGC_HW, MSG_DEBUG, "dbg: %s: current sharing: master %d mA (%s), base %d mA\n",
+		test->name, master->current, (master->cccv == MODE_CV)?("CV"):("CC"), base);
+	fprintf(test->verbose_log, "current_sharing: master %d mA, base %d mA, setpoints:", master->current, base);
+	for(ch = 0; ch < test->num_channels; ch++)
+		fprintf(test->verbose_log, " %u:%d", test->ch[ch].id, sets[ch]);
+	fprintf(test->verbose_log, "\n");
+
+	if(hw_set_currents(test, sets))
+	{
+		msg(MSGC_HW, MSG_ERROR, "%s: cannot set current sharing setpoints\n", test->name);
+		return -1;
+	}
 	return 0;
 }
 
-int hw_set_current(int fd, int channel, int current);
+void safety_feed(test_t* test, hw_measurement_t* meas);
 
-int measure_hw(test_t* test, int horrible_kludge)
+int measure_hw(test_t* test)
 {
 	char txbuf[100];
 	char expectbuf[100];
@@ -617,92 +1500,95 @@ int measure_hw(test_t* test, int horrible_kludge)
 	int i;
 	int ret;
 
-	uart_flush(test->fd);
+	for(i = 0; i < test->num_buses; i++)
+		uart_flush(test->fds[i]);
 	for(i = 0; i < test->num_channels; i++)
 	{
-		sprintf(txbuf, "@%u:VERB;", test->channels[i]);
-		sprintf(expectbuf, "%u:MEAS ", test->channels[i]);
-		if(comm_autoretry(test->fd, txbuf, expectbuf, rxbuf))
+		channel_t* c = &test->ch[i];
+		sprintf(txbuf, "@%u:VERB;", c->id);
+		sprintf(expectbuf, "%u:MEAS ", c->id);
+		if(comm_autoretry(c->fd, txbuf, expectbuf, rxbuf))
 		{
-			printf("Error getting measurement data\n");
+			msg(MSGC_HW, MSG_ERROR, "%s: getting measurement data from channel %u:%u failed\n", test->name, c->bus, c->id);
 			return -1;
 		}
 
-		printf("measure_hw: from %3u: %s\n", test->channels[i], rxbuf);
-		fprintf(test->verbose_log, "measure_hw: from %3u: %s\n", test->channels[i], rxbuf);
+		msg(MSGC_HW, MSG_DEBUG, "measure_hw: from %u:%3u: %s\n", c->bus, c->id, rxbuf);
+		fprintf(test->verbose_log, "measure_hw: from %u:%3u: %s\n", c->bus, c->id, rxbuf);
 
 		hw_measurement_t meas;
 		if((ret = parse_hw_measurement(&meas, rxbuf)))
 		{
-			printf("Error: parse_hw_measurement returned %d\n", ret);
+			msg(MSGC_HW, MSG_ERROR, "parse_hw_measurement returned %d\n", ret);
 			return -1;
 		}
 
-		if((ret = add_measurement(test, test->channels[i], &meas)))
+		if((ret = add_measurement(test, i, &meas)))
 		{
-			printf("Error: add_measurement returned %d\n", ret);
+			msg(MSGC_HW, MSG_ERROR, "add_measurement returned %d\n", ret);
 			return -1;
 		}
-
-		if(i == test->master_channel_idx && meas.cccv == MODE_CV && !horrible_kludge)
-		{
-			printf("Info: Master in CV - copying master current (%d mA) to slaves... ", meas.current_setpoint); fflush(stdout);
-			if(meas.current_setpoint < HW_MIN_CURRENT || meas.current_setpoint > HW_MAX_CURRENT ||
-			   (meas.mode == MODE_CHARGE && meas.current_setpoint < test->hw_charge.stop_current) ||
-			   (meas.mode == MODE_DISCHARGE && meas.current_setpoint > test->hw_discharge.stop_current))
-			{
-				printf("Illegal master current setpoint (%d mA), aborting copy.\n", meas.current_setpoint);
-				return -1;
-			}
-			int ch;
-			for(ch = 0; ch < test->num_channels; ch++)
-			{
-				if(ch == test->master_channel_idx)
-					continue;
-				printf(" %d  ", test->channels[ch]);
-				if(hw_set_current(test->fd, test->channels[ch], meas.current_setpoint))
-				{
-					printf("Error: Cannot set current. ");
-				}
-			}
-			printf("\n");
-		}
-
+		if(i == test->master_channel_idx)
+			safety_feed(test, &meas);
 	}
 
 	if(test->cur_meas.num_hw_measurements != test->num_channels)
 	{
-		printf("Error: didn't get measurements from all channels\n");
+		msg(MSGC_HW, MSG_ERROR, "didn't get measurements from all channels\n");
 		return -1;
 	}
 
-	return 0;
+	return current_sharing(test);
 }
 
-int hw_set_current(int fd, int channel, int current)
+// Commands the total test current (A), split equally between the channels.
+// The slaves keep their current sharing trims.
+int test_set_current(test_t* test, double current)
 {
-	char buf[32];
-	if(channel < 0 || channel > MAX_ID || current < HW_MIN_CURRENT || current > HW_MAX_CURRENT)
-		go_fatal(fd, "illegal set current");
-//		return -2;
-	sprintf(buf, "@%u:SETI %d;", channel, current);
-	if(comm_autoretry(fd, buf, "SETI OK", NULL))
+	int sets[MAX_PARALLEL_CHANNELS];
+	int ch;
+
+	test->share_cmd = current*1000.0/(double)test->num_channels;
+	for(ch = 0; ch < test->num_channels; ch++)
+	{
+		if(ch == test->master_channel_idx)
+			sets[ch] = test->share_cmd;
+		else
+			sets[ch] = share_setpoint(test, ch, test->share_cmd);
+	}
+
+	test->settle_skip = SETTLE_MEASUREMENTS;
+	if(hw_set_currents(test, sets))
+	{
+		printf("Error: Cannot set current. ");
 		return -1;
+	}
 	return 0;
 }
 
-int test_set_current(test_t* test, double current)
+// Voltage offsets of channel i for the mode, mV: the slaves get their CV voltage
+// and stop voltage further out so that the master's limits are the ones that act.
+void hw_channel_extras(test_t* params, int i, mode_t mode, int* extra_vcv, int* extra_vstop)
 {
-	int ch;
-	for(ch = 0; ch < test->num_channels; ch++)
+	*extra_vstop = 0;
+	*extra_vcv = 200;
+
+	if(i == params->master_channel_idx)
 	{
-		if(hw_set_current(test->fd, test->channels[ch], current*1000.0/(double)test->num_channels))
-		{
-			printf("Error: Cannot set current. ");
-			return -1;
-		}
+		*extra_vstop = 0;
+		*extra_vcv = 0;
+	}
+	else if(mode == MODE_DISCHARGE)
+	{
+		*extra_vstop += 500;
+		*extra_vcv += 200;
+	}
+
+	if(mode == MODE_DISCHARGE)
+	{
+		*extra_vstop *= -1;
+		*extra_vcv *= -1;
 	}
-	return 0;
 }
 
 int configure_hw(test_t* params, mode_t mode)
@@ -720,82 +1606,137 @@ int configure_hw(test_t* params, mode_t mode)
 		return -2;
 	}
 
-	uart_flush(params->fd);
+	params->share_cmd = settings->current;
+	params->settle_skip = SETTLE_MEASUREMENTS;
+
+	for(i = 0; i < params->num_buses; i++)
+		uart_flush(params->fds[i]);
 	for(i = 0; i < params->num_channels; i++)
 	{
-		int extra_vstop = 0;
-		int extra_vcv = 200;
-
-		if(i == params->master_channel_idx)
-		{
-//			printf("Info: Channel %d is master.\n", params->channels[i]);
-			extra_vstop = 0;
-			extra_vcv = 0;
-
-		}
-		else
-		{
-			if(mode == MODE_DISCHARGE)
-			{
-				extra_vstop += 500;
-				extra_vcv += 200;
-			}
-		}
-
-		if(mode == MODE_DISCHARGE)
-		{
-			extra_vstop *= -1;
-			extra_vcv *= -1;
-		}
+		channel_t* c = &params->ch[i];
+		int extra_vstop, extra_vcv;
+		hw_channel_extras(params, i, mode, &extra_vcv, &extra_vstop);
 
-		printf("Info: configuring channel %3u: ", params->channels[i]); fflush(stdout);
-		sprintf(buf, "@%u:OFF;", params->channels[i]);
+		printf("Info: configuring channel %u:%3u: ", c->bus, c->id); fflush(stdout);
+		sprintf(buf, "@%u:OFF;", c->id);
 		fprintf(params->verbose_log, "    %s", buf);
-		if(comm_autoretry(params->fd, buf, "OFF OK", NULL))
+		if(comm_autoretry(c->fd, buf, "OFF OK", NULL))
 			return -1;
 
 		usleep(1000);
 
-		sprintf(buf, "@%u:SETI %d;", params->channels[i], settings->current);
+		sprintf(buf, "@%u:SETI %d;", c->id, settings->current);
 		printf("%s", buf); fflush(stdout);
 		fprintf(params->verbose_log, "    %s", buf);
-		if(comm_autoretry(params->fd, buf, "SETI OK", NULL))
+		if(comm_autoretry(c->fd, buf, "SETI OK", NULL))
 			return -1;
+		c->share_trim = 0;
+		c->share_last_set = settings->current;
 
 		usleep(1000);
 
-		sprintf(buf, "@%u:SETV %d;", params->channels[i], settings->voltage+extra_vcv);
+		sprintf(buf, "@%u:SETV %d;", c->id, settings->voltage+extra_vcv);
 		printf("      %s", buf); fflush(stdout);
 		fprintf(params->verbose_log, "    %s", buf);
-		if(comm_autoretry(params->fd, buf, "SETV OK", NULL))
+		if(comm_autoretry(c->fd, buf, "SETV OK", NULL))
 			return -1;
 
 		usleep(1000);
 
-		sprintf(buf, "@%u:SETISTOP %d;", params->channels[i], settings->stop_current);
+		sprintf(buf, "@%u:SETISTOP %d;", c->id, settings->stop_current);
 		printf("      %s", buf); fflush(stdout);
 		fprintf(params->verbose_log, "    %s", buf);
-		if(comm_autoretry(params->fd, buf, "SETISTOP OK", NULL))
+		if(comm_autoretry(c->fd, buf, "SETISTOP OK", NULL))
 			return -1;
 
 		usleep(1000);
 
-		sprintf(buf, "@%u:SETVSTOP %d;", params->channels[i], settings->stop_voltage+extra_vstop);
+		sprintf(buf, "@%u:SETVSTOP %d;", c->id, settings->stop_voltage+extra_vstop);
 		printf("      %s\n", buf);
 		fprintf(params->verbose_log, "    %s\n", buf);
-		if(comm_autoretry(params->fd, buf, "SETVSTOP OK", NULL))
+		if(comm_autoretry(c->fd, buf, "SETVSTOP OK", NULL))
 			return -1;
 
 		usleep(1000);
 
 	}
 
+	params->profile_hw_mode = mode;
+	return 0;
+}
+
+// Sends the voltage and stop current limits of the mode to all channels, one
+// batch per command and bus, without the OFF and the console output of
+// configure_hw(); for the direction changes of profile playback. The current
+// setpoint is left to the caller.
+int hw_set_limits(test_t* test, mode_t mode)
+{
+	static char bufs[3][MAX_PARALLEL_CHANNELS][32];
+	char* sendbufs[MAX_PARALLEL_CHANNELS];
+	char* expect[3] = {"SETV OK", "SETISTOP OK", "SETVSTOP OK"};
+	hw_base_settings_t* settings = (mode == MODE_CHARGE)?(&test->hw_charge):(&test->hw_discharge);
+	int ch, bus, k;
+
+	for(bus = 0; bus < test->num_buses; bus++)
+	{
+		int n = 0;
+		for(ch = 0; ch < test->num_channels; ch++)
+		{
+			int extra_vcv, extra_vstop;
+			if(test->ch[ch].bus != bus)
+				continue;
+			hw_channel_extras(test, ch, mode, &extra_vcv, &extra_vstop);
+			sprintf(bufs[0][n], "@%u:SETV %d;", test->ch[ch].id, settings->voltage+extra_vcv);
+			sprintf(bufs[1][n], "@%u:SETISTOP %d;", test->ch[ch].id, settings->stop_current);
+			sprintf(bufs[2][n], "@%u:SETVSTOP %d;", test->ch[ch].id, settings->stop_voltage+extra_vstop);
+			test->ch[ch].share_trim = 0;
+			n++;
+		}
+		for(k = 0; k < 3; k++)
+		{
+			for(ch = 0; ch < n; ch++)
+				sendbufs[ch] = bufs[k][ch];
+			if(comm_batch(test->fds[bus], n, sendbufs, expect[k]))
+				return -1;
+		}
+	}
+	test->profile_hw_mode = mode;
+	fprintf(test->verbose_log, "Info: %s limits sent\n", short_mode_names[mode]);
 	return 0;
 }
 
+#define MIN_CURRENT 0.2
+#define MAX_CURRENT 1000.0
+
+// Current for constant power/resistance mode at voltage v, within the current limit.
+double const_power_current(base_settings_t* b, double v)
+{
+	double cur = (b->const_power_mode)?(b->power / v):(v / b->load_resistance);
+	if(cur > b->max_current)
+		cur = b->max_current;
+	if(cur < MIN_CURRENT)
+		cur = MIN_CURRENT;
+	return cur;
+}
+
+// Resistance pulses are not run inside pulse steps; those are the measurement themselves.
+int pulse_step_running(test_t* test)
+{
+	return test->program_state == PROGRAM_RUNNING && test->program[test->step_idx].type == STEP_PULSE;
+}
+
 int translate_settings(test_t* params)
 {
-	params->hw_charge.current = (int)( ((params->resistance_on && (params->cycle_cnt % params->resistance_every_cycle)==0)?(params->resistance_base_current_mul):(1.0)) * params->charge.current*1000.0/params->num_channels);
+	// Feed-forward the starting current from the latest (rest) voltage, if we have one.
+	if(params->cur_meas.voltage > 0.5)
+	{
+		if(params->charge.const_power_mode || params->charge.const_resistance_mode)
+			params->charge.current = const_power_current(&params->charge, params->cur_meas.voltage);
+		if(params->discharge.const_power_mode || params->discharge.const_resistance_mode)
+			params->discharge.current = const_power_current(&params->discharge, params->cur_meas.voltage);
+	}
+
+	params->hw_charge.current = (int)( ((params->resistance_on && !pulse_step_running(params) && (params->cycle_cnt % params->resistance_every_cycle)==0)?(params->resistance_base_current_mul):(1.0)) * params->charge.current*1000.0/params->num_channels);
 	if(params->charge.stop_mode == STOP_MODE_CURRENT)
 	{
 		params->hw_charge.stop_current = (int)(params->charge.stop_current*1000.0/params->num_channels);
@@ -817,7 +1758,7 @@ int translate_settings(test_t* params)
 		return 1;
 	}
 
-	params->hw_discharge.current = -1*((int)( ((params->resistance_on && (params->cycle_cnt % params->resistance_every_cycle)==0)?(params->resistance_base_current_mul):(1.0)) * params->discharge.current*1000.0/params->num_channels));
+	params->hw_discharge.current = -1*((int)( ((params->resistance_on && !pulse_step_running(params) && (params->cycle_cnt % params->resistance_every_cycle)==0)?(params->resistance_base_current_mul):(1.0)) * params->discharge.current*1000.0/params->num_channels));
 	if(params->discharge.stop_mode == STOP_MODE_CURRENT)
 	{
 		params->hw_discharge.stop_current = -1*((int)(params->discharge.stop_current*1000.0/params->num_channels));
@@ -843,12 +1784,63 @@ int translate_settings(test_t* params)
 
 }
 
-#define MIN_CURRENT 0.2
-#define MAX_CURRENT 1000.0
+
+// Constant power and constant resistance modes: the user's current (if given) becomes
+// the current limit, and a starting current is inferred from the voltage settings.
+int check_const_power_settings(char* name, base_settings_t* params, int num_channels, mode_t mode)
+{
+	double hw_limit = (double)(HW_MAX_CURRENT-200)/1000.0 * num_channels;
+	double v_est = (params->stop_voltage != 0.0)?(params->stop_voltage):(params->voltage);
+
+	if(!params->const_power_mode && !params->const_resistance_mode)
+		return 0;
+
+	if(params->const_power_mode && params->const_resistance_mode)
+	{
+		printf("ERROR: %s: both power and loadresistance defined\n", name);
+		return 1;
+	}
+
+	if(v_est < 1.0)
+	{
+		printf("ERROR: %s: constant power/resistance mode needs voltage or stopvoltage\n", name);
+		return 1;
+	}
+
+	if(params->const_resistance_mode && (params->load_resistance < 0.001 || params->load_resistance > 100.0))
+	{
+		printf("ERROR: %s: Illegal loadresistance: %.4f\n", name, params->load_resistance);
+		return 1;
+	}
+
+	params->max_current = params->current;
+	if(params->max_current == 0.0 || params->max_current > hw_limit)
+		params->max_current = hw_limit;
+
+	if(mode == MODE_DISCHARGE && params->const_power_mode && params->stop_mode != STOP_MODE_CURRENT && params->stop_voltage != 0.0)
+	{
+		double cur_per_ch = params->power / params->stop_voltage / num_channels;
+		printf("INFO: %s: Constant power: maximum current per channel = %f at end voltage %f\n", name, cur_per_ch, params->stop_voltage);
+		if(cur_per_ch > ((double)(HW_MAX_CURRENT-200)/1000.0))
+		{
+			printf("ERROR: %s: Constant power: maximum channel current is exceeded!\n", name);
+			return 1;
+		}
+	}
+
+	double start_cur = (params->const_power_mode)?(params->power / v_est):(v_est / params->load_resistance);
+	if(start_cur > params->max_current)
+		start_cur = params->max_current;
+	printf("INFO: %s: Constant %s: current limit %.3f A, inferring default (starting) current=%f\n",
+		name, (params->const_power_mode)?("power"):("resistance"), params->max_current, start_cur);
+	params->current = start_cur;
+
+	return 0;
+}
 
 int check_base_settings(char* name, base_settings_t* params)
 {
-	if(params->current == 0.0 && !params->const_power_mode)
+	if(params->current == 0.0 && !params->const_power_mode && !params->const_resistance_mode)
 	{
 		printf("ERROR: %s: Current missing\n", name);
 		return 1;
@@ -899,17 +1891,6 @@ int check_base_settings(char* name, base_settings_t* params)
 		return 1;
 	}
 
-	if(params->const_power_mode)
-	{
-		if(params->stop_mode != STOP_MODE_VOLTAGE)
-		{
-			printf("ERROR: %s: Constant power mode requires stopmode=voltage.\n", name);
-			return 1;
-		}
-
-	}
-
-
 	if(params->current < MIN_CURRENT || params->current > MAX_CURRENT)
 	{
 		printf("ERROR: %s: Illegal current: %.3f\n", name, params->current);
@@ -920,156 +1901,839 @@ int check_base_settings(char* name, base_settings_t* params)
 	return 0;
 }
 
-int check_params(test_t* params)
+#define PROFILE_MAX_RATE 10
+#define PROFILE_REST_CURRENT 0.05 // A; smaller setpoints turn the channels off
+
+// Profile playback: the charge and discharge settings only give the voltage limits,
+// the currents come from the profile.
+int check_profile_settings(test_t* params)
 {
-	int i;
+	double hw_limit = (double)(HW_MAX_CURRENT-200)/1000.0 * params->num_channels;
 
-	if(params->num_channels < 1 || params->num_channels > MAX_PARALLEL_CHANNELS)
+	if(params->resistance_on || params->charge.const_power_mode || params->charge.const_resistance_mode ||
+	   params->discharge.const_power_mode || params->discharge.const_resistance_mode)
 	{
-		printf("Illegal number of parallel channels: %u\n", params->num_channels);
-		return -1;
+		printf("ERROR: profile can't be combined with resistance=on, power= or loadresistance=\n");
+		return 1;
 	}
 
-	for(i = 0; i < params->num_channels; i++)
+	if(profile_load(&params->profile, params->profile_file))
+		return 1;
+
+	if(params->profile_rate == 0)
+		params->profile_rate = PROFILE_MAX_RATE;
+	if(params->profile_repeat == 0)
+		params->profile_repeat = 1;
+
+	if(!params->profile_power && (profile_max(&params->profile) > hw_limit || profile_min(&params->profile) < -hw_limit))
 	{
-		if(params->channels[i] < MIN_ID || params->channels[i] > MAX_ID)
-		{
-			printf("Illegal channel ID: %u\n", params->channels[i]);
-			return -1;
-		}
+		printf("ERROR: profile current exceeds %.1f A (%d channels)\n", hw_limit, params->num_channels);
+		return 1;
 	}
 
-	if(params->resistance_on)
+	// Starting currents of the halfcycles are set from the profile as it runs.
+	if(params->charge.current == 0.0)
+		params->charge.current = MIN_CURRENT;
+	if(params->discharge.current == 0.0)
+		params->discharge.current = MIN_CURRENT;
+
+	printf("INFO: %s: %s profile %s, %d points, %.1f s, %d Hz, %d times\n", params->name,
+		(params->profile_power)?("power"):("current"), params->profile_file, params->profile.num_points,
+		profile_duration(&params->profile), params->profile_rate, params->profile_repeat);
+	return 0;
+}
+
+// Parses durations like 90, 90s, 15m, 2h into seconds.
+int parse_duration(char* str, int* seconds)
+{
+	double val;
+	char unit = 's';
+	int n = sscanf(str, "%lf%c", &val, &unit);
+	if(n < 1 || val < 0)
+		return -1;
+	if(unit == 'm' || unit == 'M')
+		val *= 60.0;
+	else if(unit == 'h' || unit == 'H')
+		val *= 3600.0;
+	else if(unit != 's' && unit != 'S')
+		return -1;
+	*seconds = (int)(val + 0.5);
+	return 0;
+}
+
+int parse_cond(char* str, cond_t* c)
+{
+	const char* ops[5] = {"<=", ">=", "<", ">", "%"};
+	const cond_op_t op_codes[5] = {OP_LE, OP_GE, OP_LT, OP_GT, OP_MOD};
+	int i, v;
+
+	for(v = 1; v < NUM_COND_VARS; v++)
 	{
-		if(params->resistance_interval < 20 || params->resistance_interval > 600)
+		int len = strlen(cond_var_names[v]);
+		if(strncasecmp(str, cond_var_names[v], len) != 0)
+			continue;
+		for(i = 0; i < 5; i++)
 		{
-			printf("ERROR: Illegal resistance_interval (%u)\n", params->resistance_interval);
-			return -1;
+			int oplen = strlen(ops[i]);
+			if(strncmp(str+len, ops[i], oplen) != 0)
+				continue;
+			c->var = v;
+			c->op = op_codes[i];
+			if(v == COND_TIME)
+			{
+				int sec;
+				if(parse_duration(str+len+oplen, &sec))
+					return -1;
+				c->value = sec;
+			}
+			else if(v == COND_DVDT || v == COND_DTDT)
+			{
+				// Rates are per minute; "/s" and "/h" are converted.
+				char unit[8] = "";
+				if(sscanf(str+len+oplen, "%lf%7s", &c->value, unit) < 1)
+					return -1;
+				if(strcmp(unit, "/s") == 0)
+					c->value *= 60.0;
+				else if(strcmp(unit, "/h") == 0)
+					c->value /= 60.0;
+				else if(unit[0] && strcmp(unit, "/min") != 0)
+					return -1;
+			}
+			else if(sscanf(str+len+oplen, "%lf", &c->value) != 1)
+				return -1;
+			if(c->op == OP_MOD && c->value < 1.0)
+				return -1;
+			return 0;
 		}
-		params->resistance_base_current_mul = 1.0 /
-			(((double)(params->resistance_first_pulse_len)*(params->resistance_first_pulse_current_mul) +
-			(double)(params->resistance_second_pulse_len)*(params->resistance_second_pulse_current_mul) +
-			(double)(params->resistance_interval - params->resistance_first_pulse_len - params->resistance_second_pulse_len)*1.0)
-			/(double)(params->resistance_interval));
+	}
+	return -1;
+}
 
-		if(params->resistance_base_current_mul < 1.0 || params->resistance_base_current_mul > 1.2)
-		{
-			printf("ERROR: Inferred resistance_base_current_mul out of range (%f)\n", params->resistance_base_current_mul);
-			return -1;
-		}
+// Compiles one step= token, "type[,key=value]...". Jump targets are left as text
+// in *target_label for compile_program() to resolve.
+int compile_step(test_t* params, step_t* st, char* src, char* target_label)
+{
+	char buf[256];
+	char* saveptr;
+	char* p;
+	int t;
+	int have_current = 0, have_voltage = 0, have_stop_voltage = 0, have_stop_current = 0;
+	double current = 0.0, voltage = 0.0, stop_voltage = 0.0, stop_current = 0.0;
 
-		if(params->resistance_every_cycle < 1 || params->resistance_every_cycle > 100)
-		{
-			printf("ERROR: Illegal resistance_every_cycle (%u)\n", params->resistance_every_cycle);
-			return -1;
-		}
+	memset(st, 0, sizeof(*st));
+	st->time = -1;
+	target_label[0] = 0;
+	strncpy(buf, src, sizeof(buf)-1);
+	buf[sizeof(buf)-1] = 0;
 
-		printf("INFO: Resistance measurement on, inferring resistance_base_current_mul = %f\n", params->resistance_base_current_mul);
+	p = strtok_r(buf, ",", &saveptr);
+	if(p == NULL)
+		return -1;
+	for(t = 0; t < NUM_STEP_TYPES; t++)
+		if(strcmp(p, step_type_names[t]) == 0)
+			break;
+	if(t == NUM_STEP_TYPES)
+	{
+		printf("ERROR: unknown step type \"%s\"\n", p);
+		return -1;
 	}
+	st->type = t;
 
-	if(params->discharge.const_power_mode)
+	while((p = strtok_r(NULL, ",", &saveptr)))
 	{
-		if(params->resistance_on_discharge_too)
+		if(strstr(p, "label=") == p)
+			strncpy(st->label, p+strlen("label="), STEP_LABEL_LEN-1);
+		else if(sscanf(p, "current=%lf", &current) == 1)
+			have_current = 1;
+		else if(sscanf(p, "voltage=%lf", &voltage) == 1)
+			have_voltage = 1;
+		else if(sscanf(p, "stopvoltage=%lf", &stop_voltage) == 1)
+			have_stop_voltage = 1;
+		else if(sscanf(p, "stopcurrent=%lf", &stop_current) == 1)
+			have_stop_current = 1;
+		else if(strstr(p, "time=") == p)
 		{
-			printf("ERROR: Cannot use const power mode when \"resistance=on\". Use \"resistance=charge\".\n");
-			return -1;
+			if(parse_duration(p+strlen("time="), &st->time))
+			{
+				printf("ERROR: illegal step time \"%s\"\n", p);
+				return -1;
+			}
 		}
-		double cur_per_ch = params->discharge.power / params->discharge.stop_voltage / params->num_channels;
-		printf("INFO: Constant power: maximum current per channel = %f at end voltage %f\n", cur_per_ch, params->discharge.stop_voltage);
-		if(cur_per_ch > ((double)(HW_MAX_CURRENT-200)/1000.0))
+		else if(strstr(p, "until=") == p)
 		{
-			printf("ERROR: Constant power: maximum channel current is exceeded!\n");
-			return 1;
+			if(parse_cond(p+strlen("until="), &st->until))
+			{
+				printf("ERROR: illegal step condition \"%s\"\n", p);
+				return -1;
+			}
 		}
+		else if(strstr(p, "if=") == p)
+		{
+			if(parse_cond(p+strlen("if="), &st->cond))
+			{
+				printf("ERROR: illegal step condition \"%s\"\n", p);
+				return -1;
+			}
+		}
+		else if(strstr(p, "to=") == p)
+			strncpy(target_label, p+strlen("to="), STEP_LABEL_LEN-1);
+		else if(sscanf(p, "count=%d", &st->count) == 1)
+			;
+		else
+		{
+			printf("ERROR: unknown step parameter \"%s\"\n", p);
+			return -1;
+		}
+	}
 
-		double start_cur = params->discharge.power / params->discharge.stop_voltage * 0.7;
-		printf("INFO: Constant power: inferring default (starting) current=%f", start_cur);
-		params->discharge.current = start_cur;
-
+	switch(st->type)
+	{
+		case STEP_CHARGE:
+			st->mode = MODE_CHARGE;
+			st->settings = params->charge;
+			break;
+		case STEP_DISCHARGE:
+			st->mode = MODE_DISCHARGE;
+			st->settings = params->discharge;
+			break;
+		case STEP_PULSE:
+			if(!have_current || current == 0.0 || st->time < 1)
+			{
+				printf("ERROR: pulse step needs nonzero current= and time=\n");
+				return -1;
+			}
+			st->mode = (current > 0.0)?(MODE_CHARGE):(MODE_DISCHARGE);
+			st->settings = (current > 0.0)?(params->charge):(params->discharge);
+			st->settings.const_power_mode = 0;
+			st->settings.const_resistance_mode = 0;
+			st->settings.stop_if.var = COND_NONE;
+			st->settings.current = fabs(current);
+			break;
+		case STEP_CC:
+		case STEP_CCCV:
+		case STEP_CV:
+			if(!have_current || current == 0.0)
+			{
+				printf("ERROR: %s step needs nonzero current= (negative for discharge)\n", step_type_names[st->type]);
+				return -1;
+			}
+			if(st->type == STEP_CC && !have_stop_voltage)
+			{
+				printf("ERROR: cc step needs stopvoltage=\n");
+				return -1;
+			}
+			if(st->type != STEP_CC && (!have_voltage || !have_stop_current))
+			{
+				printf("ERROR: %s step needs voltage= and stopcurrent=\n", step_type_names[st->type]);
+				return -1;
+			}
+			st->mode = (current > 0.0)?(MODE_CHARGE):(MODE_DISCHARGE);
+			memset(&st->settings, 0, sizeof(st->settings));
+			st->settings.current = fabs(current);
+			if(st->type == STEP_CC)
+				st->settings.stop_voltage = stop_voltage;
+			else
+			{
+				// The hardware always limits the current; CV is CC-CV with current= as the limit.
+				st->settings.voltage = voltage;
+				st->settings.stop_current = stop_current;
+			}
+			if(check_base_settings("step", &st->settings))
+				return -1;
+			break;
+		case STEP_REST:
+			if(st->time < 0 && st->until.var == COND_NONE)
+			{
+				printf("ERROR: rest step needs time= or until=\n");
+				return -1;
+			}
+			break;
+		case STEP_LOOP:
+			if(st->count < 1 || !target_label[0])
+			{
+				printf("ERROR: loop step needs to= and count=\n");
+				return -1;
+			}
+			break;
+		case STEP_GOTO:
+			if(!target_label[0])
+			{
+				printf("ERROR: goto step needs to=\n");
+				return -1;
+			}
+			break;
+		default:
+			break;
 	}
 
-	if(check_base_settings("Charge", &params->charge))
-		return -1;
-	if(check_base_settings("Discharge", &params->discharge))
+	if((st->until.var == COND_SOC || st->cond.var == COND_SOC) && params->soc.capacity <= 0.0)
+	{
+		printf("ERROR: soc conditions need capacity=\n");
 		return -1;
+	}
 
+	if(st->mode != MODE_UNDEFINED && st->settings.current / params->num_channels > (double)(HW_MAX_CURRENT-200)/1000.0)
+	{
+		printf("ERROR: step current %.3f A is too high for %d channels\n", st->settings.current, params->num_channels);
+		return -1;
+	}
 
 	return 0;
 }
 
-
-int parse_token(char* token, test_t* params)
+int add_default_step(test_t* params, step_type_t type, int time, int target)
 {
-	static mode_t param_state = MODE_OFF;
-	int n;
-	int itmp;
-	double ftmp, ftmp2;
-	char ctmp;
-	if(strstr(token, "charge") == token)
+	step_t* st = &params->program[params->num_steps++];
+	memset(st, 0, sizeof(*st));
+	st->type = type;
+	st->time = time;
+	st->target = target;
+	if(type == STEP_CHARGE)
 	{
-		param_state = MODE_CHARGE;
-		return 0;
+		st->mode = MODE_CHARGE;
+		st->settings = params->charge;
 	}
-	else if(strstr(token, "discharge") == token)
+	else if(type == STEP_DISCHARGE)
 	{
-		param_state = MODE_DISCHARGE;
-		return 0;
+		st->mode = MODE_DISCHARGE;
+		st->settings = params->discharge;
 	}
-	else if(strstr(token, "device=") == token)
+	return 0;
+}
+
+#define PULSE_DEFAULT_POINTS 10
+#define SOC_DEFAULT_REST_TIME 1800
+#define SCHED_DEFAULT_SLACK 3600
+#define ICA_DEFAULT_BIN 0.005
+#define ICA_DEFAULT_SMOOTH 4
+#define PULSE_MAX_POINTS 50
+
+// Compiles the step= tokens into the flat program table. Without steps, the program
+// is the classic continuous cycling: halfcycles with cooldowns, cycle counted after
+// discharge.
+int compile_program(test_t* params)
+{
+	char target_labels[MAX_STEPS][STEP_LABEL_LEN];
+	int i, j;
+
+	params->num_steps = 0;
+	if(params->num_step_src == 0)
 	{
-		int arglen;
-		if(params->device_name != NULL)
+		if(params->start_mode == MODE_DISCHARGE)
 		{
-			printf("Note: overriding existing device name (%s)\n", params->device_name);
-			free(params->device_name);
+			add_default_step(params, STEP_DISCHARGE, -1, 0);
+			add_default_step(params, STEP_CYCLE, -1, 0);
+			add_default_step(params, STEP_REST, params->postdischarge_cooldown, 0);
+			add_default_step(params, STEP_CHARGE, -1, 0);
+			add_default_step(params, STEP_REST, params->postcharge_cooldown, 0);
 		}
-		arglen = strlen(token+strlen("device="));
-		if((params->device_name = malloc(arglen+1)) == NULL)
+		else
 		{
-			printf("Memory allocation error\n");
-			return -1;
+			add_default_step(params, STEP_CHARGE, -1, 0);
+			add_default_step(params, STEP_REST, params->postcharge_cooldown, 0);
+			add_default_step(params, STEP_DISCHARGE, -1, 0);
+			add_default_step(params, STEP_CYCLE, -1, 0);
+			add_default_step(params, STEP_REST, params->postdischarge_cooldown, 0);
 		}
-		strcpy(params->device_name, token+strlen("device="));
-		return 0;
-	}
-	else if(strstr(token, "startmode=charge") == token)
-	{
-		params->start_mode=MODE_CHARGE;
-		return 0;
-	}
-	else if(strstr(token, "startmode=discharge") == token)
-	{
-		params->start_mode=MODE_DISCHARGE;
+		add_default_step(params, STEP_GOTO, -1, 0);
 		return 0;
 	}
-	else if(sscanf(token, "channels=%u%n", &params->channels[0], &n) == 1)
+
+	for(i = 0; i < params->num_step_src; i++)
 	{
-		token+=n;
-		params->num_channels = 1;
-		while(sscanf(token, ",%u%n", &params->channels[params->num_channels], &n) == 1)
+		if(compile_step(params, &params->program[i], params->step_src[i], target_labels[i]))
 		{
-			token+=n;
-			params->num_channels++;
-			if(params->num_channels >= MAX_PARALLEL_CHANNELS)
-			{
-				printf("Too many parallel channels defined in channels list\n");
-				return 1;
-			}
+			printf("ERROR: in step %d: %s\n", i+1, params->step_src[i]);
+			return -1;
 		}
-		return 0;
 	}
-	else if(sscanf(token, "masterchannel=%u", &itmp) == 1)
+	params->num_steps = params->num_step_src;
+
+	// Resolve jump targets: a label, or a 1-based step number.
+	for(i = 0; i < params->num_steps; i++)
 	{
-		if(itmp >= 0 && itmp < 10000)
+		step_t* st = &params->program[i];
+		if(st->type != STEP_GOTO && st->type != STEP_LOOP)
+			continue;
+		st->target = -1;
+		for(j = 0; j < params->num_steps; j++)
 		{
-			int i;
-			for(i = 0; i < params->num_channels; i++)
-			{
-				if(params->channels[i] == itmp)
-				{
-					params->master_channel_idx = i;
-					goto MASTER_CHANNEL_PARSE_OK;
-				}
+			if(params->program[j].label[0] && strcmp(params->program[j].label, target_labels[i]) == 0)
+				st->target = j;
+		}
+		if(st->target < 0 && sscanf(target_labels[i], "%d", &j) == 1 && j >= 1 && j <= params->num_steps)
+			st->target = j-1;
+		if(st->target < 0)
+		{
+			printf("ERROR: step %d: jump target \"%s\" not found\n", i+1, target_labels[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#define DERATE_DEFAULT_MIN 0.2
+#define DERIV_DEFAULT_WINDOW 60             // s
+#define COOLDOWN_DEFAULT_BAND 2.0           // C
+#define COOLDOWN_DEFAULT_DVDT (2.0/1000.0/60.0) // 2 mV/min
+
+#define SAFETY_DEFAULT_PERIOD 500   // ms
+#define SAFETY_DEFAULT_DEADLINE 3000 // ms
+#define SAFETY_TEMP_MARGIN 5.0       // C over temperaturestop
+#define SAFETY_DEFAULT_TEMP 80.0     // C, without temperaturestop
+#define SAFETY_V_MARGIN_HIGH 0.2     // V over the highest charge voltage
+#define SAFETY_V_MARGIN_LOW 0.6      // V under the lowest discharge voltage (the hardware stops at -0.5 V in some modes)
+#define SAFETY_DEFAULT_IMISMATCH 1.0 // A
+
+int safety_period = SAFETY_DEFAULT_PERIOD;
+
+// Limits not given are derived from the settings: the voltage window from the
+// charge and discharge voltages of the steps (not for profiles).
+void safety_defaults(test_t* params)
+{
+	int i;
+	if(params->safety_temp == 0.0)
+		params->safety_temp = (params->temperature_stop > 0.0)?(params->temperature_stop + SAFETY_TEMP_MARGIN):(SAFETY_DEFAULT_TEMP);
+	if(params->safety_imismatch == 0.0)
+		params->safety_imismatch = SAFETY_DEFAULT_IMISMATCH;
+	if(params->safety_deadline == 0)
+		params->safety_deadline = SAFETY_DEFAULT_DEADLINE;
+
+	if(params->profile_file)
+		return;
+	double vmax = 0.0, vmin = 0.0;
+	for(i = 0; i < params->num_steps; i++)
+	{
+		base_settings_t* b = &params->program[i].settings;
+		if(params->program[i].mode == MODE_CHARGE)
+		{
+			double v = (b->voltage > b->stop_voltage)?(b->voltage):(b->stop_voltage);
+			if(v > vmax)
+				vmax = v;
+		}
+		else if(params->program[i].mode == MODE_DISCHARGE)
+		{
+			double v = (b->stop_mode == STOP_MODE_VOLTAGE)?(b->stop_voltage):(b->voltage);
+			if(v > 0.0 && (vmin == 0.0 || v < vmin))
+				vmin = v;
+		}
+	}
+	if(params->safety_vmax == 0.0 && vmax > 0.0)
+		params->safety_vmax = vmax + SAFETY_V_MARGIN_HIGH;
+	if(params->safety_vmin == 0.0 && vmin > SAFETY_V_MARGIN_LOW)
+		params->safety_vmin = vmin - SAFETY_V_MARGIN_LOW;
+}
+
+// Base current multiplier that keeps the average current with resistance pulses.
+double resistance_base_mul(test_t* params)
+{
+	return 1.0 /
+		(((double)(params->resistance_first_pulse_len)*(params->resistance_first_pulse_current_mul) +
+		(double)(params->resistance_second_pulse_len)*(params->resistance_second_pulse_current_mul) +
+		(double)(params->resistance_interval - params->resistance_first_pulse_len - params->resistance_second_pulse_len)*1.0)
+		/(double)(params->resistance_interval));
+}
+
+int check_params(test_t* params)
+{
+	int i;
+
+	if(params->num_channels < 1 || params->num_channels > MAX_PARALLEL_CHANNELS)
+	{
+		printf("Illegal number of parallel channels: %u\n", params->num_channels);
+		return -1;
+	}
+
+	if(params->num_buses < 1 || params->device_names[0] == NULL)
+	{
+		printf("ERROR: device not defined\n");
+		return -1;
+	}
+
+	for(i = 1; i < params->num_buses; i++)
+	{
+		int j;
+		for(j = 0; j < i; j++)
+		{
+			if(strcmp(params->device_names[i], params->device_names[j]) == 0)
+			{
+				printf("ERROR: device %s given twice\n", params->device_names[i]);
+				return -1;
+			}
+		}
+	}
+
+	// Duplicates are found with a per-bus bitmap, so long channel lists stay linear.
+	uint8_t used[MAX_TEST_BUSES][MAX_ID+1];
+	memset(used, 0, sizeof(used));
+	for(i = 0; i < params->num_channels; i++)
+	{
+		channel_t* c = &params->ch[i];
+		if(c->id < MIN_ID || c->id > MAX_ID)
+		{
+			printf("Illegal channel ID: %u\n", c->id);
+			return -1;
+		}
+		if(c->bus < 0 || c->bus >= params->num_buses)
+		{
+			printf("Channel %u:%u: no such device (%d devices defined)\n", c->bus, c->id, params->num_buses);
+			return -1;
+		}
+		if(used[c->bus][c->id])
+		{
+			printf("Channel %u:%u listed twice\n", c->bus, c->id);
+			return -1;
+		}
+		used[c->bus][c->id] = 1;
+	}
+
+	if(params->resistance_on)
+	{
+		if(params->resistance_interval < 20 || params->resistance_interval > 600)
+		{
+			printf("ERROR: Illegal resistance_interval (%u)\n", params->resistance_interval);
+			return -1;
+		}
+		params->resistance_base_current_mul = resistance_base_mul(params);
+
+		if(params->resistance_base_current_mul < 1.0 || params->resistance_base_current_mul > 1.2)
+		{
+			printf("ERROR: Inferred resistance_base_current_mul out of range (%f)\n", params->resistance_base_current_mul);
+			return -1;
+		}
+
+		if(params->resistance_every_cycle < 1 || params->resistance_every_cycle > 100)
+		{
+			printf("ERROR: Illegal resistance_every_cycle (%u)\n", params->resistance_every_cycle);
+			return -1;
+		}
+
+		printf("INFO: Resistance measurement on, inferring resistance_base_current_mul = %f\n", params->resistance_base_current_mul);
+	}
+
+	if(params->profile_file && check_profile_settings(params))
+		return -1;
+
+	if(check_const_power_settings("Charge", &params->charge, params->num_channels, MODE_CHARGE))
+		return -1;
+	if(check_const_power_settings("Discharge", &params->discharge, params->num_channels, MODE_DISCHARGE))
+		return -1;
+
+	if(params->sdt_voltage.band == 0.0)
+		params->sdt_voltage.band = 0.002;
+	if(params->sdt_current.band == 0.0)
+		params->sdt_current.band = 0.05;
+	if(params->sdt_temperature.band == 0.0)
+		params->sdt_temperature.band = 0.2;
+
+	if(check_base_settings("Charge", &params->charge))
+		return -1;
+	if(check_base_settings("Discharge", &params->discharge))
+		return -1;
+
+	if(!params->profile_file && compile_program(params))
+		return -1;
+
+	if(params->pulse_points == 0)
+		params->pulse_points = PULSE_DEFAULT_POINTS;
+
+	if(params->profile_file && (params->stop_cycle || params->stop_capacity > 0.0 || params->stop_fade > 0.0))
+	{
+		printf("ERROR: stopcycle, stopcapacity and stopfade can't be used with profile=\n");
+		return -1;
+	}
+	if(params->fade_step)
+	{
+		int i;
+		for(i = 0; i < params->num_steps; i++)
+			if(strcmp(params->program[i].label, params->fade_step) == 0)
+				break;
+		if(i == params->num_steps)
+		{
+			printf("ERROR: fadestep: no step labeled \"%s\"\n", params->fade_step);
+			return -1;
+		}
+	}
+
+	if(params->ica_on)
+	{
+		if(params->profile_file)
+		{
+			printf("ERROR: ica can't be used with profile=\n");
+			return -1;
+		}
+		if(params->ica_bin == 0.0)
+			params->ica_bin = ICA_DEFAULT_BIN;
+		if(params->ica_smooth < 0)
+			params->ica_smooth = ICA_DEFAULT_SMOOTH;
+		if(ica_init(&params->ica, params->ica_bin))
+			return -1;
+		if((params->ica_dqdv = malloc(params->ica.num_bins*sizeof(double))) == NULL)
+		{
+			printf("Memory allocation error\n");
+			return -1;
+		}
+	}
+
+	if(params->start_slack < 0)
+		params->start_slack = SCHED_DEFAULT_SLACK;
+
+	if(params->safety_on)
+		safety_defaults(params);
+
+	if(params->deriv_window == 0)
+		params->deriv_window = DERIV_DEFAULT_WINDOW;
+	if(rolling_init(&params->deriv_v, params->deriv_window) || rolling_init(&params->deriv_t, params->deriv_window))
+		return 1;
+	for(i = 0; i < params->num_abort_if; i++)
+		if(params->abort_if[i].var == COND_SOC && params->soc.capacity <= 0.0)
+			break;
+	if(i < params->num_abort_if || ((params->charge.stop_if.var == COND_SOC || params->discharge.stop_if.var == COND_SOC) && params->soc.capacity <= 0.0))
+	{
+		printf("ERROR: soc conditions need capacity=\n");
+		return 1;
+	}
+
+	if(params->cooldown_min >= 0)
+	{
+		if(params->cooldown_band == 0.0)
+			params->cooldown_band = COOLDOWN_DEFAULT_BAND;
+		if(params->cooldown_dvdt == 0.0)
+			params->cooldown_dvdt = COOLDOWN_DEFAULT_DVDT;
+	}
+
+	if(params->derate_temp > 0.0)
+	{
+		if(params->profile_file)
+		{
+			printf("ERROR: deratetemp= is not supported with profile=\n");
+			return 1;
+		}
+		if(params->derate_temp >= params->temperature_stop)
+		{
+			printf("ERROR: deratetemp= must be below temperaturestop>\n");
+			return 1;
+		}
+		if(params->derate_min == 0.0)
+			params->derate_min = DERATE_DEFAULT_MIN;
+	}
+
+	if(params->soc.rest_time == 0.0)
+		params->soc.rest_time = SOC_DEFAULT_REST_TIME;
+	if(soc_check(&params->soc))
+		return -1;
+
+	return 0;
+}
+
+
+int set_device_name(test_t* params, int bus, char* name)
+{
+	free(params->device_names[bus]);
+	if((params->device_names[bus] = malloc(strlen(name)+1)) == NULL)
+	{
+		printf("Memory allocation error\n");
+		return -1;
+	}
+	strcpy(params->device_names[bus], name);
+	return 0;
+}
+
+// Parses a channel as "id" (on the bus of device=) or "bus:id", where bus 1 is the
+// first extradevice=. Sets *n to the number of characters used.
+int parse_channel_spec(char* str, int* bus, int* id, int* n)
+{
+	if(sscanf(str, "%u:%u%n", bus, id, n) == 2)
+		return 0;
+	*bus = 0;
+	if(sscanf(str, "%u%n", id, n) == 1)
+		return 0;
+	return -1;
+}
+
+int parse_channel_list(test_t* params, char* list)
+{
+	int ids[MAX_PARALLEL_CHANNELS];
+	int buses[MAX_PARALLEL_CHANNELS];
+	int num = 0;
+	int n, i;
+
+	while(1)
+	{
+		if(num >= MAX_PARALLEL_CHANNELS)
+		{
+			printf("Too many parallel channels defined in channels list\n");
+			return 1;
+		}
+		if(parse_channel_spec(list, &buses[num], &ids[num], &n))
+		{
+			printf("Invalid channels list: %s\n", list);
+			return 1;
+		}
+		num++;
+		list += n;
+		if(*list != ',')
+			break;
+		list++;
+	}
+
+	channel_t* ch = realloc(params->ch, num*sizeof(channel_t));
+	if(ch == NULL)
+	{
+		printf("Memory allocation error\n");
+		return -1;
+	}
+	memset(ch, 0, num*sizeof(channel_t));
+	for(i = 0; i < num; i++)
+	{
+		ch[i].id = ids[i];
+		ch[i].bus = buses[i];
+	}
+	params->ch = ch;
+	params->num_channels = num;
+	params->master_channel_idx = 0;
+	return 0;
+}
+
+#define MAX_GLOBAL_SETTINGS 40
+
+// Process-wide settings are shared by all the tests of this process. The defaults
+// file gives them for all; a test file may override one, but the test files that
+// give it must agree. key names the setting, text is the whole "name=value" it is
+// compared by. Returns 0 to take the value, 1 to keep the one a test file gave
+// (the defaults are read again for every test), -1 on a conflict.
+int global_setting_text(char* key, char* text)
+{
+	static struct { char key[40]; char text[80]; char* file; } given[MAX_GLOBAL_SETTINGS];
+	static int num_given;
+	int i;
+
+	for(i = 0; i < num_given; i++)
+		if(strcmp(given[i].key, key) == 0)
+			break;
+	if(parse_file_name == NULL || strcmp(parse_file_name, "defaults") == 0)
+		return (i < num_given)?(1):(0);
+	if(i < num_given)
+	{
+		if(strcmp(given[i].text, text))
+		{
+			printf("ERROR: %s in %s conflicts with %s in %s; it is shared by all the tests, give it once or in the defaults file\n",
+				text, parse_file_name, given[i].text, given[i].file);
+			return -1;
+		}
+		return 0;
+	}
+	if(num_given < MAX_GLOBAL_SETTINGS)
+	{
+		snprintf(given[num_given].key, sizeof(given[num_given].key), "%s", key);
+		snprintf(given[num_given].text, sizeof(given[num_given].text), "%s", text);
+		given[num_given].file = parse_file_name;
+		num_given++;
+	}
+	return 0;
+}
+
+int global_setting(char* name, double value)
+{
+	char text[80];
+	snprintf(text, sizeof(text), "%s=%.10g", name, value);
+	return global_setting_text(name, text);
+}
+
+int parse_token(char* token, test_t* params)
+{
+	static mode_t param_state = MODE_OFF;
+	int global;
+	int n;
+	int itmp;
+	double ftmp, ftmp2;
+	char ctmp;
+	if(strstr(token, "charge") == token)
+	{
+		param_state = MODE_CHARGE;
+		return 0;
+	}
+	else if(strstr(token, "discharge") == token)
+	{
+		param_state = MODE_DISCHARGE;
+		return 0;
+	}
+	else if(strstr(token, "device=") == token)
+	{
+		if(params->device_names[0] != NULL)
+			printf("Note: overriding existing device name (%s)\n", params->device_names[0]);
+		if(params->num_buses < 1)
+			params->num_buses = 1;
+		return set_device_name(params, 0, token+strlen("device="));
+	}
+	else if(strstr(token, "extradevice=") == token)
+	{
+		if(params->num_buses < 1)
+			params->num_buses = 1; // bus 0 is reserved for device=
+		if(params->num_buses >= MAX_TEST_BUSES)
+		{
+			printf("Too many devices (max %d per test)\n", MAX_TEST_BUSES);
+			return 1;
+		}
+		return set_device_name(params, params->num_buses++, token+strlen("extradevice="));
+	}
+	else if(strstr(token, "startmode=charge") == token)
+	{
+		params->start_mode=MODE_CHARGE;
+		return 0;
+	}
+	else if(strstr(token, "startmode=discharge") == token)
+	{
+		params->start_mode=MODE_DISCHARGE;
+		return 0;
+	}
+	else if(strcmp(token, "channels=auto") == 0)
+	{
+		free(params->ch);
+		params->ch = NULL;
+		params->num_channels = 0;
+		params->channels_auto = 1;
+	}
+	else if(strstr(token, "channels=") == token)
+	{
+		params->channels_auto = 0;
+		return parse_channel_list(params, token+strlen("channels="));
+	}
+	else if(sscanf(token, "autocurrent=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0)
+		{
+			printf("Illegal autocurrent\n");
+			return 1;
+		}
+		params->auto_current = ftmp;
+	}
+	else if(sscanf(token, "boardchannels=%d", &itmp) == 1)
+	{
+		if(itmp < 1 || itmp > MAX_ID+1)
+		{
+			printf("Illegal boardchannels (1 to %d)\n", MAX_ID+1);
+			return 1;
+		}
+		if((global = global_setting("boardchannels", itmp)) < 0)
+			return 1;
+		if(global == 0)
+			board_channels = itmp;
+	}
+	else if(strstr(token, "masterchannel=") == token)
+	{
+		int bus;
+		if(parse_channel_spec(token+strlen("masterchannel="), &bus, &itmp, &n) == 0 && itmp >= 0 && itmp < 10000)
+		{
+			int i;
+			for(i = 0; i < params->num_channels; i++)
+			{
+				if(params->ch[i].id == itmp && params->ch[i].bus == bus)
+				{
+					params->master_channel_idx = i;
+					goto MASTER_CHANNEL_PARSE_OK;
+				}
 			}
 			printf("Masterchannel value not found in channel list.\n");
 			return 1;
@@ -1136,7 +2800,25 @@ int parse_token(char* token, test_t* params)
 			return 1;
 		}
 	}
-	else if(sscanf(token, "stopcurrent=%lf", &ftmp) == 1)
+	else if(sscanf(token, "loadresistance=%lf", &ftmp) == 1)
+	{
+		if(param_state == MODE_CHARGE)
+		{
+			params->charge.load_resistance = ftmp;
+			params->charge.const_resistance_mode = 1;
+		}
+		else if(param_state == MODE_DISCHARGE)
+		{
+			params->discharge.load_resistance = ftmp;
+			params->discharge.const_resistance_mode = 1;
+		}
+		else
+		{
+			printf("loadresistance token without charge/discharge keyword before.\n");
+			return 1;
+		}
+	}
+	else if(sscanf(token, "stopcurrent=%lf", &ftmp) == 1)
 	{
 		if(param_state == MODE_CHARGE)
 			params->charge.stop_current = ftmp;
@@ -1160,6 +2842,43 @@ int parse_token(char* token, test_t* params)
 			return 1;
 		}
 	}
+	else if(strstr(token, "stopif=") == token)
+	{
+		base_settings_t* b = (param_state == MODE_CHARGE)?(&params->charge):(&params->discharge);
+		if(param_state != MODE_CHARGE && param_state != MODE_DISCHARGE)
+		{
+			printf("stopif token without charge/discharge keyword before.\n");
+			return 1;
+		}
+		if(parse_cond(token+strlen("stopif="), &b->stop_if))
+		{
+			printf("Illegal stopif condition \"%s\"\n", token);
+			return 1;
+		}
+	}
+	else if(strstr(token, "abortif=") == token)
+	{
+		if(params->num_abort_if >= MAX_ABORT_CONDS)
+		{
+			printf("ERROR: too many abortif conditions (max %d)\n", MAX_ABORT_CONDS);
+			return 1;
+		}
+		if(parse_cond(token+strlen("abortif="), &params->abort_if[params->num_abort_if]))
+		{
+			printf("Illegal abortif condition \"%s\"\n", token);
+			return 1;
+		}
+		params->num_abort_if++;
+	}
+	else if(strstr(token, "derivwindow=") == token)
+	{
+		if(parse_duration(token+strlen("derivwindow="), &itmp) || itmp < 10 || itmp > ROLLING_MAX)
+		{
+			printf("Illegal derivwindow (10 s to %d s)\n", ROLLING_MAX);
+			return 1;
+		}
+		params->deriv_window = itmp;
+	}
 	else if(sscanf(token, "temperaturestop>%lf", &ftmp) == 1)
 	{
 		if(ftmp	< 10.0 || ftmp > 120.0)
@@ -1251,162 +2970,2166 @@ int parse_token(char* token, test_t* params)
 		}
 		params->resistance_every_cycle = itmp;
 	}
-	else if(sscanf(token, "ntc=%lf,%lf", &ftmp, &ftmp2) == 2)
+	else if(strstr(token, "logcompress=on") == token)
 	{
-
-		if(!defaults_parsed_once)
+		params->log_compress=1;
+		return 0;
+	}
+	else if(strstr(token, "logcompress=off") == token)
+	{
+		params->log_compress=0;
+		return 0;
+	}
+	else if(sscanf(token, "logtolv=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.0005 || ftmp > 0.5)
+			printf("Warning: ignoring out-of-range logtolv (%f)\n", ftmp);
+		else
+			params->sdt_voltage.band = ftmp;
+	}
+	else if(sscanf(token, "logtoli=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.005 || ftmp > 50.0)
+			printf("Warning: ignoring out-of-range logtoli (%f)\n", ftmp);
+		else
+			params->sdt_current.band = ftmp;
+	}
+	else if(sscanf(token, "logtolt=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.01 || ftmp > 20.0)
+			printf("Warning: ignoring out-of-range logtolt (%f)\n", ftmp);
+		else
+			params->sdt_temperature.band = ftmp;
+	}
+	else if(strstr(token, "step=") == token)
+	{
+		if(params->num_step_src >= MAX_STEPS)
 		{
-			if(ftmp < 10 || ftmp > 65530.0 || ftmp2 < -100.0 || ftmp2 > 200.0)
-			{
-				printf("Warning: ignoring out-of-range ntc calibration pair (%f,%f)\n", ftmp, ftmp2);
-			}
-			else
-			{
-				if(num_t_cal_points >= MAX_T_CAL_POINTS-1)
-				{
-					printf("Warning: ignoring excess NTC calibration pair (%f, %f), max %u points allowed\n", ftmp, ftmp2, MAX_T_CAL_POINTS);
-				}
-				else
-				{
-//					printf("KAKKEN                                              added t_cal_point %f  %f,  %d\n", ftmp, ftmp2, num_t_cal_points);
-					t_cal[num_t_cal_points][0] = ftmp;
-					t_cal[num_t_cal_points][1] = ftmp2;
-					num_t_cal_points++;
-				}
-			}
+			printf("Too many steps (max %d)\n", MAX_STEPS);
+			return 1;
+		}
+		if((params->step_src[params->num_step_src] = malloc(strlen(token)+1)) == NULL)
+		{
+			printf("Memory allocation error\n");
+			return -1;
 		}
+		strcpy(params->step_src[params->num_step_src++], token+strlen("step="));
+		return 0;
 	}
-	else
+	else if(strstr(token, "profile=") == token)
 	{
-		printf("Warning: ignoring unrecognized token %s\n", token);
+		free(params->profile_file);
+		if((params->profile_file = malloc(strlen(token)+1)) == NULL)
+		{
+			printf("Memory allocation error\n");
+			return -1;
+		}
+		strcpy(params->profile_file, token+strlen("profile="));
+		return 0;
 	}
-
-	return 0;
-}
-
-int parse_test_file(char* filename, test_t* params)
-{
-	char* buffer = malloc(10000);
-	if(!buffer)
+	else if(strstr(token, "profiletype=current") == token)
 	{
-		printf("Memory allocation error\n");
-		return 1;
+		params->profile_power = 0;
+		return 0;
 	}
-	FILE* testfile = fopen(filename, "r");
-	if(!testfile)
+	else if(strstr(token, "profiletype=power") == token)
 	{
-		printf("Error opening file %s\n", filename);
-		free(buffer);
-		return 2;
+		params->profile_power = 1;
+		return 0;
+	}
+	else if(sscanf(token, "profilerate=%u", &itmp) == 1)
+	{
+		if(itmp < 1 || itmp > PROFILE_MAX_RATE)
+		{
+			printf("Illegal profilerate (1 to %d)\n", PROFILE_MAX_RATE);
+			return 1;
+		}
+		params->profile_rate = itmp;
+	}
+	else if(strstr(token, "scan=on") == token || strstr(token, "scan=off") == token || strstr(token, "scan=strict") == token)
+	{
+		itmp = (strstr(token, "scan=off") == token)?(0):((strstr(token, "scan=strict") == token)?(2):(1));
+		if((global = global_setting("scan", itmp)) < 0)
+			return 1;
+		if(global == 0)
+			scan_on = itmp;
+	}
+	else if(sscanf(token, "packlimit=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0)
+		{
+			printf("Illegal packlimit\n");
+			return 1;
+		}
+		if((global = global_setting("packlimit", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			pack_limit = ftmp;
+	}
+	else if(sscanf(token, "packvoltage=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 1.0 || ftmp > 60.0)
+		{
+			printf("Illegal packvoltage\n");
+			return 1;
+		}
+		if((global = global_setting("packvoltage", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			pack_voltage = ftmp;
+	}
+	else if(sscanf(token, "packcapacity=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0)
+		{
+			printf("Illegal packcapacity\n");
+			return 1;
+		}
+		if((global = global_setting("packcapacity", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			pack_capacity = ftmp;
+	}
+	else if(sscanf(token, "packsoc=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.0 || ftmp > 100.0)
+		{
+			printf("Illegal packsoc\n");
+			return 1;
+		}
+		if((global = global_setting("packsoc", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			pack_soc = ftmp / 100.0;
+	}
+	else if(sscanf(token, "packsocmin=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.0 || ftmp > 100.0)
+		{
+			printf("Illegal packsocmin\n");
+			return 1;
+		}
+		if((global = global_setting("packsocmin", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			pack_soc_min = ftmp / 100.0;
+	}
+	else if(sscanf(token, "packsocmax=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.0 || ftmp > 100.0)
+		{
+			printf("Illegal packsocmax\n");
+			return 1;
+		}
+		if((global = global_setting("packsocmax", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			pack_soc_max = ftmp / 100.0;
+	}
+	else if(sscanf(token, "efficiency=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 50.0 || ftmp > 100.0)
+		{
+			printf("Illegal efficiency\n");
+			return 1;
+		}
+		if((global = global_setting("efficiency", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			pack_efficiency = ftmp / 100.0;
+	}
+	else if(sscanf(token, "chargerinput=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.0)
+		{
+			printf("Illegal chargerinput\n");
+			return 1;
+		}
+		if((global = global_setting("chargerinput", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			charger_input = ftmp;
+	}
+	else if(sscanf(token, "chargersoc=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.0 || ftmp > 100.0)
+		{
+			printf("Illegal chargersoc\n");
+			return 1;
+		}
+		if((global = global_setting("chargersoc", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			charger_soc = ftmp / 100.0;
+	}
+	else if(sscanf(token, "powerbudget=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0)
+		{
+			printf("Illegal powerbudget\n");
+			return 1;
+		}
+		if((global = global_setting("powerbudget", ftmp)) < 0)
+			return 1;
+		if(global == 0)
+			power_budget = ftmp;
+	}
+	else if(sscanf(token, "priority=%d", &itmp) == 1)
+	{
+		if(itmp < 0 || itmp > MAX_PRIORITY)
+		{
+			printf("Illegal priority (0 to %d)\n", MAX_PRIORITY);
+			return 1;
+		}
+		params->priority = itmp;
+	}
+	else if(strstr(token, "startslack=") == token)
+	{
+		if(parse_duration(token+strlen("startslack="), &itmp))
+		{
+			printf("Illegal startslack\n");
+			return 1;
+		}
+		params->start_slack = itmp;
+	}
+	else if(strstr(token, "cooldownmin=") == token)
+	{
+		if(parse_duration(token+strlen("cooldownmin="), &itmp))
+		{
+			printf("Illegal cooldownmin\n");
+			return 1;
+		}
+		params->cooldown_min = itmp;
+	}
+	else if(sscanf(token, "cooldownband=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0 || ftmp > 20.0)
+		{
+			printf("Illegal cooldownband (0 to 20 C)\n");
+			return 1;
+		}
+		params->cooldown_band = ftmp;
+	}
+	else if(sscanf(token, "cooldowndvdt=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0)
+		{
+			printf("Illegal cooldowndvdt\n");
+			return 1;
+		}
+		params->cooldown_dvdt = ftmp / 1000.0 / 60.0;
+	}
+	else if(sscanf(token, "ambient=%lf", &ftmp) == 1)
+	{
+		if(ftmp < -20.0 || ftmp > 60.0)
+		{
+			printf("Illegal ambient temperature\n");
+			return 1;
+		}
+		params->ambient = ftmp;
+	}
+	else if(sscanf(token, "deratetemp=%lf", &ftmp) == 1)
+	{
+		params->derate_temp = ftmp;
+	}
+	else if(sscanf(token, "deratemin=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 5.0 || ftmp > 100.0)
+		{
+			printf("Illegal deratemin (5 to 100 %%)\n");
+			return 1;
+		}
+		params->derate_min = ftmp / 100.0;
+	}
+	else if(strstr(token, "safety=on") == token)
+	{
+		params->safety_on = 1;
+	}
+	else if(strstr(token, "safety=off") == token)
+	{
+		params->safety_on = 0;
+	}
+	else if(sscanf(token, "safetytemp=%lf", &ftmp) == 1)
+	{
+		params->safety_temp = ftmp;
+	}
+	else if(sscanf(token, "safetydtdt=%lf", &ftmp) == 1)
+	{
+		params->safety_dtdt = ftmp;
+	}
+	else if(sscanf(token, "safetyvmin=%lf", &ftmp) == 1)
+	{
+		params->safety_vmin = ftmp;
+	}
+	else if(sscanf(token, "safetyvmax=%lf", &ftmp) == 1)
+	{
+		params->safety_vmax = ftmp;
+	}
+	else if(sscanf(token, "safetycurrent=%lf", &ftmp) == 1)
+	{
+		params->safety_imismatch = ftmp;
+	}
+	else if(sscanf(token, "safetydeadline=%d", &itmp) == 1)
+	{
+		if(itmp < 500)
+		{
+			printf("Illegal safetydeadline (min 500 ms)\n");
+			return 1;
+		}
+		params->safety_deadline = itmp;
 	}
+	else if(sscanf(token, "safetyperiod=%d", &itmp) == 1)
+	{
+		if(itmp < 50 || itmp > 1000)
+		{
+			printf("Illegal safetyperiod (50 to 1000 ms)\n");
+			return 1;
+		}
+		if((global = global_setting("safetyperiod", itmp)) < 0)
+			return 1;
+		if(global == 0)
+			safety_period = itmp;
+	}
+	else if(strstr(token, "ica=on") == token)
+	{
+		params->ica_on = 1;
+	}
+	else if(strstr(token, "ica=off") == token)
+	{
+		params->ica_on = 0;
+	}
+	else if(sscanf(token, "icabin=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 1.0 || ftmp > 50.0)
+		{
+			printf("Illegal icabin (1 to 50 mV)\n");
+			return 1;
+		}
+		params->ica_bin = ftmp/1000.0;
+	}
+	else if(sscanf(token, "icasmooth=%u", &itmp) == 1)
+	{
+		if(itmp > 50)
+		{
+			printf("Illegal icasmooth (0 to 50 bins)\n");
+			return 1;
+		}
+		params->ica_smooth = itmp;
+	}
+	else if(sscanf(token, "stopcycle=%u", &itmp) == 1)
+	{
+		if(itmp < 1)
+		{
+			printf("Illegal stopcycle\n");
+			return 1;
+		}
+		params->stop_cycle = itmp;
+	}
+	else if(sscanf(token, "stopcapacity=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0)
+		{
+			printf("Illegal stopcapacity\n");
+			return 1;
+		}
+		params->stop_capacity = ftmp;
+	}
+	else if(sscanf(token, "stopfade=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0 || ftmp >= 100.0)
+		{
+			printf("Illegal stopfade (0 to 100 %%)\n");
+			return 1;
+		}
+		params->stop_fade = ftmp;
+	}
+	else if(strstr(token, "fadestep=") == token)
+	{
+		free(params->fade_step);
+		if((params->fade_step = malloc(strlen(token)+1)) == NULL)
+		{
+			printf("Memory allocation error\n");
+			return -1;
+		}
+		strcpy(params->fade_step, token+strlen("fadestep="));
+		return 0;
+	}
+	else if(sscanf(token, "capacity=%lf", &ftmp) == 1)
+	{
+		if(ftmp <= 0.0 || ftmp > 10000.0)
+		{
+			printf("Illegal capacity\n");
+			return 1;
+		}
+		params->soc.capacity = ftmp;
+	}
+	else if(sscanf(token, "ocv=%lf,%lf", &ftmp, &ftmp2) == 2)
+	{
+		if(soc_add_ocv_point(&params->soc, ftmp/100.0, ftmp2))
+			return 1;
+	}
+	else if(sscanf(token, "socinit=%lf", &ftmp) == 1)
+	{
+		if(ftmp < 0.0 || ftmp > 100.0)
+		{
+			printf("Illegal socinit (0 to 100)\n");
+			return 1;
+		}
+		params->soc.init = ftmp/100.0;
+	}
+	else if(strstr(token, "socfilter=ocv") == token)
+	{
+		params->soc.filter = SOC_FILTER_OCV;
+	}
+	else if(strstr(token, "socfilter=ekf") == token)
+	{
+		params->soc.filter = SOC_FILTER_EKF;
+	}
+	else if(strstr(token, "socrest=") == token)
+	{
+		if(parse_duration(token+strlen("socrest="), &itmp) || itmp < 1)
+		{
+			printf("Illegal socrest\n");
+			return 1;
+		}
+		params->soc.rest_time = itmp;
+	}
+	else if(sscanf(token, "pulsepoints=%u", &itmp) == 1)
+	{
+		if(itmp < 1 || itmp > PULSE_MAX_POINTS)
+		{
+			printf("Illegal pulsepoints (1 to %d)\n", PULSE_MAX_POINTS);
+			return 1;
+		}
+		params->pulse_points = itmp;
+	}
+	else if(sscanf(token, "profilerepeat=%u", &itmp) == 1)
+	{
+		if(itmp < 1 || itmp > 1000000)
+		{
+			printf("Illegal profilerepeat\n");
+			return 1;
+		}
+		params->profile_repeat = itmp;
+	}
+	else if(strstr(token, "loglevel=") == token || strstr(token, "stdout=") == token || strstr(token, "lograte=") == token)
+	{
+		// Console settings are process-wide; lograte= is one setting per category.
+		char key[40];
+		int len = (strstr(token, "lograte=") == token)?(strcspn(token, ",")):(strcspn(token, "="));
+		snprintf(key, sizeof(key), "%.*s", len, token);
+		if((global = global_setting_text(key, token)) < 0)
+			return 1;
+		if(global == 0 && !msg_parse_token(token))
+		{
+			printf("Illegal %s\n", key);
+			return 1;
+		}
+	}
+	else if(sscanf(token, "ntc=%lf,%lf", &ftmp, &ftmp2) == 2)
+	{
+
+		if(!defaults_parsed_once)
+		{
+			if(ftmp < 10 || ftmp > 65530.0 || ftmp2 < -100.0 || ftmp2 > 200.0)
+			{
+				printf("Warning: ignoring out-of-range ntc calibration pair (%f,%f)\n", ftmp, ftmp2);
+			}
+			else
+			{
+				if(num_t_cal_points >= MAX_T_CAL_POINTS-1)
+				{
+					printf("Warning: ignoring excess NTC calibration pair (%f, %f), max %u points allowed\n", ftmp, ftmp2, MAX_T_CAL_POINTS);
+				}
+				else
+				{
+//					printf("KAKKEN                                              added t_cal_point %f  %f,  %d\n", ftmp, ftmp2, num_t_cal_points);
+					t_cal[num_t_cal_points][0] = ftmp;
+					t_cal[num_t_cal_points][1] = ftmp2;
+					num_t_cal_points++;
+				}
+			}
+		}
+	}
+	else
+	{
+		printf("Warning: ignoring unrecognized token %s\n", token);
+	}
+
+	return 0;
+}
+
+int parse_test_file(char* filename, test_t* params)
+{
+	char* buffer = malloc(10000);
+	if(!buffer)
+	{
+		printf("Memory allocation error\n");
+		return 1;
+	}
+	FILE* testfile = fopen(filename, "r");
+	if(!testfile)
+	{
+		printf("Error opening file %s\n", filename);
+		free(buffer);
+		return 2;
+	}
+	parse_file_name = filename;
+
+	while(fgets(buffer, 10000, testfile))
+	{
+		char* p = strtok(buffer, " \n\r");
+		while(p != NULL)
+		{
+			if(parse_token(p, params))
+			{
+				free(buffer);
+				fclose(testfile);
+				return 3;
+			}
+
+			p = strtok(NULL, " \n\r");
+		}
+	}
+
+	free(buffer);
+	fclose(testfile);
+	return 0;
+}
+
+void init_test(test_t* params)
+{
+	memset(params, 0, sizeof(*params));
+	params->soc.init = -1.0;
+	params->ica_smooth = -1;
+	params->start_slack = -1;
+	params->budget_scale = 1.0;
+	params->derate_scale = 1.0;
+	params->cooldown_min = -1;
+	params->cooldown_due = -1;
+	params->temp_min_seen = 1000.0;
+}
+
+// Seconds until the next step starts, when waiting in a timed rest step; -1 otherwise.
+// 0 while the start is held for packlimit=.
+int cooldown_left(test_t* test, int cur_time)
+{
+	if(test->sched_held)
+		return 0;
+	if(test->program_state == PROGRAM_WAIT && test->step_start_time >= 0)
+		return test->step_start_time - cur_time;
+	if(test->program_state == PROGRAM_RUNNING && !test->step_pending)
+	{
+		step_t* st = &test->program[test->step_idx];
+		if(st->type == STEP_REST && st->time >= 0)
+			return test->step_start_time + st->time - cur_time;
+	}
+	return -1;
+}
+
+void publish_telemetry(test_t* test, int cur_time)
+{
+	telemetry_sample_t s;
+	measurement_t* m = &test->cur_meas;
+	int ch;
+
+	memset(&s, 0, sizeof(s));
+	s.time = cur_time;
+	s.halfcycle_time = cur_time - m->start_time;
+	s.cycle = test->cycle_cnt;
+	s.mode = m->mode;
+	s.cccv = m->cccv;
+	s.cur_mode = test->cur_mode;
+	s.next_mode = test->next_mode;
+	s.voltage = m->voltage;
+	s.current = m->current;
+	s.temperature = m->temperature;
+	s.cumul_ah = m->cumul_ah;
+	s.cumul_wh = m->cumul_wh;
+	s.resistance = m->resistance;
+	if(m->resistance != 0.0)
+		test->last_resistance = m->resistance;
+	s.last_resistance = test->last_resistance;
+	s.soc = (test->soc.capacity > 0.0)?(m->soc):(-1.0);
+	s.soh = m->soh;
+
+	s.cooldown_left = cooldown_left(test, cur_time);
+
+	int bus;
+	for(bus = 0; bus < test->num_buses; bus++)
+	{
+		comm_stats_t cs;
+		comm_get_stats(test->fds[bus], &cs);
+		s.comm_transactions += cs.transactions;
+		s.comm_retries += cs.retries;
+		s.comm_failures += cs.failures;
+	}
+
+	s.num_channels = test->num_channels;
+	for(ch = 0; ch < test->num_channels && ch < TELEMETRY_MAX_CHANNELS; ch++)
+	{
+		hw_measurement_t* hw = &test->ch[ch].meas;
+		s.ch[ch].id = test->ch[ch].id;
+		s.ch[ch].mode = hw->mode;
+		s.ch[ch].cccv = hw->cccv;
+		s.ch[ch].voltage = hw->voltage;
+		s.ch[ch].current = hw->current;
+		s.ch[ch].temperature = hw->temperature;
+		s.ch[ch].current_setpoint = hw->current_setpoint;
+	}
+
+	telemetry_publish(test->telemetry_idx, &s);
+}
+
+int resistance_active(test_t* test)
+{
+	return test->resistance_on &&
+	 (test->resistance_on_discharge_too || test->cur_mode==MODE_CHARGE)
+	 && (test->cycle_cnt % test->resistance_every_cycle) == 0
+	 && !pulse_step_running(test);
+}
+
+#define CP_TRIM_GAIN 0.5
+#define CP_TRIM_MAX 0.1
+#define CP_UPDATE_THRESHOLD 0.002
+
+// Host-side constant power / constant resistance loop, run at every sample.
+// The nominal current (charge.current or discharge.current, which the resistance
+// pulses also scale) is fed forward from the latest voltage as P/V or V/R.
+// An integral trim removes the remaining difference between the commanded and
+// measured current, so the power stays within about 1% of the target. The
+// result is clamped to the current limit (times the pulse multiplier) and the
+// hardware limit; the trim isn't integrated further up while clamped.
+void const_power_control(test_t* test)
+{
+	base_settings_t* b = (test->cur_mode == MODE_CHARGE)?(&test->charge):(&test->discharge);
+	double sign = (test->cur_mode == MODE_CHARGE)?(1.0):(-1.0);
+	double v = test->cur_meas.voltage;
+	double mul = resistance_active(test)?(test->resistance_base_current_mul):(1.0);
+
+	if(v < 0.5)
+		return;
+
+	double expected = b->current * mul;
+	double measured = fabs(test->cur_meas.current);
+	double trim = test->cp_trim;
+	if(expected > 0.1 && measured > 0.1 && test->cp_last_set != 0.0 && test->meas_settled)
+	{
+		trim += CP_TRIM_GAIN * (expected - measured) / expected;
+		if(trim > CP_TRIM_MAX) trim = CP_TRIM_MAX;
+		if(trim < -CP_TRIM_MAX) trim = -CP_TRIM_MAX;
+	}
+
+	b->current = const_power_current(b, v);
+
+	double limit = b->max_current * mul;
+	double hw_limit = (double)(HW_MAX_CURRENT-200)/1000.0 * test->num_channels;
+	if(limit > hw_limit)
+		limit = hw_limit;
+	double set = b->current * mul * (1.0 + trim);
+	if(set > limit)
+	{
+		set = limit;
+		if(trim > test->cp_trim)
+			trim = test->cp_trim;
+	}
+	test->cp_trim = trim;
+
+	// Can't happen after the clamp above; a bug if it does.
+	if(set / test->num_channels > (HW_MAX_CURRENT-50)/1000.0)
+	{
+		go_fatal(test->fd, "constant power overcurrent");
+	}
+
+	if(fabs(set - test->cp_last_set) > CP_UPDATE_THRESHOLD * set)
+	{
+		msg(MSGC_TEST, MSG_DEBUG, "dbg: %s: Const %s: setting test current to %.3f A at %.3f V (trim %.4f)\n",
+			test->name, (b->const_power_mode)?("power"):("resistance"), set, v, test->cp_trim);
+		if(test_set_current(test, sign * set) == 0)
+			test->cp_last_set = set;
+	}
+}
+
+int start_discharge(test_t* test)
+{
+	test->cp_trim = 0.0;
+	test->cp_last_set = 0.0;
+	if(translate_configure_channel_hws(test, MODE_DISCHARGE) || set_test_mode(test, MODE_DISCHARGE))
+		return -1;
+	return 0;
+}
+
+int start_charge(test_t* test)
+{
+	test->cp_trim = 0.0;
+	test->cp_last_set = 0.0;
+	if(translate_configure_channel_hws(test, MODE_CHARGE) || set_test_mode(test, MODE_CHARGE))
+		return -1;
+	return 0;
+}
+
+#define PROGRAM_START_DELAY 5
+#define PROGRAM_MAX_JUMPS 1000
+
+double cond_var_value(test_t* test, cond_var_t var, int step_time)
+{
+	switch(var)
+	{
+		case COND_CYCLE: return test->cycle_cnt;
+		case COND_AH: return fabs(test->cur_meas.cumul_ah);
+		case COND_WH: return fabs(test->cur_meas.cumul_wh);
+		case COND_V: return test->cur_meas.voltage;
+		case COND_I: return fabs(test->cur_meas.current);
+		case COND_T: return test->cur_meas.temperature;
+		case COND_TIME: return step_time;
+		case COND_SOC: return test->soc.soc*100.0;
+		case COND_DVDT: return rolling_slope(&test->deriv_v)*1000.0*60.0;
+		case COND_DTDT: return rolling_slope(&test->deriv_t)*60.0;
+		case COND_NDV: return (test->v_peak - test->cur_meas.voltage)*1000.0;
+		default: return 0.0;
+	}
+}
+
+int cond_eval(test_t* test, cond_t* c, int step_time)
+{
+	if(c->var == COND_SOC && !test->soc.valid)
+		return 0;
+	// Rates only once the window is full, the voltage ones not during resistance pulses.
+	if((c->var == COND_DVDT && (!rolling_ready(&test->deriv_v) || test->resistance_state != 0)) ||
+	   (c->var == COND_DTDT && !rolling_ready(&test->deriv_t)) ||
+	   (c->var == COND_NDV && (test->cur_mode == MODE_OFF || test->resistance_state != 0)))
+		return 0;
+	double x = cond_var_value(test, c->var, step_time);
+	switch(c->op)
+	{
+		case OP_LT: return x < c->value;
+		case OP_GT: return x > c->value;
+		case OP_LE: return x <= c->value;
+		case OP_GE: return x >= c->value;
+		case OP_MOD: return ((long)x % (long)c->value) == 0;
+	}
+	return 0;
+}
+
+// Measures only the master channel; a fast response sample for profile playback
+// and pulse sampling.
+int measure_master(test_t* test, hw_measurement_t* meas)
+{
+	char txbuf[32];
+	char expectbuf[32];
+	char rxbuf[1000];
+	channel_t* c = &test->ch[test->master_channel_idx];
+
+	uart_flush(c->fd);
+	sprintf(txbuf, "@%u:VERB;", c->id);
+	sprintf(expectbuf, "%u:MEAS ", c->id);
+	if(comm_autoretry(c->fd, txbuf, expectbuf, rxbuf))
+		return -1;
+	return parse_hw_measurement(meas, rxbuf);
+}
+
+#define PULSE_FIRST_SAMPLE 0.1 // s after the step edge
+#define PULSE_MIN_INTERVAL 0.1 // s, the fastest the channels are polled (as with profiles)
+#define PULSE_MIN_DI 0.01      // A; no dV/dI for smaller current steps
+
+// Starts log-spaced sampling from a step edge happening in this tick. The reference
+// point is the latest measurement, taken just before the edge.
+void pulse_arm(test_t* test)
+{
+	test->pulse_armed = 1;
+	test->pulse_sampling = 0;
+	test->pulse_v0 = test->cur_meas.voltage;
+	test->pulse_i0 = (test->cur_mode == MODE_OFF)?(0.0):(test->cur_meas.current);
+	test->pulse_r = 0.0;
+}
+
+void pulse_end(test_t* test)
+{
+	if(test->pulse_sampling)
+		fflush(test->pulse_log);
+	test->pulse_armed = 0;
+	test->pulse_sampling = 0;
+}
+
+// Pulse and relaxation sampling, called from run() as often as possible like
+// profile_tick(). Samples are taken at PULSE_FIRST_SAMPLE * 10^(k/pulse_points)
+// s after the edge, skipping grid points closer than PULSE_MIN_INTERVAL to the
+// previous sample: dense right after the edge, sparse later.
+void pulse_tick(test_t* test, double now)
+{
+	if(test->pulse_armed)
+	{
+		// The edge was at the end of the tick that just finished.
+		test->pulse_armed = 0;
+		test->pulse_sampling = 1;
+		test->pulse_t0 = now;
+		test->pulse_k = 0;
+		test->pulse_next = now + PULSE_FIRST_SAMPLE;
+		return;
+	}
+
+	if(!test->pulse_sampling || now < test->pulse_next)
+		return;
+
+	while(test->pulse_next < now + PULSE_MIN_INTERVAL)
+	{
+		test->pulse_k++;
+		test->pulse_next = test->pulse_t0 + PULSE_FIRST_SAMPLE * pow(10.0, (double)test->pulse_k / (double)test->pulse_points);
+	}
+
+	hw_measurement_t m;
+	if(measure_master(test, &m))
+	{
+		msg(MSGC_HW, MSG_WARN, "%s: pulse: measuring the master channel failed\n", test->name);
+		return;
+	}
+
+	step_t* st = &test->program[test->step_idx];
+	double v = m.voltage / 1000.0;
+	double i = (m.mode == MODE_OFF)?(0.0):((double)m.current * test->num_channels / 1000.0);
+	double di = i - test->pulse_i0;
+	if(fabs(di) > PULSE_MIN_DI)
+		test->pulse_r = (v - test->pulse_v0) / di;
+
+	fprintf(test->pulse_log, "%u%s%d%s%s%s%.3f%s%.3f%s%.4f%s%.4f%s%.2f\n", test->cycle_cnt, delim, test->step_idx+1, delim,
+		step_type_names[st->type], delim, now - test->pulse_t0, delim, i, delim, v, delim, v - test->pulse_v0, delim,
+		(fabs(di) > PULSE_MIN_DI)?(test->pulse_r*1000.0):(0.0));
+}
+
+void program_stop(test_t* test, char* reason)
+{
+	msg(MSGC_TEST, MSG_INFO, "Info: %s: program stopped: %s\n", test->name, reason);
+	fprintf(test->verbose_log, "Info: program stopped: %s\n", reason);
+	if(test->cur_mode != MODE_OFF && set_test_mode(test, MODE_OFF))
+		go_fatal(test->fd, "set_test_mode failed");
+	test->program_state = PROGRAM_DONE;
+	test->step_pending = 0;
+	test->next_mode = MODE_OFF;
+	pulse_end(test);
+	log_flush_held(test);
+}
+
+// Stop condition met: the program stops and the test's channels are freed at the
+// end of the tick (free_test()), so the rack can be given to another test.
+void test_end_of_life(test_t* test, char* reason)
+{
+	program_stop(test, reason);
+	test->eol = 1;
+}
+
+// Index of the next step that runs the channels, -1 if a rest or the end comes
+// first. Follows unconditional jumps only; conditions are evaluated when the step
+// is entered, so this is a forecast for the status line and the scheduler.
+int program_peek_step(test_t* test, int idx)
+{
+	int n;
+	for(n = 0; n < test->num_steps && idx < test->num_steps; n++)
+	{
+		step_t* st = &test->program[idx];
+		if(st->mode != MODE_UNDEFINED)
+			return idx;
+		if(st->type == STEP_END || (st->type == STEP_REST && st->time != 0))
+			return -1;
+		if(st->type == STEP_GOTO && st->cond.var == COND_NONE)
+			idx = st->target;
+		else
+			idx++;
+	}
+	return -1;
+}
+
+mode_t program_peek_mode(test_t* test, int idx)
+{
+	idx = program_peek_step(test, idx);
+	return (idx < 0)?(MODE_OFF):(test->program[idx].mode);
+}
+
+// Moves to step idx, running through the steps that take no time (cycle, loop,
+// goto, zero-length rest) until one that does.
+void program_enter(test_t* test, int idx, int cur_time)
+{
+	int jumps;
+	for(jumps = 0; jumps < PROGRAM_MAX_JUMPS; jumps++)
+	{
+		if(idx >= test->num_steps)
+		{
+			program_stop(test, "program finished");
+			return;
+		}
+
+		step_t* st = &test->program[idx];
+		switch(st->type)
+		{
+			case STEP_CYCLE:
+				test->cycle_cnt++;
+				if(test->log_compress)
+					fprintf(test->verbose_log, "Info: log compression: %ld samples, %ld rows written\n", test->log_rows_in, test->log_rows_out);
+				if(test->stop_cycle && test->cycle_cnt >= test->stop_cycle)
+				{
+					test_end_of_life(test, "stopcycle reached");
+					return;
+				}
+				idx++;
+				break;
+
+			case STEP_GOTO:
+				if(st->cond.var == COND_NONE || cond_eval(test, &st->cond, 0))
+					idx = st->target;
+				else
+					idx++;
+				break;
+
+			case STEP_LOOP:
+				if(test->loop_done[idx] < st->count)
+				{
+					test->loop_done[idx]++;
+					idx = st->target;
+				}
+				else
+				{
+					test->loop_done[idx] = 0;
+					idx++;
+				}
+				break;
+
+			case STEP_END:
+				program_stop(test, "end step");
+				return;
+
+			case STEP_REST:
+				if(st->time == 0)
+				{
+					idx++;
+					break;
+				}
+				test->step_idx = idx;
+				test->step_start_time = cur_time;
+				test->next_mode = program_peek_mode(test, idx+1);
+				test->cooldown_due = -1;
+				test->cooldown_ref_time = -1;
+				test->cooldown_last_dvdt = -1.0;
+				fprintf(test->verbose_log, "Info: step %d: rest\n", idx+1);
+				return;
+
+			default:
+				test->step_idx = idx;
+				test->step_start_time = cur_time;
+				test->next_mode = st->mode;
+				test->step_pending = 1;
+				test->cooldown_due = -1;
+				return;
+		}
+	}
+	program_stop(test, "too many jumps without a step that takes time");
+}
+
+// A halfcycle stopped by the hardware on its own limits gives the estimator
+// its full and empty points.
+void soc_halfcycle_end(test_t* test, step_t* st)
+{
+	if(st->mode == MODE_CHARGE && st->settings.stop_mode == STOP_MODE_CURRENT)
+		soc_full(&test->soc);
+	else if(st->mode == MODE_DISCHARGE && st->settings.stop_mode == STOP_MODE_VOLTAGE)
+	{
+		if(soc_empty(&test->soc))
+			fprintf(test->verbose_log, "Info: measured capacity %.4f Ah, SoH %.1f%%\n", test->soc.capacity_est, test->soc.soh*100.0);
+	}
+}
+
+// Capacity stop conditions, at the end of every discharge that counts: the ones
+// ended by the hardware on stopvoltage, and only from the fadestep= step if given.
+// The fitted capacity is checked, not the single result, and the cycles left to
+// the threshold are projected from the fitted fade rate.
+void end_of_life_check(test_t* test, step_t* st)
+{
+	char buf[256];
+
+	if(st->mode != MODE_DISCHARGE || st->type == STEP_PULSE || st->settings.stop_mode != STOP_MODE_VOLTAGE)
+		return;
+	if(test->fade_step && strcmp(st->label, test->fade_step))
+		return;
+
+	double ah = -test->cur_meas.cumul_ah;
+	fade_add(&test->fade, test->cycle_cnt, ah);
+	if(test->fade.n < FADE_MIN_POINTS)
+	{
+		fprintf(test->verbose_log, "Info: capacity %.4f Ah (%d/%d points before fitting)\n", ah, test->fade.n, FADE_MIN_POINTS);
+		return;
+	}
+
+	double initial = fade_initial(&test->fade);
+	double fit = fade_value(&test->fade, test->cycle_cnt);
+	double slope = fade_slope(&test->fade);
+	double threshold = test->stop_capacity;
+	if(test->stop_fade > 0.0 && test->stop_fade/100.0*initial > threshold)
+		threshold = test->stop_fade/100.0*initial;
+
+	int len = snprintf(buf, sizeof(buf), "capacity %.4f Ah, fitted %.4f Ah (%.1f%% of initial %.4f Ah), %.6f Ah/cycle",
+		ah, fit, 100.0*fit/initial, initial, slope);
+	if(threshold > 0.0 && slope < 0.0 && fit > threshold)
+		snprintf(buf+len, sizeof(buf)-len, ", end of life in about %.0f cycles", (threshold - fit)/slope);
+	msg(MSGC_TEST, MSG_INFO, "Info: %s: %s\n", test->name, buf);
+	fprintf(test->verbose_log, "Info: %s\n", buf);
+
+	if(threshold > 0.0 && fit <= threshold)
+		test_end_of_life(test, "end of life: capacity below the stop threshold");
+}
+
+#define SCHED_DEFAULT_HORIZON 3600 // s; expected length of a step that hasn't run yet
+
+// Cell power (W, positive charges the cell) to the pack side: charging cells draw
+// more from the pack, discharging ones give back less.
+double pack_side_power(double p)
+{
+	return (p > 0.0)?(p / pack_efficiency):(p * pack_efficiency);
+}
+
+// Expected cell power of a step, from its settings and the latest voltage.
+double step_power_estimate(test_t* test, step_t* st)
+{
+	base_settings_t* b = &st->settings;
+	double v = test->cur_meas.voltage;
+	double p;
+	if(v < 0.5)
+		v = (b->voltage > 0.0)?(b->voltage):(b->stop_voltage);
+	if(b->const_power_mode)
+		p = b->power;
+	else if(b->const_resistance_mode)
+		p = v*v / b->load_resistance;
+	else
+		p = b->current * v;
+	return (st->mode == MODE_CHARGE)?(p):(-p);
+}
+
+// Present pack-side power of a test, W; measured, or expected if its channels
+// were started in this tick and have not been measured yet.
+double test_pack_power(test_t* test)
+{
+	if(test->finished || test->cur_mode == MODE_OFF)
+		return 0.0;
+	if(test->cur_meas.mode == test->cur_mode)
+		return pack_side_power(test->cur_meas.voltage * test->cur_meas.current);
+	if(test->program_state == PROGRAM_RUNNING && test->program[test->step_idx].mode != MODE_UNDEFINED)
+		return pack_side_power(step_power_estimate(test, &test->program[test->step_idx]));
+	return 0.0;
+}
+
+// Seconds until the running step of a test is expected to end (from the
+// previous run of the same step), -1 if unknown or not running.
+int test_expected_left(test_t* test, int cur_time)
+{
+	if(test->program_state != PROGRAM_RUNNING || test->cur_mode == MODE_OFF)
+		return -1;
+	int d = test->step_last_duration[test->step_idx];
+	if(d <= 0)
+		return -1;
+	int left = test->step_start_time + d - cur_time;
+	return (left > 0)?(left):(0);
+}
+
+// Pack voltage for the current conversions: reported by the boards if they do,
+// packvoltage= otherwise.
+double pack_present_voltage(void)
+{
+	return (pack_vin > 0.0)?(pack_vin):(pack_voltage);
+}
+
+double pack_net_current(void)
+{
+	double p = 0.0;
+	int t;
+	for(t = 0; t < num_all_tests; t++)
+		p += test_pack_power(&all_tests[t]);
+	return p / pack_present_voltage();
+}
+
+// Whether the test may start step idx now, waited s after its rest ended. The
+// other tests are modeled as running at their present power until their
+// expected end; the start is held if that, with the new step added, would go
+// over packlimit= during the new step, unless the start brings the net closer to
+// zero. After startslack= the start is let through anyway.
+int sched_may_start(test_t* test, int idx, int waited, int cur_time)
+{
+	if(idx < 0)
+		return 1;
+
+	// Paused for the pack SoC or voltage: held for as long as it takes.
+	int paused = (pack_pause == PACK_PAUSE_CHARGE && test->program[idx].mode == MODE_CHARGE) ||
+	             (pack_pause == PACK_PAUSE_DISCHARGE && test->program[idx].mode == MODE_DISCHARGE);
+	if(pack_limit <= 0.0 && power_budget <= 0.0 && !paused && !test->sched_held)
+		return 1;
+
+	int allowed = 0;
+	double worst_with = 0.0, worst_without = 0.0, worst_draw = 0.0;
+
+	if(paused)
+		allowed = 0;
+	else if(waited >= test->start_slack || (pack_limit <= 0.0 && power_budget <= 0.0))
+		allowed = 1;
+	else
+	{
+		double p_new = pack_side_power(step_power_estimate(test, &test->program[idx]));
+		int horizon = test->step_last_duration[idx];
+		if(horizon <= 0)
+			horizon = SCHED_DEFAULT_HORIZON;
+
+		// The net only changes when one of the others ends: check now and at each end.
+		int b, t;
+		for(b = -1; b < num_all_tests; b++)
+		{
+			int at = 0;
+			if(b >= 0)
+			{
+				at = test_expected_left(&all_tests[b], cur_time);
+				if(&all_tests[b] == test || at <= 0 || at >= horizon)
+					continue;
+			}
+			double net = 0.0;
+			for(t = 0; t < num_all_tests; t++)
+			{
+				test_t* o = &all_tests[t];
+				int left = test_expected_left(o, cur_time);
+				if(o == test || (left >= 0 && left <= at && b >= 0))
+					continue;
+				net += test_pack_power(o);
+			}
+			if(fabs(net) > worst_without)
+				worst_without = fabs(net);
+			if(fabs(net + p_new) > worst_with)
+				worst_with = fabs(net + p_new);
+			if(net + p_new > worst_draw)
+				worst_draw = net + p_new;
+		}
+		allowed = (pack_limit <= 0.0 || worst_with <= pack_limit * pack_voltage || worst_with <= worst_without) &&
+		          (power_budget <= 0.0 || p_new <= 0.0 || worst_draw <= power_budget);
+	}
+
+	if(paused && !test->sched_held)
+	{
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: holding the start of step %d, stationary pack too %s\n",
+			test->name, idx+1, (pack_pause == PACK_PAUSE_CHARGE)?("empty"):("full"));
+		fprintf(test->verbose_log, "Info: holding the start of step %d, stationary pack too %s\n",
+			idx+1, (pack_pause == PACK_PAUSE_CHARGE)?("empty"):("full"));
+	}
+	else if(!allowed && !test->sched_held)
+	{
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: holding the start of step %d, pack current would reach %.1f A, draw %.0f W\n",
+			test->name, idx+1, worst_with / pack_voltage, worst_draw);
+		fprintf(test->verbose_log, "Info: holding the start of step %d, pack current would reach %.1f A (%.1f A without), draw %.0f W\n",
+			idx+1, worst_with / pack_voltage, worst_without / pack_voltage, worst_draw);
+	}
+	if(allowed && test->sched_held)
+		fprintf(test->verbose_log, "Info: start released after %d s%s\n", waited,
+			(waited >= test->start_slack && (pack_limit > 0.0 || power_budget > 0.0))?(" (startslack)"):(""));
+	test->sched_held = !allowed;
+	return allowed;
+}
+
+#define BUDGET_MIN_SCALE 0.2      // throttling doesn't go below this fraction of the set current or power
+#define BUDGET_STOP_MARGIN 1.5    // nor below this times stopcurrent=, which would end the charge
+#define BUDGET_RESTORE 0.9        // throttled tests are let back up below this fraction of powerbudget=
+#define BUDGET_TARGET 0.95        // and adjustments aim here, between the two thresholds
+
+// Whether the power budget may change the current of a test now: charging in CC
+// in a step of its own (not profiles, pulse steps or during resistance pulses).
+int budget_adjustable(test_t* test)
+{
+	return !test->finished && !test->profile_file && test->program_state == PROGRAM_RUNNING &&
+	       !test->step_pending && test->cur_mode == MODE_CHARGE && test->cur_meas.mode == MODE_CHARGE &&
+	       test->cur_meas.cccv == MODE_CC && test->resistance_state == 0 && !pulse_step_running(test);
+}
+
+// Smallest scale that keeps a current stopped step from ending on its stop current.
+double stop_margin_scale(base_settings_t* nom)
+{
+	if(nom->const_power_mode || nom->const_resistance_mode || nom->stop_mode != STOP_MODE_CURRENT)
+		return 0.0;
+	return BUDGET_STOP_MARGIN * nom->stop_current / nom->current;
+}
+
+double budget_min_scale(test_t* test)
+{
+	double min = stop_margin_scale(&test->program[test->step_idx].settings);
+	if(min < BUDGET_MIN_SCALE)
+		min = BUDGET_MIN_SCALE;
+	return (min < 1.0)?(min):(1.0);
+}
+
+// Scales a step's current, power or conductance.
+void scale_settings(base_settings_t* b, base_settings_t* nom, double scale)
+{
+	if(b->const_power_mode)
+		b->power = nom->power * scale;
+	else if(b->const_resistance_mode)
+		b->load_resistance = nom->load_resistance / scale;
+	else
+		b->current = nom->current * scale;
+}
+
+// Applies the power budget and temperature derating scales to the running step,
+// from its own settings. Constant current is set right away; constant power and
+// resistance follow at the next sample.
+void test_apply_scale(test_t* test)
+{
+	base_settings_t* nom = &test->program[test->step_idx].settings;
+	base_settings_t* b = (test->cur_mode == MODE_CHARGE)?(&test->charge):(&test->discharge);
+	double sign = (test->cur_mode == MODE_CHARGE)?(1.0):(-1.0);
+
+	scale_settings(b, nom, test->budget_scale * test->derate_scale);
+	if(!b->const_power_mode && !b->const_resistance_mode)
+		test_set_current(test, sign * b->current * (resistance_active(test)?(test->resistance_base_current_mul):(1.0)));
+}
+
+void budget_set_scale(test_t* test, double scale, int cur_time)
+{
+	fprintf(test->verbose_log, "Info: t=%d: power budget: charge scaled to %.0f%%\n", cur_time, scale*100.0);
+	if(pack_log)
+		fprintf(pack_log, "# t=%d: %s scaled to %.0f%%\n", cur_time, test->name, scale*100.0);
+	test->budget_scale = scale;
+	test_apply_scale(test);
+}
+
+// Keeps the net power net (W) drawn from the stationary pack within what the
+// charger replaces (powerbudget=). Once a second: while over, charging tests are
+// throttled, lowest priority first; with headroom, they are let back up, highest
+// priority first. Tests that would start over the budget are held instead by
+// sched_may_start().
+void budget_update(int num_tests, test_t* tests, double net, int cur_time)
+{
+	int t;
+
+	if(power_budget > 0.0)
+	{
+		double excess = (net > power_budget)?(net - BUDGET_TARGET * power_budget):(0.0);
+		double headroom = (net < BUDGET_RESTORE * power_budget)?(BUDGET_TARGET * power_budget - net):(0.0);
+		int prio_lo = 0, prio_hi = 0, first = 1;
+		for(t = 0; t < num_tests; t++)
+		{
+			if(first || tests[t].priority < prio_lo) prio_lo = tests[t].priority;
+			if(first || tests[t].priority > prio_hi) prio_hi = tests[t].priority;
+			first = 0;
+		}
+
+		if(excess > 0.0)
+		{
+			// Lowest priority first; within a priority, in test order.
+			int prio;
+			for(prio = prio_lo; prio <= prio_hi && excess > 0.0; prio++)
+			for(t = 0; t < num_tests && excess > 0.0; t++)
+			{
+				test_t* test = &tests[t];
+				if(test->priority != prio || !budget_adjustable(test))
+					continue;
+				double p = test_pack_power(test);
+				double p_nom = p / test->budget_scale;
+				double min = budget_min_scale(test);
+				if(p <= 0.0 || test->budget_scale <= min)
+					continue;
+				double scale = (p - excess) / p_nom;
+				if(scale < min)
+					scale = min;
+				excess -= p - scale * p_nom;
+				msg(MSGC_TEST, MSG_INFO, "Info: %s: over the power budget, throttling to %.0f%%\n", test->name, scale*100.0);
+				budget_set_scale(test, scale, cur_time);
+			}
+		}
+		else if(headroom > 0.0)
+		{
+			int prio;
+			for(prio = prio_hi; prio >= prio_lo && headroom > 0.0; prio--)
+			for(t = 0; t < num_tests && headroom > 0.0; t++)
+			{
+				test_t* test = &tests[t];
+				if(test->priority != prio || test->budget_scale >= 1.0 || !budget_adjustable(test))
+					continue;
+				double p = test_pack_power(test);
+				double p_nom = p / test->budget_scale;
+				if(p_nom <= 0.0)
+					continue;
+				double scale = (p + headroom) / p_nom;
+				if(scale > 1.0)
+					scale = 1.0;
+				headroom -= (scale - test->budget_scale) * p_nom;
+				budget_set_scale(test, scale, cur_time);
+			}
+		}
+	}
+}
+
+#define DERATE_MIN_CHANGE 0.02 // smaller changes of the derating scale aren't sent
+
+// Temperature derating, once a second: from deratetemp= up to temperaturestop, the
+// current (or power) is cut linearly down to deratemin=; temperaturestop still
+// stops the test. Not in pulse steps or during resistance pulses; while the
+// channels are off, the scale is taken into use at the start of the next step.
+void derate_update(test_t* test, int cur_time)
+{
+	double temp = test->cur_meas.temperature;
+	double scale = 1.0;
+	int running = test->program_state == PROGRAM_RUNNING && !test->step_pending && test->cur_mode != MODE_OFF;
+
+	if(running && test->derate_scale < 1.0)
+	{
+		test->derate_hc_s += test->tick_dt;
+		test->derate_total_s += test->tick_dt;
+	}
+
+	if(temp > test->derate_temp)
+	{
+		scale = 1.0 - (temp - test->derate_temp) / (test->temperature_stop - test->derate_temp) * (1.0 - test->derate_min);
+		if(scale < test->derate_min)
+			scale = test->derate_min;
+		if(running)
+		{
+			double min = stop_margin_scale(&test->program[test->step_idx].settings);
+			if(scale < min)
+				scale = (min < 1.0)?(min):(1.0);
+		}
+	}
+	if(scale == test->derate_scale || (scale < 1.0 && fabs(scale - test->derate_scale) < DERATE_MIN_CHANGE))
+		return;
+	if(running && (test->cur_meas.mode != test->cur_mode || test->resistance_state != 0 || pulse_step_running(test)))
+		return;
+
+	if(test->derate_scale == 1.0)
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: %.1f C, derating current\n", test->name, temp);
+	else if(scale == 1.0)
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: %.1f C, derating ended after %.0f s in total\n", test->name, temp, test->derate_total_s);
+	fprintf(test->verbose_log, "Info: t=%d: %.1f C, derating to %.0f%%\n", cur_time, temp, scale*100.0);
+	test->derate_scale = scale;
+	if(running)
+		test_apply_scale(test);
+}
+
+#define PACK_V_MARGIN 0.4         // V from the ends of the input range where starts are paused
+#define PACK_V_HYSTERESIS 0.2     // V
+#define PACK_SOC_HYSTERESIS 0.05
+#define PACK_WARN_MARGIN 0.05     // SoC; warned this much before the pause limits
+#define PACK_V_HARD_MARGIN 0.1    // V from the ends of the input range where running halfcycles are stopped
+#define PACK_SOC_HARD_MARGIN 0.05 // SoC beyond the pause limits where running halfcycles are stopped
+
+void pack_set_pause(pack_pause_t pause, int cur_time)
+{
+	if(pause == pack_pause)
+		return;
+	if(pause == PACK_PAUSE_NONE)
+		msg(MSGC_GENERAL, MSG_INFO, "Info: stationary pack back in range, %s starts resumed\n",
+			(pack_pause == PACK_PAUSE_CHARGE)?("charge"):("discharge"));
+	else
+		msg(MSGC_GENERAL, MSG_WARN, "stationary pack too %s, pausing %s starts\n",
+			(pause == PACK_PAUSE_CHARGE)?("empty"):("full"), (pause == PACK_PAUSE_CHARGE)?("charge"):("discharge"));
+	if(pack_log)
+		fprintf(pack_log, "# t=%d: %s\n", cur_time, (pause == PACK_PAUSE_NONE)?("resumed"):
+			((pause == PACK_PAUSE_CHARGE)?("charge starts paused"):("discharge starts paused")));
+	pack_pause = pause;
+}
+
+void pack_set_stop(pack_pause_t stop, int cur_time)
+{
+	if(stop == pack_stop)
+		return;
+	if(stop != PACK_PAUSE_NONE)
+		msg(MSGC_GENERAL, MSG_WARN, "stationary pack nearly %s, stopping running %s\n",
+			(stop == PACK_PAUSE_CHARGE)?("empty"):("full"), (stop == PACK_PAUSE_CHARGE)?("charges"):("discharges"));
+	if(pack_log)
+		fprintf(pack_log, "# t=%d: %s\n", cur_time, (stop == PACK_PAUSE_NONE)?("stop lifted"):
+			((stop == PACK_PAUSE_CHARGE)?("running charges stopped"):("running discharges stopped")));
+	pack_stop = stop;
+}
+
+// Whether a running step is to be stopped because it takes the pack further out
+// of its range (see pack_update()).
+int pack_stops_step(step_t* st)
+{
+	return (pack_stop == PACK_PAUSE_CHARGE && st->mode == MODE_CHARGE) ||
+	       (pack_stop == PACK_PAUSE_DISCHARGE && st->mode == MODE_DISCHARGE);
+}
+
+// Once a second: sums the flows of all tests on the pack side, keeps the pack
+// energy balance and SoC (with packcapacity=), pauses the starts that would take
+// the pack further out when it nears the end of its SoC or voltage range, and
+// past that, stops the running halfcycles that do; runs the power budget and
+// writes pack.log.
+void pack_update(int num_tests, test_t* tests, int cur_time)
+{
+	double net = 0.0, to_cells = 0.0, from_cells = 0.0;
+	double vin_sum = 0.0;
+	int vin_n = 0;
+	int t;
+	double now = run_clock(0.0);
+	double dt = (pack_last_tick > 0.0)?(now - pack_last_tick):(1.0);
+	pack_last_tick = now;
+
+	for(t = 0; t < num_tests; t++)
+	{
+		double p = test_pack_power(&tests[t]);
+		if(p > 0.0)
+			to_cells += p;
+		else
+			from_cells -= p;
+		net += p;
+		if(!tests[t].finished && tests[t].cur_meas.input_voltage > 0.0)
+		{
+			vin_sum += tests[t].cur_meas.input_voltage;
+			vin_n++;
+		}
+	}
+	pack_wh_out += to_cells * dt / 3600.0;
+	pack_wh_in += from_cells * dt / 3600.0;
+	pack_vin = (vin_n)?(vin_sum / vin_n):(0.0);
+
+	// A CV charger set to the voltage of charger_soc only charges below it.
+	double charger_w = (charger_input > 0.0 && pack_soc < charger_soc)?(charger_input):(0.0);
+	if(pack_capacity > 0.0)
+	{
+		double prev = pack_soc;
+		pack_soc += (charger_w - net) * dt / 3600.0 / pack_capacity;
+		if(pack_soc < 0.0) pack_soc = 0.0;
+		if(pack_soc > 1.0) pack_soc = 1.0;
+
+		if(prev > pack_soc_min + PACK_WARN_MARGIN && pack_soc <= pack_soc_min + PACK_WARN_MARGIN)
+			msg(MSGC_GENERAL, MSG_WARN, "stationary pack SoC down to %.0f%%\n", pack_soc*100.0);
+		if(prev < pack_soc_max - PACK_WARN_MARGIN && pack_soc >= pack_soc_max - PACK_WARN_MARGIN)
+			msg(MSGC_GENERAL, MSG_WARN, "stationary pack SoC up to %.0f%%\n", pack_soc*100.0);
+	}
+
+	int low = (pack_capacity > 0.0 && pack_soc <= pack_soc_min) || (pack_vin > 0.0 && pack_vin <= PACK_V_MIN + PACK_V_MARGIN);
+	int high = (pack_capacity > 0.0 && pack_soc >= pack_soc_max) || (pack_vin > 0.0 && pack_vin >= PACK_V_MAX - PACK_V_MARGIN);
+	if(low)
+		pack_set_pause(PACK_PAUSE_CHARGE, cur_time);
+	else if(high)
+		pack_set_pause(PACK_PAUSE_DISCHARGE, cur_time);
+	else if(pack_pause == PACK_PAUSE_CHARGE &&
+	        (pack_capacity <= 0.0 || pack_soc > pack_soc_min + PACK_SOC_HYSTERESIS) &&
+	        (pack_vin <= 0.0 || pack_vin > PACK_V_MIN + PACK_V_MARGIN + PACK_V_HYSTERESIS))
+		pack_set_pause(PACK_PAUSE_NONE, cur_time);
+	else if(pack_pause == PACK_PAUSE_DISCHARGE &&
+	        (pack_capacity <= 0.0 || pack_soc < pack_soc_max - PACK_SOC_HYSTERESIS) &&
+	        (pack_vin <= 0.0 || pack_vin < PACK_V_MAX - PACK_V_MARGIN - PACK_V_HYSTERESIS))
+		pack_set_pause(PACK_PAUSE_NONE, cur_time);
+
+	// Halfcycles already running are let finish while the starts are paused,
+	// unless the pack gets this close to the end of its range.
+	double hard_soc_min = (pack_soc_min > PACK_SOC_HARD_MARGIN)?(pack_soc_min - PACK_SOC_HARD_MARGIN):(0.0);
+	double hard_soc_max = (pack_soc_max < 1.0 - PACK_SOC_HARD_MARGIN)?(pack_soc_max + PACK_SOC_HARD_MARGIN):(1.0);
+	if((pack_capacity > 0.0 && pack_soc <= hard_soc_min) || (pack_vin > 0.0 && pack_vin <= PACK_V_MIN + PACK_V_HARD_MARGIN))
+		pack_set_stop(PACK_PAUSE_CHARGE, cur_time);
+	else if((pack_capacity > 0.0 && pack_soc >= hard_soc_max) || (pack_vin > 0.0 && pack_vin >= PACK_V_MAX - PACK_V_HARD_MARGIN))
+		pack_set_stop(PACK_PAUSE_DISCHARGE, cur_time);
+	else if(pack_pause == PACK_PAUSE_NONE)
+		pack_set_stop(PACK_PAUSE_NONE, cur_time);
+
+	budget_update(num_tests, tests, net, cur_time);
+
+	if(pack_log)
+	{
+		fprintf(pack_log, "%d%s%.1f%s%.2f%s%.1f%s%.1f%s%.1f%s%.3f%s%.3f%s%.1f%s%.1f%s%.3f\n", cur_time,
+			delim, net, delim, net / pack_present_voltage(), delim, (power_budget > 0.0)?(power_budget - net):(0.0),
+			delim, to_cells, delim, from_cells, delim, pack_wh_out, delim, pack_wh_in,
+			delim, charger_w, delim, (pack_capacity > 0.0)?(pack_soc*100.0):(-1.0), delim, pack_vin);
+		fflush(pack_log);
+	}
+}
+
+#define COOLDOWN_DVDT_WINDOW 60 // s
+
+// Adaptive cooldown, once a tick in a timed rest: done once cooldownmin= has passed,
+// the temperature is within cooldownband= of ambient and the voltage has moved less
+// than cooldowndvdt= over the latest whole window. Rests with an until= condition and
+// the relaxation after a pulse step run their time.
+int cooldown_settled(test_t* test, step_t* st, int step_time)
+{
+	if(st->type != STEP_REST)
+		return 0;
+	if(test->cooldown_due >= 0)
+		return 1;
+	if(test->cooldown_min < 0 || st->until.var != COND_NONE ||
+	   test->pulse_armed || test->pulse_sampling)
+		return 0;
+
+	double v = test->cur_meas.voltage;
+	if(test->cooldown_ref_time < 0)
+	{
+		test->cooldown_ref_time = step_time;
+		test->cooldown_ref_v = v;
+	}
+	else if(step_time - test->cooldown_ref_time >= COOLDOWN_DVDT_WINDOW)
+	{
+		test->cooldown_last_dvdt = fabs(v - test->cooldown_ref_v) / (double)(step_time - test->cooldown_ref_time);
+		test->cooldown_ref_time = step_time;
+		test->cooldown_ref_v = v;
+	}
+
+	double ambient = (test->ambient != 0.0)?(test->ambient):(test->temp_min_seen);
+	if(step_time < test->cooldown_min || test->cooldown_last_dvdt < 0.0 ||
+	   test->cooldown_last_dvdt > test->cooldown_dvdt || !temperature_in_range(test->cur_meas.temperature) ||
+	   test->cur_meas.temperature > ambient + test->cooldown_band)
+		return 0;
+
+	fprintf(test->verbose_log, "Info: cooldown done at %d s: %.1f C (ambient %.1f C), %.2f mV/min\n",
+		step_time, test->cur_meas.temperature, ambient, test->cooldown_last_dvdt*1000.0*60.0);
+	test->cooldown_due = step_time;
+	return 1;
+}
+
+double cooldown_saved_ch_h(test_t* test)
+{
+	return (double)test->cooldown_saved_s * (double)test->num_channels / 3600.0;
+}
+
+double cooldown_saved_total(int num_tests, test_t* tests)
+{
+	double sum = 0.0;
+	int t;
+	for(t = 0; t < num_tests; t++)
+		sum += cooldown_saved_ch_h(&tests[t]);
+	return sum;
+}
+
+// Ends the running step when the hardware has stopped the channels, its time is
+// up or its until= condition is met, and moves the program on.
+void program_update(test_t* test, int cur_time)
+{
+	if(test->program_state == PROGRAM_WAIT)
+	{
+		if(test->step_start_time < 0)
+			test->step_start_time = cur_time + PROGRAM_START_DELAY;
+		if(cur_time >= test->step_start_time &&
+		   sched_may_start(test, program_peek_step(test, 0), cur_time - test->step_start_time, cur_time))
+		{
+			test->program_state = PROGRAM_RUNNING;
+			program_enter(test, 0, cur_time);
+		}
+		return;
+	}
+
+	if(test->program_state != PROGRAM_RUNNING || test->step_pending)
+		return;
+
+	step_t* st = &test->program[test->step_idx];
+	int step_time = cur_time - test->step_start_time;
+	int done = 0;
+	int hw_ended = 0;
+
+	if(st->mode != MODE_UNDEFINED && test->cur_meas.mode == MODE_OFF && test->cur_mode != MODE_OFF)
+	{
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: %s ended, setting test off.\n", test->name, short_mode_names[test->cur_mode]);
+		done = 1;
+		hw_ended = 1;
+		if(test->soc.capacity > 0.0)
+			soc_halfcycle_end(test, st);
+	}
+	else if(st->time >= 0 && (step_time >= st->time || cooldown_settled(test, st, step_time)))
+	{
+		// Cooldowns may be stretched to stagger the starts of the tests.
+		int due = (test->cooldown_due >= 0 && test->cooldown_due < st->time)?(test->cooldown_due):(st->time);
+		if(st->type != STEP_REST ||
+		   sched_may_start(test, program_peek_step(test, test->step_idx+1), step_time - due, cur_time))
+			done = 1;
+	}
+	else if(st->until.var != COND_NONE && cond_eval(test, &st->until, step_time))
+		done = 1;
+	else if(st->mode != MODE_UNDEFINED && st->settings.stop_if.var != COND_NONE && cond_eval(test, &st->settings.stop_if, step_time))
+	{
+		cond_t* c = &st->settings.stop_if;
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: %s stopped on %s%s%g, setting test off.\n", test->name, short_mode_names[test->cur_mode],
+			cond_var_names[c->var], cond_op_names[c->op], c->value);
+		done = 1;
+	}
+	else if(st->mode != MODE_UNDEFINED && pack_stops_step(st))
+	{
+		msg(MSGC_TEST, MSG_WARN, "%s: %s stopped, stationary pack nearly %s\n", test->name, short_mode_names[test->cur_mode],
+			(st->mode == MODE_CHARGE)?("empty"):("full"));
+		fprintf(test->verbose_log, "Info: t=%d: %s stopped for the stationary pack\n", cur_time, short_mode_names[test->cur_mode]);
+		done = 1;
+	}
+
+	if(!done)
+		return;
+
+	if(st->mode != MODE_UNDEFINED)
+		test->step_last_duration[test->step_idx] = step_time;
+	if(st->type == STEP_REST && test->cooldown_due >= 0 && st->time > step_time)
+	{
+		test->cooldown_saved_s += st->time - step_time;
+		fprintf(test->verbose_log, "Info: t=%d: cooldown ended after %d s of %d s; saved %ld s, %.2f channel-hours in total\n",
+			cur_time, step_time, st->time, test->cooldown_saved_s, cooldown_saved_ch_h(test));
+	}
+	pulse_end(test);
+	if(st->type == STEP_PULSE)
+	{
+		// The rest after a pulse is sampled too (relaxation). pulse_arm() takes the
+		// end of the pulse as its reference, so the relaxation dV and dV/dI are from
+		// the loaded voltage and current at the end of the pulse, not from before it.
+		if(test->pulse_r != 0.0)
+		{
+			test->cur_meas.resistance = test->pulse_r;
+			test->hc_stats.resistance_sum += test->pulse_r;
+			test->hc_stats.resistance_cnt++;
+		}
+		pulse_arm(test);
+	}
+
+	if(st->mode != MODE_UNDEFINED)
+	{
+		log_summary(&test->cur_meas, test, cur_time - test->cur_meas.start_time);
+		if(test->ica_on && st->type != STEP_PULSE)
+			log_ica(test, st->mode);
+		set_test_mode(test, MODE_OFF);
+		if(hw_ended)
+		{
+			end_of_life_check(test, st);
+			if(test->eol)
+				return;
+		}
+	}
+	program_enter(test, test->step_idx+1, cur_time);
+
+	if(test->pulse_armed && (test->program_state != PROGRAM_RUNNING || test->program[test->step_idx].type != STEP_REST))
+		test->pulse_armed = 0;
+}
+
+// Starts a step that runs the channels; done at the end of the tick like the
+// halfcycle starts always were.
+void program_start_step(test_t* test, int cur_time)
+{
+	if(!test->step_pending)
+		return;
+
+	step_t* st = &test->program[test->step_idx];
+	test->step_pending = 0;
+	test->step_start_time = cur_time;
+
+	msg(MSGC_TEST, MSG_INFO, "Info: %s: step %d: starting %s (%s)\n", test->name, test->step_idx+1,
+		(st->mode == MODE_CHARGE)?("charge"):("discharge"), step_type_names[st->type]);
+	test->cur_meas.start_time = cur_time;
+	test->cur_meas.cumul_ah = 0.0;
+	test->cur_meas.cumul_wh = 0.0;
+	halfcycle_stats_reset(&test->hc_stats, st->mode);
+	if(st->type == STEP_PULSE)
+		pulse_arm(test);
+	if(test->ica_on)
+		ica_reset(&test->ica);
+
+	test->budget_scale = 1.0;
+	test->derate_hc_s = 0.0;
+	double derate = test->derate_scale;
+	if(st->type == STEP_PULSE)
+		derate = 1.0;
+	else if(derate < stop_margin_scale(&st->settings))
+		derate = stop_margin_scale(&st->settings);
+	if(st->mode == MODE_CHARGE)
+	{
+		test->charge = st->settings;
+		if(derate < 1.0)
+			scale_settings(&test->charge, &st->settings, derate);
+		if(start_charge(test) < 0)
+			go_fatal(test->fd, "start_charge failed");
+	}
+	else
+	{
+		test->discharge = st->settings;
+		if(derate < 1.0)
+			scale_settings(&test->discharge, &st->settings, derate);
+		if(start_discharge(test) < 0)
+			go_fatal(test->fd, "start_discharge failed");
+	}
+	usleep(1000);
+}
+
+void profile_stop(test_t* test, char* reason)
+{
+	msg(MSGC_TEST, MSG_INFO, "Info: %s: profile stopped: %s\n", test->name, reason);
+	fprintf(test->verbose_log, "Info: profile stopped: %s\n", reason);
+	if(set_test_mode(test, MODE_OFF))
+		go_fatal(test->fd, "set_test_mode failed");
+	test->profile_running = 0;
+	test->profile_round = test->profile_repeat; // not restarted
+	test->next_mode = MODE_OFF;
+	fflush(test->profile_log);
+}
+
+// Sets the total test current; changing the direction reconfigures the channels,
+// near-zero currents turn them off.
+int profile_set_current(test_t* test, double current)
+{
+	mode_t mode = MODE_OFF;
+	if(current >= PROFILE_REST_CURRENT)
+		mode = MODE_CHARGE;
+	else if(current <= -PROFILE_REST_CURRENT)
+		mode = MODE_DISCHARGE;
+
+	// Direction changes only resend the voltage limits if the channels have the
+	// other direction's, then the setpoint and the mode; no full reconfiguration.
+	if(mode != test->cur_mode)
+	{
+		test->profile_last_set = current;
+		if(mode == MODE_OFF)
+			return set_test_mode(test, MODE_OFF);
+		if(mode == MODE_CHARGE)
+			test->charge.current = current;
+		else
+			test->discharge.current = -current;
+		if(test->cur_mode != MODE_OFF && set_test_mode(test, MODE_OFF))
+			return -1;
+		if(mode != test->profile_hw_mode && hw_set_limits(test, mode))
+			return -1;
+		if(test_set_current(test, current))
+			return -1;
+		return set_test_mode(test, mode);
+	}
+
+	if(mode == MODE_OFF || current == test->profile_last_set)
+		return 0;
+	test->profile_last_set = current;
+	return test_set_current(test, current);
+}
+
+// Profile playback step, called from run() as often as possible; acts at the
+// profile rate. The measurement taken before each new setpoint is the response
+// to the previous one, and both are logged.
+void profile_tick(test_t* test, double now)
+{
+	if(!test->profile_file || now < test->profile_next)
+		return;
+
+	double period = 1.0/(double)test->profile_rate;
+	double duration = profile_duration(&test->profile);
+
+	if(!test->profile_running)
+	{
+		if(test->profile_round >= test->profile_repeat)
+			return;
+		test->profile_running = 1;
+		test->profile_start = now;
+		test->profile_last_tick = now;
+		test->profile_last_set = 0.0;
+		test->cur_meas.start_time = (int)now;
+		test->cur_meas.cumul_ah = 0.0;
+		test->cur_meas.cumul_wh = 0.0;
+		profile_rewind(&test->profile);
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: starting profile, round %d/%d\n", test->name, test->profile_round+1, test->profile_repeat);
+	}
+
+	double t = now - test->profile_start;
+	if(t >= duration)
+	{
+		test->profile_round++;
+		if(test->profile_round >= test->profile_repeat)
+		{
+			profile_stop(test, "finished");
+			return;
+		}
+		test->profile_start += duration;
+		t -= duration;
+		profile_rewind(&test->profile);
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: profile round %d/%d\n", test->name, test->profile_round+1, test->profile_repeat);
+	}
+
+	// Don't try to catch up missed ticks; just continue from now.
+	test->profile_next += period;
+	if(test->profile_next <= now)
+		test->profile_next = now + period;
+
+	hw_measurement_t m;
+	if(measure_master(test, &m))
+	{
+		msg(MSGC_HW, MSG_WARN, "%s: profile: measuring the master channel failed\n", test->name);
+		return;
+	}
+
+	if(m.mode == MODE_OFF && test->cur_mode != MODE_OFF)
+	{
+		profile_stop(test, "channels turned off by the voltage limits");
+		return;
+	}
+
+	double v = m.voltage / 1000.0;
+	double meas_current = (test->cur_mode == MODE_OFF)?(0.0):((double)m.current * test->num_channels / 1000.0);
+	double dt = now - test->profile_last_tick;
+	test->profile_last_tick = now;
+	test->cur_meas.cumul_ah += meas_current * dt / 3600.0;
+	test->cur_meas.cumul_wh += meas_current * v * dt / 3600.0;
+	if(test->soc.capacity > 0.0)
+		soc_count(&test->soc, meas_current * dt / 3600.0);
+
+	double value = profile_value(&test->profile, t);
+	double current = value;
+	if(test->profile_power)
+		current = (v > 0.5)?(value / v):(0.0);
+
+	double limit = (double)(HW_MAX_CURRENT-200)/1000.0 * test->num_channels;
+	if(current > limit) current = limit;
+	if(current < -limit) current = -limit;
+
+	fprintf(test->profile_log, "%u%s%.2f%s%.3f%s%.3f%s%.3f%s%.4f\n", test->profile_round, delim, t, delim, value, delim,
+		current, delim, meas_current, delim, v);
+
+	if(profile_set_current(test, current))
+		go_fatal(test->fd, "profile: setting current failed");
+}
+
+// Safety monitor: a thread of its own checks the hard limits of every test at
+// safetyperiod= intervals, from the latest measurement of the master channel. That
+// is the control loop's, or the monitor's own poll when the control loop's is older
+// than half a period; a busy bus is skipped, not waited for. A limit exceeded, or
+// no measurement within safetydeadline= while the channels are on, turns the
+// channels off right from the thread, and the control loop then stops the test.
+// If the channels can't be reached, everything is shut down with go_fatal().
+
+#define SAFETY_LOCK_TIMEOUT_MS 20
+#define SAFETY_OFF_LOCK_TIMEOUT_MS 1000
+#define SAFETY_OFF_TRIES 3
+#define SAFETY_DTDT_WINDOW 30.0     // s
+#define SAFETY_MISMATCH_TIME 2.0    // s a current mismatch must last
+
+pthread_mutex_t safety_lock = PTHREAD_MUTEX_INITIALIZER;
+// Held by the monitor while it uses the buses of a test, and by free_test() while
+// it closes them, so a closed (and maybe reused) fd is never polled.
+pthread_mutex_t safety_bus_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void safety_feed(test_t* test, hw_measurement_t* meas)
+{
+	pthread_mutex_lock(&safety_lock);
+	test->safety_meas = *meas;
+	test->safety_time = run_clock(0.0);
+	pthread_mutex_unlock(&safety_lock);
+}
+
+void safety_set_active(test_t* test, int active)
+{
+	pthread_mutex_lock(&safety_lock);
+	if(active && !test->safety_active && test->safety_time > 0.0)
+		test->safety_time = run_clock(0.0); // the deadline counts from the start
+	test->safety_active = active;
+	pthread_mutex_unlock(&safety_lock);
+}
+
+// Returns the limit exceeded (in buf), or NULL. Called under safety_lock.
+char* safety_check(test_t* test, double now, char* buf, int len)
+{
+	hw_measurement_t* m = &test->safety_meas;
+	double age = now - test->safety_time;
+
+	if(test->safety_time == 0.0)
+		return NULL; // nothing measured yet
+	if(test->safety_active && age * 1000.0 > test->safety_deadline)
+	{
+		snprintf(buf, len, "no measurement for %.1f s", age);
+		return buf;
+	}
+
+	double temp = ntc_to_c(m->temperature);
+	double v = m->voltage / 1000.0;
+	if(temp > test->safety_temp)
+	{
+		snprintf(buf, len, "temperature %.1f C over %.1f C", temp, test->safety_temp);
+		return buf;
+	}
+	if(test->safety_dtdt > 0.0)
+	{
+		// An NTC error value isn't a temperature; the slope starts over after it.
+		if(!temperature_in_range(temp))
+			test->safety_t_ref_time = 0.0;
+		else if(test->safety_t_ref_time == 0.0)
+		{
+			test->safety_t_ref = temp;
+			test->safety_t_ref_time = now;
+		}
+		else if(now - test->safety_t_ref_time >= SAFETY_DTDT_WINDOW)
+		{
+			double rate = (temp - test->safety_t_ref) / (now - test->safety_t_ref_time) * 60.0;
+			test->safety_t_ref = temp;
+			test->safety_t_ref_time = now;
+			if(rate > test->safety_dtdt)
+			{
+				snprintf(buf, len, "temperature rising %.1f C/min", rate);
+				return buf;
+			}
+		}
+	}
+	if(test->safety_vmax > 0.0 && v > test->safety_vmax)
+	{
+		snprintf(buf, len, "voltage %.3f V over %.3f V", v, test->safety_vmax);
+		return buf;
+	}
+	if(test->safety_vmin > 0.0 && v < test->safety_vmin)
+	{
+		snprintf(buf, len, "voltage %.3f V under %.3f V", v, test->safety_vmin);
+		return buf;
+	}
+
+	// Current vs. setpoint: both ways in CC, only over it in CV, none when off.
+	double diff;
+	if(m->mode == MODE_OFF)
+		diff = iabs(m->current) / 1000.0;
+	else if(m->cccv == MODE_CC)
+		diff = iabs(m->current - m->current_setpoint) / 1000.0;
+	else
+		diff = (iabs(m->current) - iabs(m->current_setpoint)) / 1000.0;
+	if(diff > test->safety_imismatch)
+	{
+		if(test->safety_mismatch_since == 0.0)
+			test->safety_mismatch_since = now;
+		else if(now - test->safety_mismatch_since >= SAFETY_MISMATCH_TIME)
+		{
+			snprintf(buf, len, "current %.2f A, set %.2f A", m->current / 1000.0, m->current_setpoint / 1000.0);
+			return buf;
+		}
+	}
+	else
+		test->safety_mismatch_since = 0.0;
+
+	return NULL;
+}
+
+void safety_trip(test_t* test, char* reason)
+{
+	char txbuf[32];
+	int i;
+
+	msg(MSGC_TEST, MSG_ERROR, "%s: safety monitor: %s, turning the channels off\n", test->name, reason);
+
+	// Hold the buses, so that the control loop can't turn the channels back on in between.
+	for(i = 0; i < test->num_buses; i++)
+		if(comm_timedlock(test->fds[i], SAFETY_OFF_LOCK_TIMEOUT_MS))
+			go_fatal(test->fds[i], "safety monitor: bus stuck");
+	test->safety_tripped = 1;
+	for(i = 0; i < test->num_channels; i++)
+	{
+		channel_t* c = &test->ch[i];
+		int tries = 0;
+		sprintf(txbuf, "@%u:OFF;", c->id);
+		while(comm_query(c->fd, txbuf, "OFF OK", NULL, SAFETY_OFF_LOCK_TIMEOUT_MS))
+		{
+			if(++tries >= SAFETY_OFF_TRIES)
+				go_fatal(c->fd, "safety monitor: cannot turn channels off");
+		}
+	}
+
+	for(i = 0; i < test->num_buses; i++)
+		comm_unlock(test->fds[i]);
+}
 
-	while(fgets(buffer, 10000, testfile))
+void* safety_thread(void* arg)
+{
+	char rxbuf[1000], txbuf[32], expect[32], reason[128];
+	while(1)
 	{
-		char* p = strtok(buffer, " \n\r");
-		while(p != NULL)
+		double start = run_clock(0.0);
+		int t;
+		for(t = 0; t < num_all_tests; t++)
 		{
-			if(parse_token(p, params))
+			test_t* test = &all_tests[t];
+			if(!test->safety_on || test->safety_tripped)
+				continue;
+
+			pthread_mutex_lock(&safety_bus_lock);
+			pthread_mutex_lock(&safety_lock);
+			int closed = test->safety_closed;
+			int stale = run_clock(0.0) - test->safety_time > safety_period / 2000.0;
+			pthread_mutex_unlock(&safety_lock);
+			if(closed)
 			{
-				free(buffer);
-				fclose(testfile);
-				return 3;
+				pthread_mutex_unlock(&safety_bus_lock);
+				continue;
 			}
 
-			p = strtok(NULL, " \n\r");
+			if(stale)
+			{
+				channel_t* c = &test->ch[test->master_channel_idx];
+				hw_measurement_t meas;
+				sprintf(txbuf, "@%u:VERB;", c->id);
+				sprintf(expect, "%u:MEAS ", c->id);
+				if(comm_query(c->fd, txbuf, expect, rxbuf, SAFETY_LOCK_TIMEOUT_MS) == 0 && parse_hw_measurement(&meas, rxbuf) == 0)
+					safety_feed(test, &meas);
+			}
+
+			pthread_mutex_lock(&safety_lock);
+			char* r = (test->safety_closed)?(NULL):(safety_check(test, run_clock(0.0), reason, sizeof(reason)));
+			if(r)
+				strcpy(test->safety_reason, r);
+			pthread_mutex_unlock(&safety_lock);
+			if(r)
+				safety_trip(test, reason);
+			pthread_mutex_unlock(&safety_bus_lock);
 		}
+		double left = safety_period / 1000.0 - (run_clock(0.0) - start);
+		if(left > 0.0)
+			usleep((int)(left * 1e6));
 	}
-
-	free(buffer);
-	fclose(testfile);
-	return 0;
+	return NULL;
 }
 
-void init_test(test_t* params)
+void safety_start(void)
 {
-	memset(params, 0, sizeof(*params));
-}
+	pthread_t th;
+	struct sched_param sp;
 
-int start_discharge(test_t* test)
-{
-	if(translate_configure_channel_hws(test, MODE_DISCHARGE) || set_test_mode(test, MODE_DISCHARGE))
-		return -1;
-	return 0;
+	if(pthread_create(&th, NULL, safety_thread, NULL))
+	{
+		printf("ERROR: cannot start the safety monitor thread\n");
+		return;
+	}
+	// Real-time priority needs privileges; without them it runs as a normal thread.
+	sp.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	if(pthread_setschedparam(th, SCHED_FIFO, &sp))
+		msg(MSGC_GENERAL, MSG_INFO, "Info: safety monitor running at normal priority\n");
+	else
+		msg(MSGC_GENERAL, MSG_INFO, "Info: safety monitor running at real-time priority\n");
 }
 
-int start_charge(test_t* test)
+// Closes the buses of a test that has reached a stop condition; it is not polled
+// any more. The logs stay open for the final status.
+void free_test(test_t* test)
 {
-	if(translate_configure_channel_hws(test, MODE_CHARGE) || set_test_mode(test, MODE_CHARGE))
-		return -1;
-	return 0;
+	int bus;
+	msg(MSGC_TEST, MSG_INFO, "Info: %s: test finished at cycle %d, channels freed\n", test->name, test->cycle_cnt);
+	fprintf(test->verbose_log, "Info: test finished at cycle %d, channels freed\n", test->cycle_cnt);
+	if(test->cooldown_min >= 0)
+		msg(MSGC_TEST, MSG_INFO, "Info: %s: adaptive cooldown saved %.2f channel-hours\n", test->name, cooldown_saved_ch_h(test));
+	pthread_mutex_lock(&safety_bus_lock);
+	pthread_mutex_lock(&safety_lock);
+	test->safety_closed = 1;
+	pthread_mutex_unlock(&safety_lock);
+	for(bus = 0; bus < test->num_buses; bus++)
+		close_device(test->fds[bus]);
+	pthread_mutex_unlock(&safety_bus_lock);
+	chanreg_release(test);
+	log_flush_held(test);
+	fflush(test->log);
+	fflush(test->verbose_log);
+	fflush(test->summary_log);
+	test->finished = 1;
 }
 
 void update_test(test_t* test, int cur_time)
 {
-
-	if(test->kludgimus_maximus)
-	{
-//		printf("Warning: kludge in use. todo: fix HW not to give false CV information (set_current() -> also set i_override\n");
-	}
-	if(measure_hw(test, test->kludgimus_maximus) < 0)
+	double now = run_clock(0.0);
+	test->tick_dt = (test->last_tick > 0.0)?(now - test->last_tick):(1.0);
+	test->last_tick = now;
+
+	test->meas_settled = (test->settle_skip == 0);
+	if(test->settle_skip > 0)
+		test->settle_skip--;
+	if(measure_hw(test) < 0)
 	{
 		fprintf(test->verbose_log, "measure_hw failed, one retry before going fatal!\n");
-		printf("measure_hw failed, one retry before going fatal!\n");
-		if(measure_hw(test, test->kludgimus_maximus) < 0)
+		msg(MSGC_TEST, MSG_WARN, "%s: measure_hw failed, one retry before going fatal!\n", test->name);
+		if(measure_hw(test) < 0)
 			go_fatal(test->fd, "measure_hw failed");
 	}
 
-	if(test->kludgimus_maximus) test->kludgimus_maximus--;
-	if(update_measurement(test, 1) < 0)
+	// Profile playback integrates Ah/Wh itself at the faster profile rate.
+	if(update_measurement(test, (test->profile_file)?(0.0):(test->tick_dt)) < 0)
 	{
 		go_fatal(test->fd, "update_measurement failed");
 	}
 
+	if(test->soc.capacity > 0.0)
+		soc_update(&test->soc, test->cur_meas.voltage, test->cur_meas.current, test->last_resistance, test->tick_dt);
+
 //	if(cur_time == 7)
 //		go_fatal(test->fd, "go_fatal test");
 
-	if(test->cur_meas.temperature > test->temperature_stop && (test->cur_mode != MODE_OFF || test->next_mode != MODE_OFF))
+	if(temperature_in_range(test->cur_meas.temperature) && test->cur_meas.temperature < test->temp_min_seen)
+		test->temp_min_seen = test->cur_meas.temperature;
+
+	// An NTC error value would look like a jump of hundreds of degrees; the window
+	// starts over instead.
+	if(temperature_in_range(test->cur_meas.temperature))
+		rolling_add(&test->deriv_t, test->cur_meas.temperature);
+	else
+		rolling_reset(&test->deriv_t);
+	if(test->cur_mode != MODE_OFF && test->resistance_state == 0)
+	{
+		rolling_add(&test->deriv_v, test->cur_meas.voltage);
+		if(test->cur_meas.voltage > test->v_peak)
+			test->v_peak = test->cur_meas.voltage;
+	}
+
+	if(test->cur_meas.temperature > test->temperature_stop && (test->cur_mode != MODE_OFF || test->program_state != PROGRAM_DONE || test->profile_running))
 	{
-		printf("Info: Test %s overtemperature, stopping test.\n", test->name);
+		msg(MSGC_TEST, MSG_WARN, "Test %s overtemperature, stopping test.\n", test->name);
 		fprintf(test->verbose_log, "Info: Test %s overtemperature, stopping test.\n", test->name);
+		if(test->profile_running)
+			profile_stop(test, "overtemperature");
 		if(set_test_mode(test, MODE_OFF))
 		{
 			go_fatal(test->fd, "set_test_mode failed");
 		}
+		test->program_state = PROGRAM_DONE;
+		test->step_pending = 0;
 		test->next_mode = MODE_OFF;
+		pulse_end(test);
 	}
 
-	if(test->cur_mode == MODE_DISCHARGE)
+	if(test->safety_tripped && !test->safety_handled)
 	{
-
+		char reason[128];
+		pthread_mutex_lock(&safety_lock);
+		strcpy(reason, test->safety_reason);
+		pthread_mutex_unlock(&safety_lock);
+		msg(MSGC_TEST, MSG_WARN, "Test %s stopped by the safety monitor: %s\n", test->name, reason);
+		fprintf(test->verbose_log, "Info: stopped by the safety monitor: %s\n", reason);
+		if(test->profile_running)
+			profile_stop(test, "safety monitor");
+		if(set_test_mode(test, MODE_OFF))
+		{
+			go_fatal(test->fd, "set_test_mode failed");
+		}
+		test->program_state = PROGRAM_DONE;
+		test->step_pending = 0;
+		test->next_mode = MODE_OFF;
+		pulse_end(test);
+		test->safety_handled = 1;
 	}
 
-	if(test->cur_meas.mode == MODE_OFF && test->cur_mode != MODE_OFF)
+	if(test->num_abort_if && (test->cur_mode != MODE_OFF || test->program_state != PROGRAM_DONE || test->profile_running))
 	{
-		printf("Info: Cycle ended, setting test off.\n");
-		if(test->cur_mode == MODE_CHARGE)
-		{
-			test->cooldown_start_time = cur_time;
-			test->next_mode = MODE_DISCHARGE;
-		}
-		else if(test->cur_mode == MODE_DISCHARGE)
+		int i;
+		for(i = 0; i < test->num_abort_if; i++)
+			if(cond_eval(test, &test->abort_if[i], cur_time - test->cur_meas.start_time))
+				break;
+		if(i < test->num_abort_if)
 		{
-			log_summary(&test->cur_meas, test, cur_time - test->cur_meas.start_time);
-			test->cooldown_start_time = cur_time;
-			test->next_mode = MODE_CHARGE;
-			test->cycle_cnt++;
+			cond_t* c = &test->abort_if[i];
+			msg(MSGC_TEST, MSG_WARN, "Test %s aborted: %s%s%g (%g), stopping test.\n", test->name,
+				cond_var_names[c->var], cond_op_names[c->op], c->value, cond_var_value(test, c->var, cur_time - test->cur_meas.start_time));
+			fprintf(test->verbose_log, "Info: aborted: %s%s%g\n", cond_var_names[c->var], cond_op_names[c->op], c->value);
+			if(test->profile_running)
+				profile_stop(test, "abortif");
+			if(set_test_mode(test, MODE_OFF))
+			{
+				go_fatal(test->fd, "set_test_mode failed");
+			}
+			test->program_state = PROGRAM_DONE;
+			test->step_pending = 0;
+			test->next_mode = MODE_OFF;
+			pulse_end(test);
+			log_flush_held(test);
 		}
-		set_test_mode(test, MODE_OFF);
 	}
 
-	if(test->cooldown_start_time == -999999)
+	if(test->derate_temp > 0.0)
+		derate_update(test, cur_time);
+
+	if(test->cur_mode == MODE_DISCHARGE)
 	{
-		test->cooldown_start_time = cur_time+5 - ((test->next_mode==MODE_CHARGE)?(test->postdischarge_cooldown):(test->postcharge_cooldown));
+
 	}
 
+	if(test->profile_file)
+	{
+		if(test->profile_running && test->cur_meas.mode == MODE_OFF && test->cur_mode != MODE_OFF)
+			profile_stop(test, "channels turned off by the voltage limits");
+	}
+	else
+	{
+		program_update(test, cur_time);
+	}
 
-	if(test->resistance_on &&
-	 (test->resistance_on_discharge_too || test->cur_mode==MODE_CHARGE)
-	 && (test->cycle_cnt % test->resistance_every_cycle) == 0)
+	if(resistance_active(test))
 	{
 		int tim = cur_time - test->cur_meas.start_time;
 		int res_cycle_time = tim % test->resistance_interval;
@@ -1472,7 +5195,6 @@ void update_test(test_t* test, int cur_time)
 					test_set_current(test, -1 * test->discharge.current * test->resistance_base_current_mul);
 				}
 				test->resistance_state = 0;
-				test->kludgimus_maximus = 2;
 			}
 		}
 
@@ -1486,88 +5208,129 @@ void update_test(test_t* test, int cur_time)
 			test->resistance_state = 0;
 		}
 	}  // end if resistance measurement
-	else if(test->cur_mode == MODE_DISCHARGE && test->discharge.const_power_mode && cur_time%10 == 5)
-	{
-		double new_current = test->discharge.power / test->cur_meas.voltage;
-		if(new_current / test->num_channels > (HW_MAX_CURRENT-50)/1000.0)
-		{
-			go_fatal(test->fd, "constant power overcurrent");
-		}
-		printf("dbg: Const power: Setting test current to %.2f A * %.3f V = %.2f W\n", new_current, test->cur_meas.voltage, new_current*test->cur_meas.voltage);
-		test_set_current(test, -1 * new_current);
 
+	// Constant power/resistance: hold the current steady during resistance pulses
+	// and let the hardware regulate in CV.
+	if(((test->cur_mode == MODE_CHARGE && (test->charge.const_power_mode || test->charge.const_resistance_mode)) ||
+	    (test->cur_mode == MODE_DISCHARGE && (test->discharge.const_power_mode || test->discharge.const_resistance_mode))) &&
+	   test->resistance_state == 0 && test->cur_meas.cccv == MODE_CC && test->cur_meas.mode == test->cur_mode)
+	{
+		const_power_control(test);
 	}
 
-	printf("test=%s cycle=%u ", test->name, test->cycle_cnt);
-	print_measurement(&test->cur_meas, cur_time - test->cur_meas.start_time);
+	if(test->cur_mode == MODE_CHARGE || test->cur_mode == MODE_DISCHARGE)
+		halfcycle_stats_add(&test->hc_stats, &test->cur_meas, test->tick_dt);
+
+	test->cur_meas.soc = (test->soc.valid)?(test->soc.soc*100.0):(-1.0);
+	test->cur_meas.soh = test->soc.soh*100.0;
+
+	print_measurement(test->name, test->cycle_cnt, &test->cur_meas, cur_time - test->cur_meas.start_time);
 	log_measurement(&test->cur_meas, test, cur_time - test->cur_meas.start_time);
+	publish_telemetry(test, cur_time);
 
 	clear_hw_measurements(test);
 	test->cur_meas.resistance = 0.0;
 
-	if(test->cur_mode == MODE_OFF && test->next_mode == MODE_DISCHARGE)
+	program_start_step(test, cur_time);
+
+	if(test->eol)
+		free_test(test);
+}
+
+// Routes a reply that starts with its channel ID ("12:MEAS ...") to the test that
+// owns the channel on registry bus rbus, in constant time. NULL if nobody does.
+test_t* route_reply(int rbus, char* reply, int* idx)
+{
+	int id;
+	if(sscanf(reply, "%d:", &id) != 1)
+		return NULL;
+	return chanreg_lookup(rbus, id, idx);
+}
+
+// Claims the test's channels in the process-wide registry, before anything is sent
+// to them. Refuses channels another test has, also under another name of the same
+// device.
+int register_buses(test_t* test)
+{
+	int bus;
+	for(bus = 0; bus < test->num_buses; bus++)
 	{
-		printf("     Starting discharge in %d seconds...", test->cooldown_start_time + test->postcharge_cooldown - cur_time);
-		if(cur_time >= test->cooldown_start_time + test->postcharge_cooldown)
+		int b;
+		if((test->rbuses[bus] = chanreg_bus(test->device_names[bus])) < 0)
+			return -1;
+		for(b = 0; b < bus; b++)
 		{
-			printf("\n");
-			test->cur_meas.start_time = cur_time;
-			test->cur_meas.cumul_ah = 0.0;
-			test->cur_meas.cumul_wh = 0.0;
-
-			if(start_discharge(test) < 0)
+			if(test->rbuses[b] == test->rbuses[bus])
 			{
-				go_fatal(test->fd, "start_discharge failed");
+				printf("ERROR: %s: devices %s and %s are the same device\n", test->name, test->device_names[b], test->device_names[bus]);
+				return -1;
 			}
-			usleep(1000);
 		}
 	}
-	else if(test->cur_mode == MODE_OFF && test->next_mode == MODE_CHARGE)
+	return 0;
+}
+
+int register_channels(test_t* test)
+{
+	int ch;
+	if(register_buses(test))
+		return -1;
+
+	for(ch = 0; ch < test->num_channels; ch++)
 	{
-		printf("    Starting charge in %d seconds...", test->cooldown_start_time + test->postdischarge_cooldown - cur_time);
-		if(cur_time >= test->cooldown_start_time + test->postdischarge_cooldown)
+		channel_t* c = &test->ch[ch];
+		void* other;
+		int other_idx;
+		c->rbus = test->rbuses[c->bus];
+		if(chanreg_claim(c->rbus, c->id, test, ch, &other, &other_idx))
 		{
-			printf("\n");
-			test->cur_meas.start_time = cur_time;
-			test->cur_meas.cumul_ah = 0.0;
-			test->cur_meas.cumul_wh = 0.0;
-
-			if(start_charge(test) < 0)
-			{
-				go_fatal(test->fd, "start_charge failed");
-			}
-			usleep(1000);
+			test_t* o = other;
+			if(o == test)
+				printf("ERROR: %s: channel %u:%u (%u on %s) is given twice (also as %u:%u)\n", test->name, c->bus, c->id, c->id,
+					chanreg_bus_path(c->rbus), o->ch[other_idx].bus, o->ch[other_idx].id);
+			else
+				printf("ERROR: %s: channel %u:%u (%u on %s) is already used by test %s (as %u:%u)\n", test->name, c->bus, c->id, c->id,
+					chanreg_bus_path(c->rbus), o->name, o->ch[other_idx].bus, o->ch[other_idx].id);
+			chanreg_release(test);
+			return -1;
 		}
 	}
-
-	printf("\n\n");
-
+	return 0;
 }
 
 int prepare_test(test_t* test)
 {
 	char buf[200];
 	int ret;
-	int ch;
+	int ch, bus;
 
 	test->cur_mode = MODE_OFF;
-	test->next_mode = test->start_mode;
-	test->cooldown_start_time = -999999; // this forces the test to start
-	if((test->fd = open_device(test->device_name)) < 0)
+	test->program_state = (test->profile_file)?(PROGRAM_DONE):(PROGRAM_WAIT);
+	test->next_mode = (test->profile_file)?(MODE_OFF):(program_peek_mode(test, 0));
+	test->step_start_time = -1; // the program starts PROGRAM_START_DELAY s after the first tick
+	for(bus = 0; bus < test->num_buses; bus++)
 	{
-		printf("Error: open_device returned %d\n", test->fd);
-		return -1;
+		if((test->fds[bus] = open_device(test->device_names[bus])) < 0)
+		{
+			printf("Error: open_device returned %d\n", test->fds[bus]);
+			return -1;
+		}
 	}
+	test->fd = test->fds[0];
 
 	for(ch = 0; ch < test->num_channels; ch++)
 	{
-		uart_flush(test->fd);
-		sprintf(buf, "@%u:OFF;", test->channels[ch]);
-		comm_send(test->fd, buf);
-		if((ret = comm_expect(test->fd, "OFF OK")))
+		channel_t* c = &test->ch[ch];
+		c->fd = test->fds[c->bus];
+		comm_add_channel(c->fd, c->id);
+		uart_flush(c->fd);
+		sprintf(buf, "@%u:OFF;", c->id);
+		comm_send(c->fd, buf);
+		if((ret = comm_expect(c->fd, "OFF OK")))
 		{
 			printf("Test preparation failed; comm_expect for first OFF message returned %d\n", ret);
-			close_device(test->fd);
+			for(bus = 0; bus < test->num_buses; bus++)
+				close_device(test->fds[bus]);
 			return -2;
 		}
 //		usleep(200000); // todo: verify that this indeed is no longer necessary
@@ -1577,10 +5340,398 @@ int prepare_test(test_t* test)
 	return 0;
 }
 
+// Compact one-line status of all tests, printed once per tick.
+void print_status_line(int num_tests, test_t* tests, int cur_time)
+{
+	char buf[4096];
+	int len = 0;
+	int t;
+
+	len += snprintf(buf+len, sizeof(buf)-len, "t=%d", cur_time);
+	if(pack_limit > 0.0 || power_budget > 0.0)
+		len += snprintf(buf+len, sizeof(buf)-len, " pack %+.1fA", pack_net_current());
+	if(pack_capacity > 0.0)
+		len += snprintf(buf+len, sizeof(buf)-len, " pack SoC %.1f%%", pack_soc*100.0);
+	if(pack_vin > 0.0)
+		len += snprintf(buf+len, sizeof(buf)-len, (pack_capacity > 0.0)?(" %.2fV"):(" pack %.2fV"), pack_vin);
+	if(pack_pause != PACK_PAUSE_NONE)
+		len += snprintf(buf+len, sizeof(buf)-len, " (%s paused)", (pack_pause == PACK_PAUSE_CHARGE)?("CHA"):("DSCH"));
+	if(cooldown_saved_total(num_tests, tests) > 0.0)
+		len += snprintf(buf+len, sizeof(buf)-len, " cooldown saved %.1fch-h", cooldown_saved_total(num_tests, tests));
+	for(t = 0; t < num_tests && len < (int)sizeof(buf); t++)
+	{
+		test_t* test = &tests[t];
+		measurement_t* m = &test->cur_meas;
+		int left = cooldown_left(test, cur_time);
+		if(test->finished)
+		{
+			len += snprintf(buf+len, sizeof(buf)-len, " | %s c%u finished", test->name, test->cycle_cnt);
+			continue;
+		}
+		len += snprintf(buf+len, sizeof(buf)-len, " | %s c%u %s %s %.3fV %.2fA %.1fC %.3fAh",
+			test->name, test->cycle_cnt, short_mode_names[m->mode], short_cccv_names[m->cccv],
+			m->voltage, m->current, m->temperature, m->cumul_ah);
+		if(test->soc.capacity > 0.0 && m->soc >= 0.0 && len < (int)sizeof(buf))
+			len += snprintf(buf+len, sizeof(buf)-len, " SoC %.1f%%", m->soc);
+		if(test->safety_tripped && len < (int)sizeof(buf))
+			len += snprintf(buf+len, sizeof(buf)-len, " SAFETY STOP");
+		if(test->derate_scale < 1.0 && len < (int)sizeof(buf))
+			len += snprintf(buf+len, sizeof(buf)-len, " derated %.0f%%", test->derate_scale*100.0);
+		if(test->budget_scale < 1.0 && len < (int)sizeof(buf))
+			len += snprintf(buf+len, sizeof(buf)-len, " throttled %.0f%%", test->budget_scale*100.0);
+		if(test->sched_held && len < (int)sizeof(buf))
+			len += snprintf(buf+len, sizeof(buf)-len, " next %s held", short_mode_names[test->next_mode]);
+		else if(left >= 0 && len < (int)sizeof(buf))
+			len += snprintf(buf+len, sizeof(buf)-len, " next %s in %ds", short_mode_names[test->next_mode], left);
+	}
+	msg(MSGC_STATUS, MSG_INFO, "%s\n", buf);
+}
+
+double run_clock(double start)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9 - start;
+}
+
+// Work faster than the 1 s tick: profile playback and pulse sampling.
+void run_fast(int num_tests, test_t* tests, double now)
+{
+	int t;
+	for(t = 0; t < num_tests; t++)
+	{
+		profile_tick(&tests[t], now);
+		pulse_tick(&tests[t], now);
+	}
+}
+
+// A MEAS reply is about 70 characters, 6 ms at 115200 baud; the next VERB waits
+// that long so that the replies of neighbouring IDs don't collide on the bus.
+#define SCAN_SPACING_US 7000
+
+// Startup scan: every ID on every device of the tests is queried with pipelined
+// VERBs, the replies are routed by the ID they carry, and the responding channels
+// go to the inventory and inventory.log. Test channels that don't answer with a
+// valid measurement are warned about, or stop kakkor with scan=strict.
+int scan_buses(int num_tests, test_t* tests)
+{
+	char cmds[CHANREG_NUM_IDS][16];
+	char* sendbufs[CHANREG_NUM_IDS];
+	static char replies[CHANREG_NUM_IDS][MAX_REPLY_LEN];
+	int rbus, id, i, t;
+	int fail = 0;
+
+	for(id = 0; id < CHANREG_NUM_IDS; id++)
+	{
+		sprintf(cmds[id], "@%u:VERB;", id);
+		sendbufs[id] = cmds[id];
+	}
+
+	FILE* log = fopen("inventory.log", "a");
+	if(log)
+		fprintf(log, "time%sdevice%sid%smode%scc/cv%svoltage%scurrent%stemperature%stest\n",
+			delim,delim,delim,delim,delim,delim,delim,delim);
+
+	for(rbus = 0; rbus < chanreg_num_buses(); rbus++)
+	{
+		char* path = (char*)chanreg_bus_path(rbus);
+		char ids[CHANREG_NUM_IDS*4+1];
+		int len = 0, num_present = 0;
+		int fd = open_device(path);
+		if(fd < 0)
+		{
+			printf("%s: cannot open %s for the bus scan (%d)\n", (scan_on == 2)?("ERROR"):("Warning"), path, fd);
+			if(scan_on == 2)
+				fail = -1;
+			continue;
+		}
+		double start = run_clock(0.0);
+		int n = comm_pipeline(fd, CHANREG_NUM_IDS, sendbufs, replies, CHANREG_NUM_IDS, SCAN_SPACING_US);
+		double ms = run_clock(start) * 1000.0;
+		close_device(fd);
+		if(n < 0)
+		{
+			printf("Note: bus scan not available, skipped\n");
+			break;
+		}
+
+		ids[0] = 0;
+		for(i = 0; i < n; i++)
+		{
+			int off = 0;
+			test_t* owner;
+			int idx;
+			if(sscanf(replies[i], "%d:MEAS %n", &id, &off) < 1 || off == 0 || id < MIN_ID || id > MAX_ID)
+			{
+				msg(MSGC_HW, MSG_WARN, "%s: unexpected reply in the bus scan: %s\n", path, replies[i]);
+				continue;
+			}
+			inventory_t* e = &inventory[rbus][id];
+			e->present = 1;
+			e->garbled = (parse_hw_measurement(&e->meas, replies[i]+off) != 0);
+			num_present++;
+			len += snprintf(ids+len, sizeof(ids)-len, " %d", id);
+			owner = route_reply(rbus, replies[i], &idx);
+			if(log)
+				fprintf(log, "%ld%s%s%s%d%s%s%s%s%s%.3f%s%.3f%s%.1f%s%s\n", (long)time(0), delim, path, delim, id, delim,
+					(e->garbled)?("?"):(short_mode_names[e->meas.mode]), delim, (e->garbled)?("?"):(short_cccv_names[e->meas.cccv]), delim,
+					e->meas.voltage/1000.0, delim, e->meas.current/1000.0, delim, ntc_to_c(e->meas.temperature), delim, (owner)?(owner->name):(""));
+		}
+		printf("Info: scanned %s in %.0f ms: %d channels:%s\n", path, ms, num_present, ids);
+	}
+	if(log)
+		fclose(log);
+	if(fail)
+		return fail;
+	scan_done = 1;
+
+	for(t = 0; t < num_tests; t++)
+	{
+		for(i = 0; i < tests[t].num_channels; i++)
+		{
+			channel_t* c = &tests[t].ch[i];
+			inventory_t* e = &inventory[c->rbus][c->id];
+			if(!e->present)
+			{
+				printf("%s: %s: channel %u:%u doesn't answer on %s\n", (scan_on == 2)?("ERROR"):("Warning"),
+					tests[t].name, c->bus, c->id, chanreg_bus_path(c->rbus));
+				if(scan_on == 2)
+					fail = -1;
+			}
+			else if(e->garbled)
+			{
+				printf("%s: %s: channel %u:%u gives an invalid measurement\n", (scan_on == 2)?("ERROR"):("Warning"),
+					tests[t].name, c->bus, c->id);
+				if(scan_on == 2)
+					fail = -1;
+			}
+			else if(e->meas.mode != MODE_OFF)
+				printf("Warning: %s: channel %u:%u is running (%s); it will be turned off\n", tests[t].name, c->bus, c->id, short_mode_names[e->meas.mode]);
+		}
+	}
+	return fail;
+}
+
+// Largest current (A) a test can ask for, from its charge and discharge settings
+// and step currents, with the resistance pulse compensation; autocurrent= overrides.
+// Constant power and resistance without current= are sized for their starting
+// current at stopvoltage (or voltage).
+double required_current(test_t* test)
+{
+	base_settings_t* modes[2] = {&test->charge, &test->discharge};
+	double need = 0.0;
+	int i;
+
+	if(test->auto_current > 0.0)
+		return test->auto_current;
+
+	for(i = 0; i < 2; i++)
+	{
+		base_settings_t* b = modes[i];
+		double v_est = (b->stop_voltage != 0.0)?(b->stop_voltage):(b->voltage);
+		double c = b->current;
+		if(c == 0.0 && b->const_power_mode && v_est >= 1.0)
+			c = b->power / v_est;
+		else if(c == 0.0 && b->const_resistance_mode && b->load_resistance > 0.0)
+			c = v_est / b->load_resistance;
+		if(c > need)
+			need = c;
+	}
+
+	for(i = 0; i < test->num_step_src; i++)
+	{
+		char* p = test->step_src[i];
+		double c;
+		while((p = strstr(p, ",current=")))
+		{
+			p += strlen(",current=");
+			if(sscanf(p, "%lf", &c) == 1 && fabs(c) > need)
+				need = fabs(c);
+		}
+	}
+
+	if(test->resistance_on && test->resistance_interval > 0 && resistance_base_mul(test) > 1.0)
+		need *= resistance_base_mul(test);
+	return need;
+}
+
+#define CHANNEL_USABLE_CURRENT ((double)(HW_MAX_CURRENT-200)/1000.0) // A, the limit check_params uses
+
+// Picks n channels from the free map of the buses in bus_mask, board by board: a
+// board that fits the rest if there is one (the one with the fewest free channels,
+// leaving whole boards for larger tests), otherwise the one with the most. Returns
+// the number of boards used, -1 if there aren't enough free channels.
+int alloc_pick(int free_map[MAX_TEST_BUSES][MAX_ID+1], int num_buses, int bus_mask, int n, int* bus_out, int* id_out)
+{
+	int num_boards = (MAX_ID + board_channels) / board_channels;
+	int used = 0;
+	int got = 0;
+
+	while(got < n)
+	{
+		int best_bus = -1, best_board = -1, best_free = 0, fits = 0;
+		int b, k, id;
+		for(b = 0; b < num_buses; b++)
+		{
+			if(!(bus_mask & (1<<b)))
+				continue;
+			for(k = 0; k < num_boards; k++)
+			{
+				int cnt = 0;
+				for(id = k*board_channels; id < (k+1)*board_channels && id <= MAX_ID; id++)
+					cnt += free_map[b][id];
+				if(cnt == 0)
+					continue;
+				int f = (cnt >= n - got);
+				if(best_bus < 0 || (f && !fits) || (f && fits && cnt < best_free) || (!f && !fits && cnt > best_free))
+				{
+					best_bus = b;
+					best_board = k;
+					best_free = cnt;
+					fits = f;
+				}
+			}
+		}
+		if(best_bus < 0)
+			return -1;
+		for(id = best_board*board_channels; id < (best_board+1)*board_channels && id <= MAX_ID && got < n; id++)
+		{
+			if(!free_map[best_bus][id])
+				continue;
+			free_map[best_bus][id] = 0;
+			bus_out[got] = best_bus;
+			id_out[got] = id;
+			got++;
+		}
+		used++;
+	}
+	return used;
+}
+
+// channels=auto: sizes the test for its largest current and takes free channels
+// from the scan inventory, on the test's own devices: all on one board if one has
+// room, otherwise on as few boards of one bus as possible, otherwise across buses.
+// The first channel picked is the master. The result is printed and
+// logged in the form of a channels= line, so it can be reused.
+int allocate_channels(test_t* test)
+{
+	int free_map[MAX_TEST_BUSES][MAX_ID+1];
+	int pick_bus[MAX_PARALLEL_CHANNELS], pick_id[MAX_PARALLEL_CHANNELS];
+	int buses[MAX_PARALLEL_CHANNELS], ids[MAX_PARALLEL_CHANNELS];
+	int b, id, i, best = -1, best_boards = 0;
+	char list[MAX_PARALLEL_CHANNELS*8+1];
+	int len = 0;
+
+	if(!scan_done)
+	{
+		printf("ERROR: %s: channels=auto needs the bus scan (scan=on)\n", test->name);
+		return -1;
+	}
+	if(test->num_buses < 1 || test->device_names[0] == NULL)
+	{
+		printf("ERROR: device not defined\n");
+		return -1;
+	}
+	double need = required_current(test);
+	int n = (int)ceil(need / CHANNEL_USABLE_CURRENT - 1e-9);
+	if(n < 1)
+	{
+		printf("ERROR: %s: channels=auto: no current to size the test for; give autocurrent=\n", test->name);
+		return -1;
+	}
+	if(n > MAX_PARALLEL_CHANNELS)
+	{
+		printf("ERROR: %s: channels=auto: %.1f A needs %d channels (max %d)\n", test->name, need, n, MAX_PARALLEL_CHANNELS);
+		return -1;
+	}
+
+	for(b = 0; b < test->num_buses; b++)
+	{
+		for(id = 0; id <= MAX_ID; id++)
+		{
+			inventory_t* e = &inventory[test->rbuses[b]][id];
+			free_map[b][id] = e->present && !e->garbled && e->meas.mode == MODE_OFF && !chanreg_lookup(test->rbuses[b], id, NULL);
+		}
+	}
+
+	// One bus if any has room, the one needing the fewest boards; otherwise all of them.
+	for(b = 0; b <= test->num_buses; b++)
+	{
+		int mask = (b < test->num_buses)?(1<<b):((1<<test->num_buses)-1);
+		int map[MAX_TEST_BUSES][MAX_ID+1];
+		if(b == test->num_buses && best >= 0)
+			break;
+		memcpy(map, free_map, sizeof(map));
+		int boards = alloc_pick(map, test->num_buses, mask, n, buses, ids);
+		if(boards < 0 || (best >= 0 && boards >= best_boards))
+			continue;
+		best = b;
+		best_boards = boards;
+		memcpy(pick_bus, buses, n*sizeof(int));
+		memcpy(pick_id, ids, n*sizeof(int));
+	}
+	if(best < 0)
+	{
+		printf("ERROR: %s: channels=auto: %.1f A needs %d free channels, not enough on its devices\n", test->name, need, n);
+		return -1;
+	}
+
+	channel_t* ch = malloc(n*sizeof(channel_t));
+	if(ch == NULL)
+	{
+		printf("Memory allocation error\n");
+		return -1;
+	}
+	memset(ch, 0, n*sizeof(channel_t));
+	list[0] = 0;
+	for(i = 0; i < n; i++)
+	{
+		ch[i].bus = pick_bus[i];
+		ch[i].id = pick_id[i];
+		if(ch[i].bus == 0)
+			len += snprintf(list+len, sizeof(list)-len, "%s%d", (i)?(","):(""), ch[i].id);
+		else
+			len += snprintf(list+len, sizeof(list)-len, "%s%d:%d", (i)?(","):(""), ch[i].bus, ch[i].id);
+	}
+	free(test->ch);
+	test->ch = ch;
+	test->num_channels = n;
+	test->master_channel_idx = 0;
+
+	printf("Info: %s: channels=auto: %.2f A on %d channel%s, %d board%s: channels=%s masterchannel=%.*s\n", test->name, need, n,
+		(n > 1)?("s"):(""), best_boards, (best_boards > 1)?("s"):(""), list, (int)strcspn(list, ","), list);
+	FILE* log = fopen("inventory.log", "a");
+	if(log)
+	{
+		fprintf(log, "# %ld %s: channels=%s masterchannel=%.*s\n", (long)time(0), test->name, list, (int)strcspn(list, ","), list);
+		fclose(log);
+	}
+	return 0;
+}
+
 void run(int num_tests, test_t* tests)
 {
 	int pc_start_time = (int)(time(0));
 	int prev_time = -1;
+	double clock_start = run_clock(0.0);
+
+	all_tests = tests;
+	num_all_tests = num_tests;
+
+	int t;
+	for(t = 0; t < num_tests; t++)
+		if(tests[t].safety_on)
+			break;
+	if(t < num_tests)
+		safety_start();
+
+	if(pack_limit > 0.0 || power_budget > 0.0 || pack_capacity > 0.0)
+	{
+		pack_log = fopen("pack.log", "a");
+		if(pack_log)
+			fprintf(pack_log, "time%snet W%snet A%sheadroom W%sto cells W%sfrom cells W%sout Wh%sin Wh%scharger W%sSoC%sVin\n",
+				delim,delim,delim,delim,delim,delim,delim,delim,delim,delim);
+	}
 
 	while(1)
 	{
@@ -1590,17 +5741,36 @@ void run(int num_tests, test_t* tests)
 		{
 			usleep(500);
 			cur_time = (int)(time(0))-pc_start_time;
+			run_fast(num_tests, tests, run_clock(clock_start));
 		}
 		while(cur_time == prev_time);
 
 		prev_time = cur_time;
 
-		int t;
+		int num_running = 0;
 		for(t=0; t<num_tests; t++)
 		{
+			if(tests[t].finished)
+				continue;
+			num_running++;
 			update_test(&tests[t], cur_time);
+			// Keep the profiles and pulse sampling running while slow tests are being measured.
+			run_fast(num_tests, tests, run_clock(clock_start));
+		}
+		pack_update(num_tests, tests, cur_time);
+		print_status_line(num_tests, tests, cur_time);
+		msg_flush();
+
+		if(num_running == 0)
+		{
+			for(t = 0; t < num_tests; t++)
+				log_flush_held(&tests[t]);
+			msg(MSGC_GENERAL, MSG_INFO, "All tests finished.\n");
+			if(cooldown_saved_total(num_tests, tests) > 0.0)
+				msg(MSGC_GENERAL, MSG_INFO, "Adaptive cooldown saved %.2f channel-hours in total.\n", cooldown_saved_total(num_tests, tests));
+			msg_flush();
+			return;
 		}
-		printf("\n");
 	}
 
 }
@@ -1636,9 +5806,35 @@ int main(int argc, char** argv)
 		}
 	}
 
+	// Tests with fixed channels claim them first; channels=auto takes what is left
+	// after the scan.
+	for(t = 0; t < num_tests; t++)
+	{
+		if((tests[t].channels_auto)?(register_buses(&tests[t])):(check_params(&tests[t]) || register_channels(&tests[t])))
+		{
+			free(tests);
+			return 1;
+		}
+	}
+
+	if(scan_on && scan_buses(num_tests, tests))
+	{
+		free(tests);
+		return 1;
+	}
+
+	for(t = 0; t < num_tests; t++)
+	{
+		if(tests[t].channels_auto && (allocate_channels(&tests[t]) || check_params(&tests[t]) || register_channels(&tests[t])))
+		{
+			free(tests);
+			return 1;
+		}
+	}
+
 	for(t = 0; t < num_tests; t++)
 	{
-		if(check_params(&tests[t]) || translate_settings(&tests[t]) || prepare_test(&tests[t]) || start_log(&tests[t]))
+		if(translate_settings(&tests[t]) || prepare_test(&tests[t]) || start_log(&tests[t]))
 		{
 			free(tests);
 			return 1;
@@ -1646,7 +5842,15 @@ int main(int argc, char** argv)
 		print_params(&tests[t]);
 	}
 
+	telemetry_open(num_tests);
+	for(t = 0; t < num_tests; t++)
+	{
+		tests[t].telemetry_idx = t;
+		telemetry_set_test_name(t, tests[t].name);
+	}
+
 	run(num_tests, tests);
+	telemetry_close();
 
 	return 0;
 }
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "msg.h"
+
+#define MSG_BUF_LEN 65536
+#define MSG_LINE_LEN 1024
+
+const char* msg_level_names[4] = {"error", "warn", "info", "debug"};
+const char* msg_category_names[MSG_NUM_CATEGORIES] = {"general", "test", "hw", "comm", "status"};
+
+typedef struct
+{
+	double rate;
+	double burst;
+	double tokens;
+	double last_time;
+	long suppressed;
+} msg_bucket_t;
+
+static msg_level_t cur_level = MSG_INFO;
+
+// Defaults: {rate, burst}. Tokens refill to the burst size on first use.
+static msg_bucket_t buckets[MSG_NUM_CATEGORIES] =
+{
+	{0.0, 1.0, 0.0, 0.0, 0},    // general: unlimited
+	{10.0, 50.0, 0.0, 0.0, 0},  // test
+	{10.0, 50.0, 0.0, 0.0, 0},  // hw
+	{5.0, 20.0, 0.0, 0.0, 0},   // comm
+	{0.0, 1.0, 0.0, 0.0, 0},    // status: one line per tick anyway
+};
+
+// msg() may be called from the safety monitor thread too.
+static pthread_mutex_t msg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int nb_fd = -1;
+static char nb_buf[MSG_BUF_LEN];
+static int nb_len = 0;
+static long nb_dropped = 0;
+
+static double mono_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+void msg_set_level(msg_level_t level)
+{
+	cur_level = level;
+}
+
+msg_level_t msg_get_level(void)
+{
+	return cur_level;
+}
+
+void msg_set_rate(msg_category_t cat, double rate, int burst)
+{
+	if(cat < 0 || cat >= MSG_NUM_CATEGORIES)
+		return;
+	buckets[cat].rate = rate;
+	buckets[cat].burst = (burst < 1)?(1):(burst);
+	buckets[cat].tokens = buckets[cat].burst;
+	buckets[cat].last_time = mono_time();
+}
+
+int msg_set_nonblocking(int on)
+{
+	if(!on)
+	{
+		msg_flush();
+		if(nb_fd >= 0)
+			close(nb_fd);
+		nb_fd = -1;
+		return 0;
+	}
+
+	if(nb_fd >= 0)
+		return 0;
+
+	// Reopen stdout instead of dup(): this gives a separate open file description,
+	// so O_NONBLOCK doesn't leak to the plain printf()s using fd 1.
+	nb_fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_APPEND);
+	if(nb_fd < 0)
+	{
+		printf("Warning: cannot open non-blocking stdout (%s), using blocking output\n", strerror(errno));
+		return -1;
+	}
+	fflush(stdout);
+	return 0;
+}
+
+static void flush_locked(void)
+{
+	if(nb_fd < 0 || nb_len == 0)
+		return;
+
+	int ret = write(nb_fd, nb_buf, nb_len);
+	if(ret > 0)
+	{
+		memmove(nb_buf, nb_buf+ret, nb_len-ret);
+		nb_len -= ret;
+	}
+}
+
+void msg_flush(void)
+{
+	pthread_mutex_lock(&msg_lock);
+	flush_locked();
+	pthread_mutex_unlock(&msg_lock);
+}
+
+static void msg_output(const char* str, int len)
+{
+	if(nb_fd < 0)
+	{
+		fwrite(str, 1, len, stdout);
+		fflush(stdout);
+		return;
+	}
+
+	if(nb_dropped && nb_len < MSG_BUF_LEN - 64)
+	{
+		nb_len += snprintf(nb_buf+nb_len, MSG_BUF_LEN-nb_len, "(console too slow, %ld messages dropped)\n", nb_dropped);
+		nb_dropped = 0;
+	}
+
+	if(len > MSG_BUF_LEN - nb_len)
+	{
+		nb_dropped++;
+	}
+	else
+	{
+		memcpy(nb_buf+nb_len, str, len);
+		nb_len += len;
+	}
+
+	flush_locked();
+}
+
+static int msg_allowed(msg_bucket_t* b, msg_level_t level)
+{
+	if(level == MSG_ERROR || b->rate <= 0.0)
+		return 1;
+
+	double now = mono_time();
+	b->tokens += (now - b->last_time) * b->rate;
+	if(b->tokens > b->burst)
+		b->tokens = b->burst;
+	b->last_time = now;
+
+	if(b->tokens >= 1.0)
+	{
+		b->tokens -= 1.0;
+		return 1;
+	}
+	b->suppressed++;
+	return 0;
+}
+
+void msg(msg_category_t cat, msg_level_t level, const char* fmt, ...)
+{
+	char line[MSG_LINE_LEN];
+	int len = 0;
+	va_list args;
+
+	if(level > cur_level || cat < 0 || cat >= MSG_NUM_CATEGORIES)
+		return;
+
+	pthread_mutex_lock(&msg_lock);
+	msg_bucket_t* b = &buckets[cat];
+	if(!msg_allowed(b, level))
+	{
+		pthread_mutex_unlock(&msg_lock);
+		return;
+	}
+
+	if(b->suppressed)
+	{
+		len = snprintf(line, MSG_LINE_LEN, "(%ld %s messages suppressed)\n", b->suppressed, msg_category_names[cat]);
+		b->suppressed = 0;
+	}
+
+	if(level == MSG_ERROR)
+		len += snprintf(line+len, MSG_LINE_LEN-len, "Error: ");
+	else if(level == MSG_WARN)
+		len += snprintf(line+len, MSG_LINE_LEN-len, "Warning: ");
+
+	va_start(args, fmt);
+	int ret = vsnprintf(line+len, MSG_LINE_LEN-len, fmt, args);
+	va_end(args);
+	if(ret >= 0)
+	{
+		len += ret;
+		if(len > MSG_LINE_LEN-1)
+			len = MSG_LINE_LEN-1;
+		msg_output(line, len);
+	}
+	pthread_mutex_unlock(&msg_lock);
+}
+
+int msg_parse_token(char* token)
+{
+	int i;
+	double ftmp;
+	int itmp;
+	char name[32];
+
+	if(strstr(token, "loglevel=") == token)
+	{
+		for(i = 0; i < 4; i++)
+		{
+			if(strcmp(token+strlen("loglevel="), msg_level_names[i]) == 0)
+			{
+				msg_set_level(i);
+				return 1;
+			}
+		}
+		printf("Warning: ignoring unknown loglevel %s\n", token);
+		return 1;
+	}
+	else if(strstr(token, "stdout=nonblock") == token)
+	{
+		msg_set_nonblocking(1);
+		return 1;
+	}
+	else if(strstr(token, "stdout=block") == token)
+	{
+		msg_set_nonblocking(0);
+		return 1;
+	}
+	else if(sscanf(token, "lograte=%31[^,],%lf,%d", name, &ftmp, &itmp) == 3)
+	{
+		for(i = 0; i < MSG_NUM_CATEGORIES; i++)
+		{
+			if(strcmp(name, msg_category_names[i]) == 0)
+			{
+				msg_set_rate(i, ftmp, itmp);
+				return 1;
+			}
+		}
+		printf("Warning: ignoring lograte for unknown category %s\n", name);
+		return 1;
+	}
+	return 0;
+}
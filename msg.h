@@ -0,0 +1,31 @@
+#ifndef __MSG_H
+#define __MSG_H
+
+// Leveled, rate-limited console output.
+//
+// Messages below the configured level are dropped. Each category has a token
+// bucket rate limit; excess messages are counted and reported once output is
+// allowed again. Errors are never rate limited.
+//
+// With the non-blocking sink, output goes through an internal buffer to a
+// non-blocking handle of stdout: if the terminal (ssh, screen) can't keep up,
+// output is dropped instead of stalling the control loop.
+
+typedef enum {MSG_ERROR = 0, MSG_WARN, MSG_INFO, MSG_DEBUG} msg_level_t;
+
+typedef enum {MSGC_GENERAL = 0, MSGC_TEST, MSGC_HW, MSGC_COMM, MSGC_STATUS, MSG_NUM_CATEGORIES} msg_category_t;
+
+void msg(msg_category_t cat, msg_level_t level, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+void msg_set_level(msg_level_t level);
+msg_level_t msg_get_level(void);
+// rate = messages per second, burst = bucket size. rate <= 0 disables the limit.
+void msg_set_rate(msg_category_t cat, double rate, int burst);
+int msg_set_nonblocking(int on);
+// Writes out whatever the non-blocking sink can take without blocking.
+void msg_flush(void);
+
+// Parses loglevel=, lograte= and stdout= tokens. Returns 1 if the token was recognized.
+int msg_parse_token(char* token);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "profile.h"
+
+static int profile_add(profile_t* p, int* alloc, double t, double v)
+{
+	if(p->num_points >= *alloc)
+	{
+		int new_alloc = (*alloc)?((*alloc)*2):(1024);
+		double* new_time = realloc(p->time, new_alloc*sizeof(double));
+		if(new_time == NULL)
+			return -1;
+		p->time = new_time;
+		double* new_value = realloc(p->value, new_alloc*sizeof(double));
+		if(new_value == NULL)
+			return -1;
+		p->value = new_value;
+		*alloc = new_alloc;
+	}
+	p->time[p->num_points] = t;
+	p->value[p->num_points] = v;
+	p->num_points++;
+	return 0;
+}
+
+static int load_text(profile_t* p, FILE* f, int* alloc)
+{
+	char line[256];
+	int line_num = 0;
+	while(fgets(line, sizeof(line), f))
+	{
+		double t, v;
+		char* s = line;
+		line_num++;
+		while(*s == ' ' || *s == '\t')
+			s++;
+		if(*s == '#' || *s == '\n' || *s == '\r' || *s == 0)
+			continue;
+		if(sscanf(s, "%lf%*[;, \t]%lf", &t, &v) != 2)
+		{
+			// Allow one header line
+			if(p->num_points == 0 && line_num == 1)
+				continue;
+			printf("ERROR: profile line %d: cannot parse \"%s\"\n", line_num, line);
+			return -1;
+		}
+		if(profile_add(p, alloc, t, v))
+			return -2;
+	}
+	return 0;
+}
+
+static int load_binary(profile_t* p, FILE* f, int* alloc)
+{
+	uint8_t raw[8];
+	while(fread(raw, 1, 8, f) == 8)
+	{
+		float fv[2];
+		int i;
+		for(i = 0; i < 2; i++)
+		{
+			uint32_t u = raw[i*4] | (raw[i*4+1]<<8) | (raw[i*4+2]<<16) | ((uint32_t)raw[i*4+3]<<24);
+			memcpy(&fv[i], &u, 4);
+		}
+		if(profile_add(p, alloc, fv[0], fv[1]))
+			return -2;
+	}
+	return 0;
+}
+
+int profile_load(profile_t* p, const char* filename)
+{
+	int alloc = 0;
+	int ret;
+	int len = strlen(filename);
+	int binary = (len > 4 && strcmp(filename+len-4, ".bin") == 0);
+
+	memset(p, 0, sizeof(*p));
+
+	FILE* f = fopen(filename, (binary)?("rb"):("r"));
+	if(f == NULL)
+	{
+		printf("ERROR: cannot open profile %s\n", filename);
+		return -1;
+	}
+
+	ret = (binary)?(load_binary(p, f, &alloc)):(load_text(p, f, &alloc));
+	fclose(f);
+	if(ret == -2)
+		printf("ERROR: memory allocation error loading profile %s\n", filename);
+	if(ret)
+	{
+		profile_free(p);
+		return -1;
+	}
+
+	if(p->num_points < 2)
+	{
+		printf("ERROR: profile %s: need at least two points\n", filename);
+		profile_free(p);
+		return -1;
+	}
+
+	int i;
+	for(i = 1; i < p->num_points; i++)
+	{
+		if(p->time[i] <= p->time[i-1])
+		{
+			printf("ERROR: profile %s: time must increase (point %d: %f s)\n", filename, i+1, p->time[i]);
+			profile_free(p);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void profile_free(profile_t* p)
+{
+	free(p->time);
+	free(p->value);
+	memset(p, 0, sizeof(*p));
+}
+
+double profile_duration(profile_t* p)
+{
+	int n = p->num_points;
+	return p->time[n-1] + (p->time[n-1] - p->time[n-2]);
+}
+
+double profile_min(profile_t* p)
+{
+	int i;
+	double min = p->value[0];
+	for(i = 1; i < p->num_points; i++)
+		if(p->value[i] < min)
+			min = p->value[i];
+	return min;
+}
+
+double profile_max(profile_t* p)
+{
+	int i;
+	double max = p->value[0];
+	for(i = 1; i < p->num_points; i++)
+		if(p->value[i] > max)
+			max = p->value[i];
+	return max;
+}
+
+double profile_value(profile_t* p, double t)
+{
+	while(p->cursor < p->num_points-1 && p->time[p->cursor+1] <= t)
+		p->cursor++;
+	return p->value[p->cursor];
+}
+
+void profile_rewind(profile_t* p)
+{
+	p->cursor = 0;
+}
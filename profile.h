@@ -0,0 +1,35 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+// Current or power profile for playback (drive cycles, waveforms).
+//
+// Text files have one "time;value" point per line (',' or whitespace also work,
+// lines starting with '#' are comments). Files ending in .bin are raw
+// little-endian float32 pairs (time, value). Time is in seconds from the start
+// and must increase; each value is held until the next point, and the last one
+// for as long as the interval before it. Positive values charge.
+//
+// Don't include anything here that pulls in sys/types.h; kakkor.c has its own mode_t.
+
+typedef struct
+{
+	int num_points;
+	double* time;
+	double* value;
+	int cursor;     // index of the point in effect at the latest lookup
+} profile_t;
+
+// Returns 0 on success, negative on error (message printed).
+int profile_load(profile_t* p, const char* filename);
+void profile_free(profile_t* p);
+
+double profile_duration(profile_t* p);
+double profile_min(profile_t* p);
+double profile_max(profile_t* p);
+
+// Value at time t (s). Lookups are amortized O(1) for increasing t; call
+// profile_rewind() before going back to the start.
+double profile_value(profile_t* p, double t);
+void profile_rewind(profile_t* p);
+
+#endif
@@ -0,0 +1,59 @@
+#include <stdio.h>
+
+#include "rolling.h"
+
+int rolling_init(rolling_t* r, int n)
+{
+	if(n < 2 || n > ROLLING_MAX)
+	{
+		printf("ERROR: rolling window must be 2 to %d samples\n", ROLLING_MAX);
+		return -1;
+	}
+	r->n = n;
+	rolling_reset(r);
+	return 0;
+}
+
+void rolling_reset(rolling_t* r)
+{
+	r->head = 0;
+	r->count = 0;
+	r->sum_y = 0.0;
+	r->sum_iy = 0.0;
+}
+
+void rolling_add(rolling_t* r, double y)
+{
+	if(r->count < r->n)
+	{
+		r->y[(r->head + r->count) % r->n] = y;
+		r->sum_iy += r->count * y;
+		r->sum_y += y;
+		r->count++;
+		return;
+	}
+
+	// Drop the oldest: every other sample moves one index down.
+	double old = r->y[r->head];
+	r->sum_y -= old;
+	r->sum_iy -= r->sum_y;
+	r->y[r->head] = y;
+	r->head = (r->head + 1) % r->n;
+	r->sum_iy += (r->n - 1) * y;
+	r->sum_y += y;
+}
+
+int rolling_ready(rolling_t* r)
+{
+	return r->count >= r->n;
+}
+
+double rolling_slope(rolling_t* r)
+{
+	double n = r->count;
+	if(r->count < 2)
+		return 0.0;
+	double sum_i = n * (n - 1.0) / 2.0;
+	double sum_ii = (n - 1.0) * n * (2.0*n - 1.0) / 6.0;
+	return (n * r->sum_iy - sum_i * r->sum_y) / (n * sum_ii - sum_i * sum_i);
+}
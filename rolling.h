@@ -0,0 +1,33 @@
+#ifndef __ROLLING_H
+#define __ROLLING_H
+
+// Rolling window estimators for trigger conditions, one sample per tick.
+//
+// The slope is the least squares line through the samples of the window, kept
+// with running sums, so every sample is constant time however long the window is,
+// and a single noisy sample moves it much less than a two point difference.
+//
+// Don't include anything here that pulls in sys/types.h; kakkor.c has its own mode_t.
+
+#define ROLLING_MAX 600
+
+typedef struct
+{
+	int n;                    // window length, samples
+	double y[ROLLING_MAX];    // ring buffer
+	int head;                 // index of the oldest sample
+	int count;                // samples in the window
+	double sum_y;             // sum of y
+	double sum_iy;            // sum of i*y, i = 0 for the oldest sample
+} rolling_t;
+
+// Returns 0 on success, negative if n is out of range (message printed).
+int rolling_init(rolling_t* r, int n);
+void rolling_reset(rolling_t* r);
+void rolling_add(rolling_t* r, double y);
+// The window is full.
+int rolling_ready(rolling_t* r);
+// Slope per sample; 0 until there are two samples.
+double rolling_slope(rolling_t* r);
+
+#endif
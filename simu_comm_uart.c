@@ -11,6 +11,9 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 
+#include "comm_uart.h"
+#include "msg.h"
+
 int cur_fd = 5;
 
 int open_device(char* device)
@@ -30,6 +33,25 @@ void uart_flush(int fd)
 	return;
 }
 
+void comm_add_channel(int fd, int id)
+{
+	return;
+}
+
+// Single threaded input from the console: no locking needed.
+void comm_lock(int fd)
+{
+}
+
+void comm_unlock(int fd)
+{
+}
+
+int comm_timedlock(int fd, int timeout_ms)
+{
+	return 0;
+}
+
 int comm_send(int device_fd, char* buf)
 {
 	printf("        UART_SIMU: tx to fd=%d: %s\n", device_fd, buf);
@@ -50,6 +72,13 @@ int read_reply(int fd, char* outbuf, int maxbytes)
 	return 0;
 }
 
+int read_replies(int fd, char replies[][MAX_REPLY_LEN], int max_replies)
+{
+	if(max_replies < 1 || read_reply(fd, replies[0], MAX_REPLY_LEN))
+		return 0;
+	return 1;
+}
+
 int comm_expect(int fd, char* buf)
 {
 	char readbuf[1000];
@@ -64,12 +93,42 @@ int comm_expect(int fd, char* buf)
 		return -999;
 }
 
+#define MAX_STATS_FDS 256
+comm_stats_t comm_stats[MAX_STATS_FDS];
+
+void comm_get_stats(int fd, comm_stats_t* stats)
+{
+	if(fd < 0 || fd >= MAX_STATS_FDS)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	memcpy(stats, &comm_stats[fd], sizeof(*stats));
+}
+
+int comm_autoretry(int fd, char* sendbuf, char* expect, char* rxbuf);
+
+int comm_batch(int fd, int n, char** sendbufs, char* expect)
+{
+	int i;
+	int fail = 0;
+	for(i = 0; i < n; i++)
+	{
+		if(comm_autoretry(fd, sendbufs[i], expect, NULL))
+			fail = -1;
+	}
+	return fail;
+}
+
 // Sends sendbuf, expects expect, sets the result AFTER expect buffer to rxbuf, returns 0
 // In case of error, autoretries, and returns negative if failure.
 int comm_autoretry(int fd, char* sendbuf, char* expect, char* rxbuf)
 {
 	char readbuf[1000];
+	char reason[1100];
 	int retry = 0;
+	comm_stats_t* stats = &comm_stats[(fd >= 0 && fd < MAX_STATS_FDS)?fd:0];
+	stats->transactions++;
 	while(1)
 	{
 		int ret;
@@ -85,24 +144,37 @@ int comm_autoretry(int fd, char* sendbuf, char* expect, char* rxbuf)
 			}
 			else
 			{
-				printf("comm_autoretry: reply (%s) not as expected (%s) -- ", readbuf, expect);
+				snprintf(reason, sizeof(reason), "reply (%s) not as expected (%s)", readbuf, expect);
 			}
 		}
 		else
 		{
-			printf("comm_autoretry: read_reply returned %d -- ", ret);
+			snprintf(reason, sizeof(reason), "read_reply returned %d", ret);
 		}
 		retry++;
 		uart_flush(fd);
 		if(retry > 5)
 		{
-			printf("out of autoretries, giving up.\n"); 
+			msg(MSGC_COMM, MSG_ERROR, "comm_autoretry: %s -- out of autoretries for %s, giving up.\n", reason, sendbuf);
+			stats->failures++;
 			return -1;
 		}
+		stats->retries++;
 		int sleepy = retry*retry*retry;
-		printf("autoretry #%d after sleeping %d ms...\n", retry, sleepy);
+		msg(MSGC_COMM, MSG_WARN, "comm_autoretry: %s -- autoretry #%d after sleeping %d ms...\n", reason, retry, sleepy);
 		usleep(1000*sleepy);
 	}
 	return -1;
 }
 
+
+// The safety monitor's polls are not simulated.
+int comm_query(int fd, char* sendbuf, char* expect, char* rxbuf, int lock_timeout_ms)
+{
+	return -100;
+}
+
+int comm_pipeline(int fd, int n, char** sendbufs, char replies[][MAX_REPLY_LEN], int max_replies, int spacing_us)
+{
+	return -1;
+}
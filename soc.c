@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "soc.h"
+
+#define SOC_REST_C_RATE 0.01   // currents under C/100 count as rest
+#define SOC_EKF_Q 1e-8         // process noise of soc, per s (counting errors)
+#define SOC_EKF_V_REST 0.005   // measurement noise after a full rest, V
+#define SOC_EKF_V_LOAD 0.02    // measurement noise under load or while relaxing, V (model error)
+#define SOC_P_INIT 0.01        // variance of an initial estimate
+#define SOC_P_SYNC 1e-6        // variance at a full or empty point
+
+int soc_add_ocv_point(soc_est_t* e, double soc, double v)
+{
+	int n = e->num_ocv_points;
+	if(n >= SOC_MAX_OCV_POINTS)
+	{
+		printf("ERROR: too many ocv points (max %d)\n", SOC_MAX_OCV_POINTS);
+		return -1;
+	}
+	if(soc < 0.0 || soc > 1.0 || v < 0.5 || v > 5.0)
+	{
+		printf("ERROR: ocv point %.1f%%, %.3f V out of range\n", soc*100.0, v);
+		return -1;
+	}
+	if(n > 0 && (soc <= e->ocv_soc[n-1] || v <= e->ocv_v[n-1]))
+	{
+		printf("ERROR: ocv points must be given in increasing SoC and voltage\n");
+		return -1;
+	}
+	e->ocv_soc[n] = soc;
+	e->ocv_v[n] = v;
+	e->num_ocv_points++;
+	return 0;
+}
+
+int soc_check(soc_est_t* e)
+{
+	if(e->capacity <= 0.0)
+		return 0;
+	if(e->num_ocv_points == 1)
+	{
+		printf("ERROR: need at least two ocv points\n");
+		return -1;
+	}
+	if(e->filter == SOC_FILTER_EKF && e->num_ocv_points < 2)
+	{
+		printf("ERROR: socfilter=ekf needs the ocv table\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Index of the table segment containing x (clamped to the ends).
+static int segment(double* xs, int n, double x)
+{
+	int i;
+	for(i = 1; i < n-1; i++)
+		if(x < xs[i])
+			break;
+	return i-1;
+}
+
+double soc_ocv(soc_est_t* e, double soc)
+{
+	int i = segment(e->ocv_soc, e->num_ocv_points, soc);
+	double k = (e->ocv_v[i+1] - e->ocv_v[i]) / (e->ocv_soc[i+1] - e->ocv_soc[i]);
+	return e->ocv_v[i] + k * (soc - e->ocv_soc[i]);
+}
+
+static double ocv_slope(soc_est_t* e, double soc)
+{
+	int i = segment(e->ocv_soc, e->num_ocv_points, soc);
+	return (e->ocv_v[i+1] - e->ocv_v[i]) / (e->ocv_soc[i+1] - e->ocv_soc[i]);
+}
+
+double soc_from_ocv(soc_est_t* e, double v)
+{
+	int n = e->num_ocv_points;
+	if(v <= e->ocv_v[0])
+		return e->ocv_soc[0];
+	if(v >= e->ocv_v[n-1])
+		return e->ocv_soc[n-1];
+	int i = segment(e->ocv_v, n, v);
+	double k = (e->ocv_soc[i+1] - e->ocv_soc[i]) / (e->ocv_v[i+1] - e->ocv_v[i]);
+	return e->ocv_soc[i] + k * (v - e->ocv_v[i]);
+}
+
+static double capacity(soc_est_t* e)
+{
+	return (e->capacity_est > 0.0)?(e->capacity_est):(e->capacity);
+}
+
+void soc_count(soc_est_t* e, double ah)
+{
+	if(e->have_full)
+		e->full_ah += ah;
+	if(e->valid)
+		e->soc += ah / capacity(e);
+}
+
+void soc_update(soc_est_t* e, double v, double i, double r, double dt)
+{
+	int have_ocv = (e->num_ocv_points >= 2);
+	int at_rest = (fabs(i) < SOC_REST_C_RATE * e->capacity);
+
+	if(at_rest)
+		e->rest_s += dt;
+	else
+	{
+		e->rest_s = 0.0;
+		e->rest_corrected = 0;
+	}
+	int rested = at_rest && e->rest_s >= e->rest_time;
+
+	if(!e->valid)
+	{
+		if(e->init >= 0.0)
+			e->soc = e->init;
+		else if(have_ocv && at_rest)
+			e->soc = soc_from_ocv(e, v);
+		else
+			return;
+		e->valid = 1;
+		e->p = SOC_P_INIT;
+		return;
+	}
+
+	if(!have_ocv)
+		return;
+
+	if(e->filter == SOC_FILTER_OCV)
+	{
+		if(rested && !e->rest_corrected)
+		{
+			e->soc = soc_from_ocv(e, v);
+			e->rest_corrected = 1;
+		}
+		return;
+	}
+
+	// EKF: the prediction is soc_count(); here the variance grows and the
+	// voltage corrects.
+	e->p += SOC_EKF_Q * dt;
+	if(!at_rest && r <= 0.0)
+		return;
+	double h = ocv_slope(e, e->soc);
+	double v_pred = soc_ocv(e, e->soc) + ((at_rest)?(0.0):(i*r));
+	double noise = (rested)?(SOC_EKF_V_REST):(SOC_EKF_V_LOAD);
+	double k = e->p * h / (h * e->p * h + noise*noise);
+	e->soc += k * (v - v_pred);
+	e->p *= (1.0 - k*h);
+}
+
+void soc_full(soc_est_t* e)
+{
+	e->soc = 1.0;
+	e->p = SOC_P_SYNC;
+	e->valid = 1;
+	e->have_full = 1;
+	e->full_ah = 0.0;
+}
+
+int soc_empty(soc_est_t* e)
+{
+	int measured = 0;
+	if(e->have_full && e->full_ah < 0.0)
+	{
+		e->capacity_est = -e->full_ah;
+		e->soh = e->capacity_est / e->capacity;
+		measured = 1;
+	}
+	e->have_full = 0;
+	e->soc = 0.0;
+	e->p = SOC_P_SYNC;
+	e->valid = 1;
+	return measured;
+}
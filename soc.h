@@ -0,0 +1,63 @@
+#ifndef __SOC_H
+#define __SOC_H
+
+// Online state of charge and state of health estimation for one test.
+//
+// Coulomb counting, corrected from the open circuit voltage table: either
+// once per long enough rest, or continuously with a one-state extended Kalman
+// filter that models the terminal voltage as OCV(SoC) + I*R, with R from the
+// latest DC resistance result. Every update is constant time.
+//
+// SoH is the measured capacity (charge from a full charge down to the
+// discharge stop voltage) divided by the nominal capacity. Once measured, the
+// capacity is also used for counting, so SoC is relative to the actual cell.
+//
+// Don't include anything here that pulls in sys/types.h; kakkor.c has its own mode_t.
+
+#define SOC_MAX_OCV_POINTS 32
+
+typedef enum {SOC_FILTER_OCV = 0, SOC_FILTER_EKF} soc_filter_t;
+
+typedef struct
+{
+	// Settings
+	double capacity;          // nominal, Ah; 0 = estimator off
+	int num_ocv_points;
+	double ocv_soc[SOC_MAX_OCV_POINTS]; // 0..1, increasing
+	double ocv_v[SOC_MAX_OCV_POINTS];
+	soc_filter_t filter;
+	double rest_time;         // s at rest before an OCV correction
+	double init;              // starting SoC 0..1, negative = from OCV or the first full charge
+
+	// State
+	int valid;                // soc is known
+	double soc;               // 0..1
+	double p;                 // EKF: variance of soc
+	double rest_s;            // time at rest so far, s
+	int rest_corrected;
+	int have_full;            // full charge seen; full_ah counts from it
+	double full_ah;           // net Ah since the latest full charge
+	double capacity_est;      // measured capacity, Ah, 0 until measured
+	double soh;               // capacity_est / capacity, 0 until measured
+} soc_est_t;
+
+// Points must be given in increasing SoC (0..1) and voltage. Returns 0 on success.
+int soc_add_ocv_point(soc_est_t* e, double soc, double v);
+// Checks the settings; returns 0 if OK (message printed otherwise).
+int soc_check(soc_est_t* e);
+
+double soc_ocv(soc_est_t* e, double soc);
+double soc_from_ocv(soc_est_t* e, double v);
+
+// Coulomb counting: ah is the charge in (positive) or out (negative) since the last call.
+void soc_count(soc_est_t* e, double ah);
+// Correction, once per tick: v in V, i in A (positive charges), r the latest
+// DC resistance in ohm (0 if none yet), dt the tick length in s.
+void soc_update(soc_est_t* e, double v, double i, double r, double dt);
+// A charge ended on its stop current: the cell is full.
+void soc_full(soc_est_t* e);
+// A discharge ended on its stop voltage: the cell is empty. Measures the capacity
+// if a full charge was seen before; returns 1 if it did.
+int soc_empty(soc_est_t* e);
+
+#endif
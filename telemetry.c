@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+
+static telemetry_shm_t* wr_shm = NULL;
+static size_t wr_size = 0;
+
+static size_t telemetry_size(int num_tests)
+{
+	return sizeof(telemetry_shm_t) + (size_t)num_tests * sizeof(telemetry_test_t);
+}
+
+// Process that wrote an existing segment, if it's still running; 0 if the segment
+// is stale (left by a kakkor that was killed or crashed).
+static pid_t telemetry_live_writer(void)
+{
+	struct stat st;
+	pid_t pid = 0;
+	int fd = shm_open(TELEMETRY_SHM_NAME, O_RDONLY, 0);
+	if(fd < 0)
+		return 0;
+	if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(telemetry_shm_t))
+	{
+		telemetry_shm_t* shm = mmap(NULL, sizeof(telemetry_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+		if(shm != MAP_FAILED)
+		{
+			pid = (pid_t)shm->writer_pid;
+			munmap(shm, sizeof(telemetry_shm_t));
+		}
+	}
+	close(fd);
+	if(pid > 0 && pid != getpid() && (kill(pid, 0) == 0 || errno == EPERM))
+		return pid;
+	return 0;
+}
+
+int telemetry_open(int num_tests)
+{
+	int fd;
+	wr_size = telemetry_size(num_tests);
+
+	fd = shm_open(TELEMETRY_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0 && errno == EEXIST)
+	{
+		// One kakkor per machine publishes; don't take the segment from under a running one.
+		pid_t pid = telemetry_live_writer();
+		if(pid)
+		{
+			printf("Warning: telemetry disabled, kakkor pid %d is already publishing in %s\n", (int)pid, TELEMETRY_SHM_NAME);
+			return -1;
+		}
+		shm_unlink(TELEMETRY_SHM_NAME);
+		fd = shm_open(TELEMETRY_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+	if(fd < 0)
+	{
+		printf("Warning: telemetry disabled, shm_open failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if(ftruncate(fd, wr_size) < 0)
+	{
+		printf("Warning: telemetry disabled, ftruncate failed: %s\n", strerror(errno));
+		close(fd);
+		shm_unlink(TELEMETRY_SHM_NAME);
+		return -1;
+	}
+
+	wr_shm = mmap(NULL, wr_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(wr_shm == MAP_FAILED)
+	{
+		printf("Warning: telemetry disabled, mmap failed: %s\n", strerror(errno));
+		wr_shm = NULL;
+		shm_unlink(TELEMETRY_SHM_NAME);
+		return -1;
+	}
+
+	memset(wr_shm, 0, wr_size);
+	wr_shm->version = TELEMETRY_VERSION;
+	wr_shm->num_tests = num_tests;
+	wr_shm->history_len = TELEMETRY_HISTORY_LEN;
+	wr_shm->max_channels = TELEMETRY_MAX_CHANNELS;
+	wr_shm->sample_size = sizeof(telemetry_sample_t);
+	wr_shm->writer_pid = getpid();
+	// Magic goes last: readers don't trust the header before it's there.
+	__atomic_store_n(&wr_shm->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void telemetry_set_test_name(int test, const char* name)
+{
+	if(!wr_shm || test < 0 || test >= (int)wr_shm->num_tests)
+		return;
+	strncpy(wr_shm->tests[test].name, name, TELEMETRY_NAME_LEN-1);
+}
+
+void telemetry_publish(int test, telemetry_sample_t* sample)
+{
+	if(!wr_shm || test < 0 || test >= (int)wr_shm->num_tests)
+		return;
+
+	telemetry_test_t* t = &wr_shm->tests[test];
+	uint32_t index = t->head;
+	telemetry_slot_t* slot = &t->ring[index % TELEMETRY_HISTORY_LEN];
+	uint32_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->sample, sample, sizeof(telemetry_sample_t));
+	slot->sample.index = index;
+	__atomic_store_n(&slot->seq, seq+2, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&t->head, index+1, __ATOMIC_RELEASE);
+	__atomic_store_n(&wr_shm->heartbeat, (int64_t)time(0), __ATOMIC_RELAXED);
+}
+
+void telemetry_close(void)
+{
+	if(!wr_shm)
+		return;
+	munmap(wr_shm, wr_size);
+	wr_shm = NULL;
+	shm_unlink(TELEMETRY_SHM_NAME);
+}
+
+telemetry_shm_t* telemetry_attach(void)
+{
+	struct stat st;
+	int fd = shm_open(TELEMETRY_SHM_NAME, O_RDONLY, 0);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(telemetry_shm_t))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	telemetry_shm_t* shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED)
+		return NULL;
+
+	if(__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC ||
+	   shm->version != TELEMETRY_VERSION ||
+	   shm->sample_size != sizeof(telemetry_sample_t) ||
+	   (size_t)st.st_size < telemetry_size(shm->num_tests))
+	{
+		munmap(shm, st.st_size);
+		return NULL;
+	}
+
+	return shm;
+}
+
+void telemetry_detach(telemetry_shm_t* shm)
+{
+	if(shm)
+		munmap(shm, telemetry_size(shm->num_tests));
+}
+
+int telemetry_read_sample(telemetry_shm_t* shm, int test, uint32_t index, telemetry_sample_t* out)
+{
+	if(test < 0 || test >= (int)shm->num_tests)
+		return -1;
+
+	telemetry_slot_t* slot = &shm->tests[test].ring[index % TELEMETRY_HISTORY_LEN];
+	int tries;
+	for(tries = 0; tries < 1000; tries++)
+	{
+		uint32_t seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(seq1 & 1)
+			continue;
+		memcpy(out, &slot->sample, sizeof(telemetry_sample_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		uint32_t seq2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		if(seq1 == seq2)
+			return (seq1 != 0 && out->index == index) ? 0 : -1;
+	}
+	return -1;
+}
+
+int telemetry_read_latest(telemetry_shm_t* shm, int test, telemetry_sample_t* out)
+{
+	if(test < 0 || test >= (int)shm->num_tests)
+		return -1;
+
+	int tries;
+	for(tries = 0; tries < 10; tries++)
+	{
+		uint32_t head = __atomic_load_n(&shm->tests[test].head, __ATOMIC_ACQUIRE);
+		if(head == 0)
+			return -1;
+		if(telemetry_read_sample(shm, test, head-1, out) == 0)
+			return 0;
+	}
+	return -1;
+}
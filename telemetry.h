@@ -0,0 +1,107 @@
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include <stdint.h>
+
+// Live telemetry published by kakkor into POSIX shared memory (/dev/shm/kakkor).
+// One kakkor per machine publishes; a second one, started while it runs, doesn't.
+//
+// Layout: telemetry_shm_t header followed by num_tests telemetry_test_t blocks.
+// Each test has a ring of the latest TELEMETRY_HISTORY_LEN samples. Every ring
+// slot is protected by its own sequence counter (seqlock): the writer makes it
+// odd while writing and even when done. Readers map the segment read-only and
+// retry if the counter was odd or changed during their copy, so they never
+// block or slow down the control loop.
+//
+// Don't include anything here that pulls in sys/types.h; kakkor.c has its own mode_t.
+
+#define TELEMETRY_SHM_NAME "/kakkor"
+#define TELEMETRY_MAGIC 0x4b414b4bu
+#define TELEMETRY_VERSION 3
+
+#define TELEMETRY_MAX_CHANNELS 32
+#define TELEMETRY_HISTORY_LEN 256
+#define TELEMETRY_NAME_LEN 64
+
+typedef struct
+{
+	int32_t id;
+	int32_t mode;
+	int32_t cccv;
+	int32_t voltage;          // mV
+	int32_t current;          // mA
+	int32_t temperature;      // raw NTC reading
+	int32_t current_setpoint; // mA
+} telemetry_channel_t;
+
+typedef struct
+{
+	uint32_t index;      // running sample number, slot = index % TELEMETRY_HISTORY_LEN
+	int32_t time;        // seconds since kakkor start
+	int32_t halfcycle_time;
+	int32_t cycle;
+	int32_t mode;        // measured mode (MODE_OFF, MODE_CHARGE, MODE_DISCHARGE)
+	int32_t cccv;
+	int32_t cur_mode;    // commanded mode
+	int32_t next_mode;
+	double voltage;
+	double current;
+	double temperature;
+	double cumul_ah;
+	double cumul_wh;
+	double resistance;
+	double last_resistance; // latest nonzero DC resistance result
+	double soc;             // %, -1 if not estimated (no capacity=) or not known yet
+	double soh;             // %, 0 until the capacity is measured
+	int32_t cooldown_left;  // seconds until the next halfcycle starts, -1 if not cooling down
+	int32_t pad;
+	int64_t comm_transactions;
+	int64_t comm_retries;
+	int64_t comm_failures;
+	int32_t num_channels;
+	telemetry_channel_t ch[TELEMETRY_MAX_CHANNELS];
+} telemetry_sample_t;
+
+typedef struct
+{
+	uint32_t seq;
+	uint32_t pad;
+	telemetry_sample_t sample;
+} telemetry_slot_t;
+
+typedef struct
+{
+	char name[TELEMETRY_NAME_LEN];
+	uint32_t head;       // number of samples written so far
+	uint32_t pad;
+	telemetry_slot_t ring[TELEMETRY_HISTORY_LEN];
+} telemetry_test_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_tests;
+	uint32_t history_len;
+	uint32_t max_channels;
+	uint32_t sample_size;
+	int64_t writer_pid;
+	int64_t heartbeat;   // unix time of the latest publish
+	telemetry_test_t tests[];
+} telemetry_shm_t;
+
+// Writer side (kakkor). Failures only disable telemetry.
+int telemetry_open(int num_tests);
+void telemetry_set_test_name(int test, const char* name);
+void telemetry_publish(int test, telemetry_sample_t* sample);
+void telemetry_close(void);
+
+// Reader side. Returns NULL if kakkor is not publishing.
+telemetry_shm_t* telemetry_attach(void);
+void telemetry_detach(telemetry_shm_t* shm);
+// Copies a consistent snapshot of the latest sample. Returns 0 on success, -1 if no data yet.
+int telemetry_read_latest(telemetry_shm_t* shm, int test, telemetry_sample_t* out);
+// Copies sample number index if it's still in the ring. Returns 0 on success, -1 if overwritten or not written yet.
+int telemetry_read_sample(telemetry_shm_t* shm, int test, uint32_t index, telemetry_sample_t* out);
+
+#endif